@@ -3,38 +3,137 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
-#include <assert.h>
 #include <math.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
-#define STB_DS_IMPLEMENTATION
-#include "stb_ds.h"
+#include "spamclf.h"
+#include "spamclf_internal.h"
 
 // ---------- Configuration ----------
 
-#define SMALL_BUFFER_SIZE 256
-#define BUFFER_SIZE 1024
+#define STOP_WORDS_PATH "dataset/stop-words.txt"
+#define TRAIN_TEST_SPLIT 70   // Percent of data to train. Rest will be used for testing.
 
-#define VOCABULARY_SIZE 8123 // No. of unique tokens in dataset.
+// Default hyperparameters, overridable from the command line.
 #define LEARNING_RATE 0.001
 #define LAMBDA 0.01
 #define EPOCHS 5
-#define TRAIN_TEST_SPLIT 70   // Percent of data to train. Rest will be used for testing.
-
 #define HAM_WEIGHT 0.5774
 #define SPAM_WEIGHT 3.7296
+#define BATCH_SIZE 1
+
+#define SCORE_CHUNK_SIZE (1 << 20) // Bytes of input per batch scoring job.
+#define SCORE_WINDOW_CHUNKS 16     // Chunks per thread held in the reorder buffer.
+#define SCORE_BENCH_SIZE (64 << 20)
+#define INGEST_BATCH 256             // Messages per batch between ingest pipeline stages.
+#define INGEST_BATCHES_PER_THREAD 4  // Batches in flight per tokenizer thread.
+#define RING_SPINS 64                // Failed ring attempts before yielding the CPU.
+#define HASHED_TERM 0x80000000u      // Tags hashed features while the vocabulary grows.
+
+#define CSV_BENCH_SIZE (256 << 20)
+#define INGEST_BENCH_SIZE (16 << 20)
+#define RELOAD_POLL_MS 250          // Interval between checks of a served model file.
+#define STATS_EXPORT_MS 5000        // Interval between rewrites of a metrics file.
+
+#define RING_BENCH_MESSAGES 20000  // Round trips per client in the ring benchmark.
+#define RING_BENCH_PROCESSES 100   // Messages classified by a `-r` process each.
+#define RING_BENCH_WINDOW 256      // Messages in flight in the pipelined ring run.
+#define RELOAD_BENCH_MS 1000       // Length of each phase of the reload benchmark.
+#define RELOAD_BENCH_INTERVAL_MS 10
+#define STATS_BENCH_RECORDS 20000000 // Records per thread in the metrics benchmark.
+#define CACHE_BENCH_MESSAGES 500000  // Lines of the synthetic burst trace.
+#define CACHE_BENCH_CAMPAIGN 20000   // Lines per spam campaign.
+#define CACHE_BENCH_CAMPAIGN_SIZE 16 // Distinct messages per campaign.
+#define CACHE_BENCH_CAMPAIGN_PERCENT 80
+#define CACHE_BENCH_ENTRIES 4096
+#define NEAR_DUP_BENCH_MESSAGES 200000  // Lines of the synthetic campaign trace.
+#define NEAR_DUP_BENCH_CAMPAIGN 10000   // Lines per spam campaign.
+#define NEAR_DUP_BENCH_TEMPLATES 4      // Messages a campaign makes variants of.
+#define NEAR_DUP_BENCH_CAMPAIGN_PERCENT 60
+#define NEAR_DUP_BENCH_ENTRIES 4096
+#define BLOOM_BENCH_PROBES 1000000 // Random tokens probed for the false positive rate.
+#define BLOOM_BENCH_EXTRA_TOKENS (1 << 20)
+#define BLOOM_BENCH_EXTRA_LENGTH 6 // Shortest added token, so that few real words are added.
+#define REGISTRY_BENCH_MODELS 64
+#define REGISTRY_BENCH_KEEP_PERCENT 80    // Share of the base vocabulary each tenant keeps.
+#define REGISTRY_BENCH_PRIVATE_TOKENS 200 // Tokens only one tenant has.
+#define REGISTRY_BENCH_HASH_BITS 12
+#define STRESS_ROUNDS 5            // Passes over the messages per thread in the stress test.
+
+#define EVALUATION_THRESHOLD 0.5f  // Probability above which evaluate() counts spam.
+
+#define BATCH_BLOCK 4096 // Weights per cache block of a mini-batch update (16 KiB).
+#define SYNTHETIC_ROWS 1000000
+#define SYNTHETIC_FEATURES (1 << 15)
+#define SYNTHETIC_TERMS 8
+
+#define CORPUS_MAGIC 0x43505053 // "SPPC"
+#define CORPUS_VERSION 2
+#define TOKENIZER_VERSION 2     // Bump whenever tokenization changes.
+
+typedef struct hyperparams {
+  double learning_rate;
+  double lambda;
+  size_t epochs;
+  float ham_weight;
+  float spam_weight;
+  size_t batch_size;
+} hyperparams;
+
+/*
+ * Candidate values of each hyperparameter (stb_ds arrays). A sweep trains one
+ * model for every combination.
+ */
+typedef struct feature_options {
+  uint32_t flags;     // FEATURE_* streams to extract besides unigrams.
+  uint32_t hash_bits;
+} feature_options;
+
+typedef struct hyperparam_grid {
+  double *learning_rates;
+  double *lambdas;
+  double *epochs;
+  double *ham_weights;
+  double *spam_weights;
+  double *batch_sizes;
+} hyperparam_grid;
+
+typedef struct feature {
+  uint32_t index;
+  float value;
+} feature;
 
 typedef struct item {
-  char *text;
   bool is_spam;
-  float values[VOCABULARY_SIZE];
+  feature *features; // Sparse TF-IDF vector, sorted by index.
 } item;
 
-typedef struct vocabulary_data {
-  size_t index;
-  size_t count;
-} vocabulary_data;
+typedef struct corpus {
+  item *items;
+  size_t feature_count;
+} corpus;
+
+typedef struct metrics {
+  size_t true_positives;
+  size_t false_positives;
+  size_t false_negatives;
+  float precision;
+  float recall;
+  float f1_score;
+} metrics;
 
 // ---------- String functions ----------
 
@@ -51,67 +150,440 @@ char *str_lwr(char *str) {
 }
 
 /*
- * Remove the first n characters from the given string.
+ * Lower case, NUL terminated copy of len bytes of str into the given dynamic
+ * array, which is reused across calls.
  */
-char *str_remove_first_chars(char *str, int n) {
-  char *p = str;
-  int len = strlen(str);
+char *str_lwr_copy(char **out, const char *str, size_t len) {
+  arrsetlen(*out, len + 1);
+  memcpy(*out, str, len);
+  (*out)[len] = '\0';
+  return str_lwr(*out);
+}
+
+// ---------- Utilities ----------
+
+int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Parses a comma separated list of numbers, appending them to the given
+ * dynamic array. Returns false if any element is not a number.
+ */
+bool parse_number_list(const char *str, double **out) {
+  const char *p = str;
+  while (*p) {
+    char *end;
+    double value = strtod(p, &end);
+    if (end == p || (*end != ',' && *end != '\0')) return false;
+    arrput(*out, value);
+    p = *end == ',' ? end + 1 : end;
+  }
+  return true;
+}
+
+bool read_exact(int fd, void *buf, size_t len) {
+  for (size_t done = 0; done < len;) {
+    ssize_t n = read(fd, (char *)buf + done, len - done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+bool write_exact(int fd, const void *buf, size_t len) {
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write(fd, (const char *)buf + done, len - done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+/*
+ * Monotonic wall clock time in seconds.
+ */
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-  if (n < len) {
-    memmove(p, p + n, len - n + 1);
+/*
+ * Exits with a message if a library call failed.
+ */
+void check_status(spamclf_status status, const char *what) {
+  if (status == SPAMCLF_OK) return;
+  if (status == SPAMCLF_ERROR_MEMORY) {
+    printf("Memory allocation failed.\n");
+  } else if (status == SPAMCLF_ERROR_IO) {
+    perror(what);
   } else {
-    *p = '\0';
+    fprintf(stderr, "%s: %s.\n", what, spamclf_strerror(status));
   }
-  return str;
+  exit(EXIT_FAILURE);
 }
 
-// ---------- NLP ----------
+// ---------- Thread pool ----------
+
+typedef struct thread_pool {
+  size_t n;
+  atomic_size_t next;
+  void (*fn)(void *ctx, size_t i);
+  void *ctx;
+} thread_pool;
+
+void *thread_pool_worker(void *arg) {
+  thread_pool *pool = arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&pool->next, 1)) < pool->n) {
+    pool->fn(pool->ctx, i);
+  }
+  return NULL;
+}
 
 /*
- * Loads the list of stop words in English into the given dynamic array.
+ * Runs fn(ctx, i) for every i in [0, n) on the given number of threads.
+ * Workers keep claiming the next job index until none are left, so long and
+ * short jobs balance out.
  */
-void get_stop_words(char ***words) {
-  FILE *file;
-  char buf[SMALL_BUFFER_SIZE];
+void parallel_for(size_t n, size_t threads, void (*fn)(void *ctx, size_t i), void *ctx) {
+  thread_pool pool = { .n = n, .fn = fn, .ctx = ctx };
+  atomic_init(&pool.next, 0);
 
-  file = fopen("dataset/stop-words.txt", "r");
-  if (file == NULL) {
-    perror("Error opening file");
-    exit(1);
+  if (threads > n) threads = n;
+  if (threads <= 1) {
+    thread_pool_worker(&pool);
+    return;
   }
 
-  while (fgets(buf, SMALL_BUFFER_SIZE, file) != NULL) {
-    buf[strcspn(buf, "\r\n")] = '\0'; // Remove newline or carriage return
-    arrput(*words, strdup(buf));     // Add a copy of the string to the dynamic array
+  pthread_t *workers = SPAM_MALLOC(threads * sizeof(pthread_t));
+  if (workers == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
   }
+  for (size_t t = 0; t < threads; ++t) {
+    if (pthread_create(&workers[t], NULL, thread_pool_worker, &pool) != 0) {
+      perror("Failed to create thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (size_t t = 0; t < threads; ++t) {
+    pthread_join(workers[t], NULL);
+  }
+  SPAM_FREE(workers);
+}
 
-  fclose(file);
+/*
+ * Work-stealing variant of parallel_for for jobs of uneven cost. Every worker
+ * owns a deque holding a contiguous range of job indices, packed as
+ * begin | end << 32 into one atomic word. The owner takes jobs from the front
+ * and an idle worker steals the back half of another worker's range, so the
+ * owners keep walking their ranges in order.
+ */
+typedef struct steal_deque {
+  _Alignas(64) _Atomic uint64_t range;
+} steal_deque;
+
+typedef struct steal_pool {
+  size_t threads;
+  size_t base;
+  steal_deque *deques;
+  void (*fn)(void *ctx, size_t i);
+  void *ctx;
+} steal_pool;
+
+typedef struct steal_worker_arg {
+  steal_pool *pool;
+  size_t id;
+} steal_worker_arg;
+
+uint64_t steal_range(uint32_t begin, uint32_t end) {
+  return (uint64_t)end << 32 | begin;
+}
+
+void *steal_worker(void *arg) {
+  steal_pool *pool = ((steal_worker_arg *)arg)->pool;
+  size_t id = ((steal_worker_arg *)arg)->id;
+  steal_deque *own = &pool->deques[id];
+
+  for (;;) {
+    uint64_t range = atomic_load(&own->range);
+    uint32_t begin = (uint32_t)range, end = range >> 32;
+    if (begin < end) {
+      if (atomic_compare_exchange_weak(&own->range, &range, steal_range(begin + 1, end))) {
+        pool->fn(pool->ctx, pool->base + begin);
+      }
+      continue;
+    }
+
+    bool stolen = false;
+    for (size_t v = 1; v < pool->threads && !stolen; ++v) {
+      steal_deque *victim = &pool->deques[(id + v) % pool->threads];
+      range = atomic_load(&victim->range);
+      begin = (uint32_t)range, end = range >> 32;
+      while (begin < end) {
+        uint32_t half = end - (end - begin) / 2;
+        if (half == end) half = begin;
+        if (atomic_compare_exchange_weak(&victim->range, &range, steal_range(begin, half))) {
+          atomic_store(&own->range, steal_range(half, end));
+          stolen = true;
+          break;
+        }
+        begin = (uint32_t)range, end = range >> 32;
+      }
+    }
+    if (!stolen) return NULL;
+  }
 }
 
 /*
- * Checks whether the word is a valid token. The word should be of length 3-12
- * and should not be a stop word.
+ * Runs fn(ctx, i) for every i in [begin, end) on the given number of threads,
+ * starting each worker on an equal contiguous share.
  */
-bool accept_string(char ***stop_words, char *str) {
-  size_t str_len = strlen(str);
-  if (str_len < 3 || str_len > 12) return false;
+void steal_for(size_t begin, size_t end, size_t threads, void (*fn)(void *ctx, size_t i), void *ctx) {
+  size_t n = end - begin;
+  if (threads > n) threads = n;
+  if (threads == 0) return;
 
-  for (size_t i = 0; i < arrlenu(*stop_words); ++i) {
-    if (strcmp((*stop_words)[i], str) == 0) {
-      return false;
+  steal_pool pool = { .threads = threads, .base = begin, .fn = fn, .ctx = ctx };
+  char *deques = SPAM_MALLOC((threads + 1) * sizeof(steal_deque));
+  pool.deques = (steal_deque *)(((uintptr_t)deques + 63) & ~(uintptr_t)63);
+  pthread_t *workers = SPAM_MALLOC(threads * sizeof(pthread_t));
+  steal_worker_arg *args = SPAM_MALLOC(threads * sizeof(steal_worker_arg));
+  if (deques == NULL || workers == NULL || args == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t t = 0; t < threads; ++t) {
+    atomic_init(&pool.deques[t].range, steal_range(t * n / threads, (t + 1) * n / threads));
+    args[t].pool = &pool;
+    args[t].id = t;
+  }
+
+  for (size_t t = 1; t < threads; ++t) {
+    if (pthread_create(&workers[t], NULL, steal_worker, &args[t]) != 0) {
+      perror("Failed to create thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  steal_worker(&args[0]);
+  for (size_t t = 1; t < threads; ++t) {
+    pthread_join(workers[t], NULL);
+  }
+  SPAM_FREE(args);
+  SPAM_FREE(workers);
+  SPAM_FREE(deques);
+}
+
+/*
+ * Number of threads to use when none is given.
+ */
+size_t default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+}
+
+// ---------- CSV ----------
+
+/*
+ * Streaming RFC 4180 parser over a buffer, usually a mapped file. Fields are
+ * returned as views into the buffer, so nothing is copied or allocated,
+ * except for quoted fields holding escaped quotes (""), which are unescaped
+ * into a scratch array that is reused for every such field. Records end with
+ * LF or CRLF, and quoted fields may hold commas and line breaks. Unquoted
+ * fields are found with memchr() for the end of the line and the next comma,
+ * and quoted ones with memchr() for the next quote.
+ */
+typedef struct csv_parser {
+  const char *p;         // Next byte to parse.
+  const char *end;
+  const char *line_end;  // Next '\n' at or after p (or end), NULL if unknown.
+  char *scratch;         // Last unescaped quoted field (stb_ds array).
+} csv_parser;
+
+void csv_init(csv_parser *csv, const char *data, size_t size) {
+  csv->p = data;
+  csv->end = data + size;
+  csv->line_end = NULL;
+  csv->scratch = NULL;
+}
+
+void csv_free(csv_parser *csv) {
+  arrfree(csv->scratch);
+}
+
+/*
+ * Parses the next field. The view stays valid until the next call, and last
+ * is set if the field ends its record. Returns false at the end of the input.
+ * Text between a closing quote and the next delimiter is kept, and a quoted
+ * field left open runs to the end of the input.
+ */
+bool csv_field(csv_parser *csv, const char **field, size_t *len, bool *last) {
+  const char *p = csv->p;
+  const char *end = csv->end;
+  if (p >= end) return false;
+
+  if (*p != '"') {
+    if (csv->line_end == NULL || csv->line_end < p) {
+      csv->line_end = memchr(p, '\n', end - p);
+      if (csv->line_end == NULL) csv->line_end = end;
+    }
+    const char *stop = memchr(p, ',', csv->line_end - p);
+    *last = stop == NULL;
+    if (stop == NULL) stop = csv->line_end;
+    *field = p;
+    *len = stop - p;
+    if (*last && *len > 0 && p[*len - 1] == '\r') --*len;
+    csv->p = stop < end ? stop + 1 : end;
+    return true;
+  }
+
+  bool copied = false;
+  const char *start = p + 1;
+  const char *quote;
+  for (;;) {
+    quote = memchr(start, '"', end - start);
+    if (quote == NULL) quote = end;
+    if (quote + 1 >= end || quote[1] != '"') break;
+    if (!copied) arrsetlen(csv->scratch, 0);
+    copied = true;
+    memcpy(arraddnptr(csv->scratch, quote + 1 - start), start, quote + 1 - start);
+    start = quote + 2;
+  }
+
+  const char *tail = quote < end ? quote + 1 : end;
+  const char *stop = tail;
+  while (stop < end && *stop != ',' && *stop != '\n') ++stop;
+  const char *tail_end = stop;
+  if (stop < end && *stop == '\n' && tail_end > tail && tail_end[-1] == '\r') --tail_end;
+  if (copied || tail_end > tail) {
+    if (!copied) arrsetlen(csv->scratch, 0);
+    memcpy(arraddnptr(csv->scratch, quote - start), start, quote - start);
+    memcpy(arraddnptr(csv->scratch, tail_end - tail), tail, tail_end - tail);
+    *field = csv->scratch;
+    *len = arrlenu(csv->scratch);
+  } else {
+    *field = start;
+    *len = quote - start;
+  }
+  *last = stop >= end || *stop == '\n';
+  csv->p = stop < end ? stop + 1 : end;
+  csv->line_end = NULL;
+  return true;
+}
+
+/*
+ * Skips the rest of the current record.
+ */
+void csv_skip_record(csv_parser *csv) {
+  bool quoted = false;
+  const char *p = csv->p;
+  while (p < csv->end) {
+    char c = *p++;
+    if (c == '"') {
+      quoted = !quoted;
+    } else if (c == '\n' && !quoted) {
+      break;
     }
   }
+  csv->p = p;
+  csv->line_end = NULL;
+}
+
+/*
+ * Labelled messages of a dataset: a CSV file with a header row and the
+ * columns label ("ham" or "spam") and message. Further columns are ignored.
+ * The file is mapped and parsed in place, so messages can be of any length.
+ */
+typedef struct dataset_reader {
+  const char *path;
+  const char *data;
+  size_t size;
+  size_t record;  // No. of records read, including the header.
+  csv_parser csv;
+} dataset_reader;
+
+void open_dataset(dataset_reader *r, const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror("Error opening file");
+    exit(1);
+  }
+  r->path = path;
+  r->size = st.st_size;
+  r->data = r->size > 0 ? mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (r->data == MAP_FAILED) {
+    perror("Failed to map file");
+    exit(1);
+  }
+  if (r->size > 0) madvise((void *)r->data, r->size, MADV_SEQUENTIAL);
+  csv_init(&r->csv, r->data, r->size);
+  csv_skip_record(&r->csv);
+  r->record = 1;
+}
+
+/*
+ * Reads the next message. text stays valid until the next call. Returns false
+ * at the end of the dataset, and exits on a record without a valid label.
+ */
+bool next_message(dataset_reader *r, bool *is_spam, const char **text, size_t *len) {
+  const char *label;
+  size_t label_len;
+  bool last;
+  do {
+    if (!csv_field(&r->csv, &label, &label_len, &last)) return false;
+    r->record++;
+  } while (last && label_len == 0); // Blank line.
+
+  if (label_len == 3 && memcmp(label, "ham", 3) == 0) {
+    *is_spam = false;
+  } else if (label_len == 4 && memcmp(label, "spam", 4) == 0) {
+    *is_spam = true;
+  } else {
+    fprintf(stderr, "Error: %s: record %zu should start with ham or spam.\n", r->path, r->record);
+    exit(1);
+  }
+  if (last || !csv_field(&r->csv, text, len, &last)) {
+    fprintf(stderr, "Error: %s: record %zu has no message.\n", r->path, r->record);
+    exit(1);
+  }
+  if (!last) csv_skip_record(&r->csv);
   return true;
 }
 
+void close_dataset(dataset_reader *r) {
+  csv_free(&r->csv);
+  if (r->size > 0) munmap((void *)r->data, r->size);
+}
+
+// ---------- NLP ----------
+
+/*
+ * Loads the list of stop words in English into the given dynamic array.
+ */
+void get_stop_words(char ***words) {
+  check_status(read_stop_words(STOP_WORDS_PATH, words), "Error opening file");
+}
+
 /*
  * This macro extracts token word from raw input string and allows you to
- * perform action for each word.
+ * perform action for each word. Words are cut at BUFFER_SIZE - 1 characters,
+ * far beyond the longest accepted token, so input of any length is read.
  */
 #define extract_token_words(input, stop_words, body) do {               \
     char buf[BUFFER_SIZE];                                              \
     size_t extract_token_words_j = 0;                                   \
-    for (size_t extract_token_words_i = 0; extract_token_words_i < strlen(input) && extract_token_words_j < BUFFER_SIZE - 1; ++extract_token_words_i) { \
+    size_t extract_token_words_len = strlen(input);                     \
+    for (size_t extract_token_words_i = 0; extract_token_words_i < extract_token_words_len; ++extract_token_words_i) { \
       switch(input[extract_token_words_i]) {                            \
       case '.':                                                         \
       case ',':                                                         \
@@ -131,7 +603,9 @@ bool accept_string(char ***stop_words, char *str) {
         extract_token_words_j = 0;                                      \
         break;                                                          \
       default:                                                          \
-        if (!isdigit(input[extract_token_words_i]) && input[extract_token_words_i] != input[extract_token_words_i - 1]) \
+        if (!isdigit((unsigned char)input[extract_token_words_i]) &&    \
+            (extract_token_words_i == 0 || input[extract_token_words_i] != input[extract_token_words_i - 1]) && \
+            extract_token_words_j < BUFFER_SIZE - 1)                    \
           buf[extract_token_words_j++] = input[extract_token_words_i];  \
         break;                                                          \
       }                                                                 \
@@ -142,370 +616,3808 @@ bool accept_string(char ***stop_words, char *str) {
     }                                                                   \
   } while(0)
 
+/*
+ * This macro extracts the character n-grams (CHAR_NGRAM_MIN to CHAR_NGRAM_MAX
+ * characters) of the input in a single pass and runs body for each, with
+ * char_ngram_bucket set to its bucket in a space of 2^hash_bits. Every n-gram
+ * length keeps a polynomial rolling hash of its window, so nothing is copied
+ * or allocated per n-gram.
+ */
+#define extract_char_ngrams(input, len, hash_bits, body) do {            \
+    uint64_t char_ngram_hash[CHAR_NGRAM_MAX + 1] = {0};                 \
+    uint64_t char_ngram_power[CHAR_NGRAM_MAX + 1];                      \
+    char_ngram_power[0] = 1;                                            \
+    for (size_t char_ngram_n = 1; char_ngram_n <= CHAR_NGRAM_MAX; ++char_ngram_n) \
+      char_ngram_power[char_ngram_n] = char_ngram_power[char_ngram_n - 1] * 0x100000001b3ULL; \
+    for (size_t char_ngram_i = 0; char_ngram_i < (len); ++char_ngram_i) { \
+      uint64_t char_ngram_in = (unsigned char)(input)[char_ngram_i] + 1; \
+      for (size_t char_ngram_n = CHAR_NGRAM_MIN; char_ngram_n <= CHAR_NGRAM_MAX; ++char_ngram_n) { \
+        char_ngram_hash[char_ngram_n] = char_ngram_hash[char_ngram_n] * 0x100000001b3ULL + char_ngram_in; \
+        if (char_ngram_i >= char_ngram_n) {                             \
+          char_ngram_hash[char_ngram_n] -= ((unsigned char)(input)[char_ngram_i - char_ngram_n] + 1) \
+            * char_ngram_power[char_ngram_n];                           \
+        }                                                               \
+        if (char_ngram_i + 1 >= char_ngram_n) {                         \
+          size_t char_ngram_bucket =                                    \
+            mix64(char_ngram_hash[char_ngram_n] ^ (CHAR_NGRAM_SEED * char_ngram_n)) >> (64 - (hash_bits)); \
+          body;                                                         \
+        }                                                               \
+      }                                                                 \
+    }                                                                   \
+  } while(0)
+
 // ---------- Main program  ----------
 
-typedef struct model {
-  float weights[VOCABULARY_SIZE];
-  float bias;
-  float idf[VOCABULARY_SIZE];
-  char vocabulary[VOCABULARY_SIZE][16];
-} model;
+void load_model(model *m, const char *path) {
+  check_status(read_model(m, path), path);
+}
+
+void dump_model(model *m, const char *path) {
+  check_status(write_model(m, path), "Failed to write model");
+  printf("Model saved to %s\n", path);
+}
+
+void print_help(char *prog) {
+  printf("Usage: %s [OPTION]...\n", prog);
+  printf("Train spam message detechtion machine learning model\n");
+  printf("Example: %s -t -o model.bin\n", prog);
+
+  printf("\nModel training:\n");
+  printf("  -t, --train     Train the machine learning model.\n");
+  printf("  -o, --output    Output file path where the model has to be stored.\n");
+  printf("  -d, --dataset   Path to dataset file.\n");
+  printf("  --cache         Corpus cache file. Runs on the same dataset and tokenizer\n");
+  printf("                  settings load the tokenized corpus from it.\n");
+  printf("  -k, --kfold     Run K-fold cross-validation with the given K.\n");
+  printf("  -s, --sweep     Train one model per combination of the hyperparameter\n");
+  printf("                  lists below and rank them by F1-Score.\n");
+  printf("  -j, --threads   Number of worker threads for the sweep and of tokenizer\n");
+  printf("                  threads reading the dataset.\n");
+  printf("  --bigrams       Add word bigram features, hashed into 2^BITS buckets\n");
+  printf("                  (optional argument, default %d).\n", HASH_BITS);
+  printf("  --char-ngrams   Add character %d-%d-gram features, hashed into the same\n",
+         CHAR_NGRAM_MIN, CHAR_NGRAM_MAX);
+  printf("                  buckets (optional BITS argument as for --bigrams).\n");
+
+  printf("\nHyperparameters (comma separated lists when sweeping):\n");
+  printf("  --learning-rate Learning rate (default %g).\n", LEARNING_RATE);
+  printf("  --lambda        L2 regularization strength (default %g).\n", LAMBDA);
+  printf("  --epochs        Number of passes over the training data (default %d).\n", EPOCHS);
+  printf("  --ham-weight    Loss weight of ham messages (default %g).\n", HAM_WEIGHT);
+  printf("  --spam-weight   Loss weight of spam messages (default %g).\n", SPAM_WEIGHT);
+  printf("  --batch-size    Messages per mini-batch update (default %d).\n", BATCH_SIZE);
+  printf("  --exact-sigmoid Train with expf() instead of the approximate sigmoid.\n");
+
+  printf("\nUpdate model:\n");
+  printf("  -u, --update    Continue training the given model on the messages in\n");
+  printf("                  --dataset and save it back in place.\n");
+
+  printf("\nRun model:\n");
+  printf("  -r, --run       Run pre-trained model.\n");
+  printf("  -m, --model     Path to model file.\n");
+  printf("  -i, --input     Input string for the model.\n");
+  printf("  --score         Score every line of the given file on --threads threads\n");
+  printf("                  and print \"spam|ham<TAB>probability\" lines in order.\n");
+  printf("                  Given comma separated models, their vocabularies are\n");
+  printf("                  shared and each line has one such pair per model.\n");
+  printf("  --serve         Classify messages of local clients through the given\n");
+  printf("                  shared memory ring (default /spamclf, see spamclf.h)\n");
+  printf("                  until interrupted. The model is reloaded on SIGHUP or\n");
+  printf("                  when its file changes.\n");
+  printf("  --result-cache  Cache the scores of up to the given number of distinct\n");
+  printf("                  messages for --score and --serve, so repeated messages\n");
+  printf("                  are not classified again.\n");
+  printf("  --near-dups     Reuse the score of one of the given number of recent\n");
+  printf("                  messages for --score and --serve when their tokens'\n");
+  printf("                  SimHash is within %d bits, for variants of a campaign.\n",
+         NEAR_DUP_DISTANCE);
+  printf("  --metrics       Export latency and counters of --serve in the Prometheus\n");
+  printf("                  text format to the given file, rewritten every %ds, or\n",
+         STATS_EXPORT_MS / 1000);
+  printf("                  to HTTP requests on a Unix socket given as unix:PATH.\n");
+
+  printf("\nBenchmarks:\n");
+  printf("  -b, --bench     Run the named benchmark on --dataset: features, lookup,\n");
+  printf("                  kernels, batch, batch-synthetic, sigmoid, score, alloc, stress,\n");
+  printf("                  csv, ingest, ring, reload, metrics, cache, neardup,\n");
+  printf("                  bloom, registry.\n");
+}
+
+/*
+ * Sorts the given feature indices and appends one (index, count) feature per
+ * distinct index to out.
+ */
+void append_term_counts(feature **out, uint32_t *terms) {
+  qsort(terms, arrlenu(terms), sizeof(*terms), compare_u32);
+  for (size_t i = 0; i < arrlenu(terms); ++i) {
+    if (i > 0 && terms[i] == terms[i - 1]) {
+      arrlast(*out).value += 1.0f;
+    } else {
+      feature f = { terms[i], 1.0f };
+      arrput(*out, f);
+    }
+  }
+}
+
+/*
+ * Sorts the given feature indices and appends one (index, count / total)
+ * feature per distinct index to out.
+ */
+void append_term_frequencies(feature **out, uint32_t *terms, size_t total) {
+  size_t first = arrlenu(*out);
+  append_term_counts(out, terms);
+  for (size_t i = first; i < arrlenu(*out); ++i) {
+    (*out)[i].value /= (float)total;
+  }
+}
+
+/*
+ * Merges two feature vectors sorted by index, adding the values of features
+ * present in both. Frees both inputs.
+ */
+feature *merge_features(feature *a, feature *b) {
+  if (arrlenu(b) == 0) {
+    arrfree(b);
+    return a;
+  }
+  feature *out = NULL;
+  size_t i = 0, j = 0;
+  while (i < arrlenu(a) || j < arrlenu(b)) {
+    if (j == arrlenu(b) || (i < arrlenu(a) && a[i].index < b[j].index)) {
+      arrput(out, a[i++]);
+    } else if (i == arrlenu(a) || b[j].index < a[i].index) {
+      arrput(out, b[j++]);
+    } else {
+      feature f = { a[i].index, a[i].value + b[j].value };
+      arrput(out, f);
+      ++i, ++j;
+    }
+  }
+  arrfree(a);
+  arrfree(b);
+  return out;
+}
+
+// ---------- Ingest pipeline ----------
+
+/*
+ * The dataset is ingested in batches of INGEST_BATCH messages by three
+ * stages:
+ *
+ *   reader      parses the mapped CSV file into message views (one thread)
+ *   tokenizers  lowercase and tokenize messages and count character n-grams
+ *               (-j threads)
+ *   merger      assigns vocabulary indices in dataset order and builds the
+ *               corpus items (the calling thread)
+ *
+ * Batch i goes to tokenizer i % N and the merger takes them back in the same
+ * order, so the corpus and vocabulary are identical to a sequential run.
+ * Batches cycle through single producer, single consumer rings: reader to
+ * each tokenizer, each tokenizer to the merger, and the merger hands them back
+ * to the reader. Only a fixed pool of batches exists, so the reader stalls
+ * once the later stages fall behind, bounding memory use.
+ */
+size_t ingest_threads = 1; // Tokenizer threads, set by -j.
+
+typedef struct spsc_ring {
+  _Alignas(64) atomic_size_t head;  // Next slot to read, written by the consumer.
+  _Alignas(64) atomic_size_t tail;  // Next slot to write, written by the producer.
+  _Alignas(64) void **slots;
+  size_t mask;
+} spsc_ring;
+
+bool ring_try_push(spsc_ring *r, void *item) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&r->head, memory_order_acquire) > r->mask) return false;
+  r->slots[tail & r->mask] = item;
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+bool ring_try_pop(spsc_ring *r, void **item) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  if (atomic_load_explicit(&r->tail, memory_order_acquire) == head) return false;
+  *item = r->slots[head & r->mask];
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  return true;
+}
+
+/*
+ * Blocking push and pop. They spin for RING_SPINS attempts, then yield the
+ * CPU between attempts, and return the time spent waiting.
+ */
+double ring_push(spsc_ring *r, void *item) {
+  if (ring_try_push(r, item)) return 0.0;
+  double start = now_seconds();
+  for (size_t spins = 0; !ring_try_push(r, item); ++spins) {
+    if (spins >= RING_SPINS) sched_yield();
+  }
+  return now_seconds() - start;
+}
+
+double ring_pop(spsc_ring *r, void **item) {
+  if (ring_try_pop(r, item)) return 0.0;
+  double start = now_seconds();
+  for (size_t spins = 0; !ring_try_pop(r, item); ++spins) {
+    if (spins >= RING_SPINS) sched_yield();
+  }
+  return now_seconds() - start;
+}
+
+typedef struct ingest_message {
+  bool is_spam;
+  bool copied;        // Text is in the batch's copies rather than the mapping.
+  size_t offset;
+  size_t len;
+  size_t tokens_end;  // End of the message's tokens in token_hashes.
+  size_t char_end;    // End of its character n-gram counts in char_counts.
+  size_t char_total;  // No. of character n-grams.
+} ingest_message;
+
+typedef struct ingest_batch {
+  ingest_message *messages;
+  char *copies;             // Messages unescaped by the CSV parser.
+  uint64_t *token_hashes;   // Accepted tokens of all messages, in order.
+  uint32_t *token_offsets;  // Their offsets in token_pool.
+  char *token_pool;
+  feature *char_counts;     // Character n-gram (bucket, count) of all messages.
+  char *text;               // Tokenizer scratch.
+  uint32_t *terms;
+} ingest_batch;
+
+void free_ingest_batch(ingest_batch *b) {
+  arrfree(b->messages);
+  arrfree(b->copies);
+  arrfree(b->token_hashes);
+  arrfree(b->token_offsets);
+  arrfree(b->token_pool);
+  arrfree(b->char_counts);
+  arrfree(b->text);
+  arrfree(b->terms);
+}
+
+/*
+ * Reader stage: fills the batch with up to INGEST_BATCH messages. Returns
+ * false once the dataset is exhausted and the batch is empty.
+ */
+bool read_batch(dataset_reader *r, ingest_batch *b) {
+  arrsetlen(b->messages, 0);
+  arrsetlen(b->copies, 0);
+  bool is_spam;
+  const char *text;
+  size_t len;
+  while (arrlenu(b->messages) < INGEST_BATCH && next_message(r, &is_spam, &text, &len)) {
+    ingest_message msg = { .is_spam = is_spam, .len = len };
+    if (r->size > 0 && text >= r->data && text + len <= r->data + r->size) {
+      msg.offset = text - r->data;
+    } else {
+      msg.copied = true;
+      msg.offset = arrlenu(b->copies);
+      memcpy(arraddnptr(b->copies, len + 1), text, len);
+    }
+    arrput(b->messages, msg);
+  }
+  return arrlenu(b->messages) > 0;
+}
+
+/*
+ * Tokenizer stage: extracts the accepted tokens of every message with their
+ * hashes and counts its character n-grams. Reads nothing shared but the
+ * mapped dataset and the stop words.
+ */
+void tokenize_batch(ingest_batch *b, const char *data, char ***stop_words, uint32_t flags,
+                    uint32_t hash_bits) {
+  arrsetlen(b->token_hashes, 0);
+  arrsetlen(b->token_offsets, 0);
+  arrsetlen(b->token_pool, 0);
+  arrsetlen(b->char_counts, 0);
+  for (size_t i = 0; i < arrlenu(b->messages); ++i) {
+    ingest_message *msg = &b->messages[i];
+    const char *raw = (msg->copied ? b->copies : data) + msg->offset;
+    char *processed_text = str_lwr_copy(&b->text, raw, msg->len);
+    extract_token_words(processed_text, stop_words, {
+        size_t len = strlen(buf);
+        arrput(b->token_hashes, hash_bytes(buf, len, 0));
+        arrput(b->token_offsets, pool_append(&b->token_pool, buf, len));
+      });
+    msg->tokens_end = arrlenu(b->token_hashes);
+
+    if (flags & FEATURE_CHAR_NGRAMS) {
+      arrsetlen(b->terms, 0);
+      extract_char_ngrams(processed_text, strlen(processed_text), hash_bits, {
+          arrput(b->terms, char_ngram_bucket);
+        });
+      msg->char_total = arrlenu(b->terms);
+      append_term_counts(&b->char_counts, b->terms);
+    }
+    msg->char_end = arrlenu(b->char_counts);
+  }
+}
+
+/*
+ * Merger state. Hashed features are tagged with HASHED_TERM while the
+ * vocabulary is still growing, and moved behind it once its final size is
+ * known.
+ */
+typedef struct ingest_merger {
+  model *m;
+  corpus *c;
+  token_table vocabulary_table;
+  size_t vocabulary_i;
+  uint32_t *hashed_counts;
+  uint32_t *terms;  // Feature indices of the current message.
+} ingest_merger;
+
+/*
+ * Merger stage: looks up or adds the tokens of every message in the
+ * vocabulary, in dataset order, and appends its term frequency features to
+ * the corpus.
+ */
+void merge_batch(ingest_merger *s, const ingest_batch *b) {
+  model *m = s->m;
+  size_t token = 0, char_count = 0;
+  for (size_t i = 0; i < arrlenu(b->messages); ++i) {
+    const ingest_message *msg = &b->messages[i];
+    arrsetlen(s->terms, 0);
+    size_t total = 0;
+    uint64_t previous = 0;
+    for (; token < msg->tokens_end; ++token) {
+      size_t len;
+      const char *buf = pool_token(b->token_pool, b->token_offsets[token], &len);
+      uint64_t current = b->token_hashes[token];
+      ptrdiff_t index = token_table_find_hashed(&s->vocabulary_table, m->pool, m->offsets,
+                                                buf, len, current);
+      size_t vocabulary_index;
+      if (index == -1) {
+        if (s->vocabulary_i == m->vocabulary_size) {
+          check_status(resize_model(m, s->vocabulary_i < 1024 ? 1024 : 2 * s->vocabulary_i),
+                       "Failed to resize model");
+        }
+        m->offsets[s->vocabulary_i] = pool_append(&m->pool, buf, len);
+        check_status(token_table_insert(&s->vocabulary_table, m->pool, m->offsets, buf, len,
+                                        s->vocabulary_i), "Failed to index vocabulary");
+        vocabulary_index = s->vocabulary_i++;
+      } else {
+        vocabulary_index = index;
+      }
+      arrput(s->terms, vocabulary_index);
+
+      if (m->flags & FEATURE_BIGRAMS) {
+        if (total > 0) {
+          size_t bucket = bigram_bucket(m, previous, current);
+          arrput(s->terms, HASHED_TERM | bucket);
+        }
+        previous = current;
+      }
+      total++;
+    }
+
+    // Term Frequency (TF) of the message, merged into one feature per term.
+    // Character n-grams are normalized by their own count.
+    item itm;
+    itm.is_spam = msg->is_spam;
+    itm.features = NULL;
+    append_term_frequencies(&itm.features, s->terms, total);
+    if (total == 0) {
+      fprintf(stderr, "Warning: No valid tokens in message.\n");
+    }
+
+    if (m->flags & FEATURE_CHAR_NGRAMS) {
+      feature *char_features = NULL;
+      for (; char_count < msg->char_end; ++char_count) {
+        feature f = b->char_counts[char_count];
+        f.index |= HASHED_TERM;
+        f.value /= (float)msg->char_total;
+        arrput(char_features, f);
+      }
+      itm.features = merge_features(itm.features, char_features);
+    }
+    // Document frequencies: features are distinct, so each counts once.
+    for (size_t j = 0; j < arrlenu(itm.features); ++j) {
+      uint32_t index = itm.features[j].index;
+      if (index & HASHED_TERM) {
+        s->hashed_counts[index & ~HASHED_TERM] += 1;
+      } else {
+        m->counts[index] += 1;
+      }
+    }
+    arrput(s->c->items, itm);
+  }
+}
+
+typedef struct ingest_pipeline {
+  dataset_reader *reader;
+  char ***stop_words;
+  uint32_t flags;
+  uint32_t hash_bits;
+  size_t tokenizers;
+  spsc_ring free;     // Empty batches, merger to reader.
+  spsc_ring *inputs;  // Reader to each tokenizer.
+  spsc_ring *outputs; // Each tokenizer to the merger.
+  double reader_busy;
+  double *tokenizer_busy;
+} ingest_pipeline;
+
+typedef struct tokenizer_arg {
+  ingest_pipeline *p;
+  size_t id;
+} tokenizer_arg;
+
+void *reader_worker(void *arg) {
+  ingest_pipeline *p = arg;
+  double start = now_seconds(), waited = 0.0;
+  for (size_t seq = 0;; ++seq) {
+    void *b;
+    waited += ring_pop(&p->free, &b);
+    if (!read_batch(p->reader, b)) break;
+    waited += ring_push(&p->inputs[seq % p->tokenizers], b);
+  }
+  for (size_t k = 0; k < p->tokenizers; ++k) {
+    ring_push(&p->inputs[k], NULL);
+  }
+  p->reader_busy = now_seconds() - start - waited;
+  return NULL;
+}
+
+void *tokenizer_worker(void *arg) {
+  ingest_pipeline *p = ((tokenizer_arg *)arg)->p;
+  size_t id = ((tokenizer_arg *)arg)->id;
+  for (;;) {
+    void *b;
+    ring_pop(&p->inputs[id], &b);
+    if (b != NULL) {
+      double start = now_seconds();
+      tokenize_batch(b, p->reader->data, p->stop_words, p->flags, p->hash_bits);
+      p->tokenizer_busy[id] += now_seconds() - start;
+    }
+    ring_push(&p->outputs[id], b);
+    if (b == NULL) return NULL;
+  }
+}
+
+void init_ring(spsc_ring *r, size_t capacity) {
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  r->mask = capacity - 1;
+  r->slots = SPAM_MALLOC(capacity * sizeof(void *));
+  if (r->slots == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Runs the pipeline with the given number of tokenizer threads, merging on
+ * the calling thread, and reports how busy each stage was.
+ */
+void run_ingest_pipeline(dataset_reader *reader, char ***stop_words, ingest_merger *s,
+                         size_t tokenizers) {
+  ingest_pipeline p = {
+    .reader = reader,
+    .stop_words = stop_words,
+    .flags = s->m->flags,
+    .hash_bits = s->m->hash_bits,
+    .tokenizers = tokenizers,
+  };
+  size_t batches = INGEST_BATCHES_PER_THREAD * tokenizers;
+  size_t capacity = 1;
+  while (capacity < batches) capacity *= 2;
+
+  // Rings are kept on their own cache lines, see steal_for().
+  char *rings = SPAM_MALLOC((2 * tokenizers + 1) * sizeof(spsc_ring));
+  p.inputs = (spsc_ring *)(((uintptr_t)rings + 63) & ~(uintptr_t)63);
+  p.outputs = p.inputs + tokenizers;
+  ingest_batch *pool = SPAM_CALLOC(batches, sizeof(ingest_batch));
+  pthread_t *workers = SPAM_MALLOC((tokenizers + 1) * sizeof(pthread_t));
+  tokenizer_arg *args = SPAM_MALLOC(tokenizers * sizeof(tokenizer_arg));
+  p.tokenizer_busy = SPAM_CALLOC(tokenizers, sizeof(double));
+  if (rings == NULL || pool == NULL || workers == NULL || args == NULL || p.tokenizer_busy == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  init_ring(&p.free, capacity);
+  for (size_t k = 0; k < tokenizers; ++k) {
+    init_ring(&p.inputs[k], capacity);
+    init_ring(&p.outputs[k], capacity);
+  }
+  for (size_t i = 0; i < batches; ++i) {
+    ring_push(&p.free, &pool[i]);
+  }
+
+  double start = now_seconds();
+  if (pthread_create(&workers[tokenizers], NULL, reader_worker, &p) != 0) {
+    perror("Failed to create thread");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t k = 0; k < tokenizers; ++k) {
+    args[k] = (tokenizer_arg){ .p = &p, .id = k };
+    if (pthread_create(&workers[k], NULL, tokenizer_worker, &args[k]) != 0) {
+      perror("Failed to create thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  double merger_busy = 0.0;
+  size_t messages = 0;
+  for (size_t seq = 0;; ++seq) {
+    void *b;
+    ring_pop(&p.outputs[seq % tokenizers], &b);
+    if (b == NULL) break;
+    double merge_start = now_seconds();
+    merge_batch(s, b);
+    merger_busy += now_seconds() - merge_start;
+    messages += arrlenu(((ingest_batch *)b)->messages);
+    ring_push(&p.free, b);
+  }
+  for (size_t k = 0; k <= tokenizers; ++k) {
+    pthread_join(workers[k], NULL);
+  }
+  double elapsed = now_seconds() - start;
+
+  double tokenizer_busy = 0.0;
+  for (size_t k = 0; k < tokenizers; ++k) {
+    tokenizer_busy += p.tokenizer_busy[k];
+  }
+  printf("Ingested %zu messages in %.3fs. Busy: reader %.0f%%, %zu tokenizers %.0f%%, merger %.0f%%\n",
+         messages, elapsed, 100 * p.reader_busy / elapsed, tokenizers,
+         100 * tokenizer_busy / tokenizers / elapsed, 100 * merger_busy / elapsed);
+
+  for (size_t i = 0; i < batches; ++i) {
+    free_ingest_batch(&pool[i]);
+  }
+  SPAM_FREE(p.free.slots);
+  for (size_t k = 0; k < tokenizers; ++k) {
+    SPAM_FREE(p.inputs[k].slots);
+    SPAM_FREE(p.outputs[k].slots);
+  }
+  SPAM_FREE(p.tokenizer_busy);
+  SPAM_FREE(args);
+  SPAM_FREE(workers);
+  SPAM_FREE(pool);
+  SPAM_FREE(rings);
+}
+
+/*
+ * Reads the dataset and builds the sparse term frequency features of every
+ * message. New tokens are appended to the model's vocabulary, and token
+ * counts and the document count are added to the model's. With more than one
+ * ingest thread the stages run as a pipeline, otherwise in turn on one batch.
+ */
+void tokenize_corpus(char *dataset, char ***stop_words, corpus *c, model *m) {
+  dataset_reader reader;
+  open_dataset(&reader, dataset);
+
+  ingest_merger s = { .m = m, .c = c, .vocabulary_i = m->vocabulary_size };
+  for (size_t i = 0; i < m->vocabulary_size; ++i) {
+    size_t len;
+    const char *token = vocabulary_token(m, i, &len);
+    check_status(token_table_insert(&s.vocabulary_table, m->pool, m->offsets, token, len, i),
+                 "Failed to index vocabulary");
+  }
+  s.hashed_counts = SPAM_CALLOC(hashed_buckets(m), sizeof(uint32_t));
+  if (hashed_buckets(m) > 0 && s.hashed_counts == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  c->items = NULL;
+  if (ingest_threads > 1) {
+    run_ingest_pipeline(&reader, stop_words, &s, ingest_threads);
+  } else {
+    ingest_batch b = {0};
+    while (read_batch(&reader, &b)) {
+      tokenize_batch(&b, reader.data, stop_words, m->flags, m->hash_bits);
+      merge_batch(&s, &b);
+    }
+    free_ingest_batch(&b);
+  }
+  close_dataset(&reader);
+  arrfree(s.terms);
+  free_token_table(&s.vocabulary_table);
+
+  check_status(resize_model(m, s.vocabulary_i), "Failed to resize model");
+  m->documents += arrlenu(c->items);
+  c->feature_count = feature_count(m);
+  for (size_t i = 0; i < hashed_buckets(m); ++i) {
+    m->counts[m->vocabulary_size + i] += s.hashed_counts[i];
+  }
+  SPAM_FREE(s.hashed_counts);
+
+  for (size_t i = 0; i < arrlenu(c->items); ++i) {
+    item *itm = &c->items[i];
+    for (size_t j = 0; j < arrlenu(itm->features); ++j) {
+      if (itm->features[j].index & HASHED_TERM) {
+        itm->features[j].index = m->vocabulary_size + (itm->features[j].index & ~HASHED_TERM);
+      }
+    }
+  }
+}
+
+/*
+ * Recomputes the Inverse Document Frequency (IDF) of the whole vocabulary
+ * from the model's counts and weights the term frequencies of the corpus
+ * with it.
+ */
+void weight_corpus(corpus *c, model *m) {
+  for (size_t i = 0; i < feature_count(m); ++i) {
+    float idf = logf((float)m->documents / (1 + m->counts[i]));
+    m->idf[i] = idf > 0.0f ? idf : 0.0f;
+  }
+  for (size_t i = 0; i < arrlenu(c->items); ++i) {
+    item *itm = &c->items[i];
+    for (size_t j = 0; j < arrlenu(itm->features); ++j) {
+      itm->features[j].value *= m->idf[itm->features[j].index];
+    }
+  }
+}
+
+/*
+ * Reads the dataset and builds the sparse TF-IDF features of every message.
+ * The dataset is tokenized only once. New tokens are appended to the model's
+ * vocabulary, token counts and document count are added to the model's and
+ * the IDF of the whole vocabulary is recomputed from them, so the same
+ * function serves fresh training and incremental updates.
+ */
+void build_corpus(char *dataset, char ***stop_words, corpus *c, model *m) {
+  tokenize_corpus(dataset, stop_words, c, m);
+  weight_corpus(c, m);
+}
+
+/*
+ * Identifies the dataset and the tokenizer settings a cached corpus was
+ * built from. Any difference makes the cache stale.
+ */
+typedef struct corpus_key {
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t content_hash;
+  uint64_t settings_hash;
+} corpus_key;
+
+/*
+ * Corpus cache file layout, in native byte order with every array aligned to
+ * its element size, so that each section can be validated and copied straight
+ * out of the mapped file:
+ *
+ *   corpus_header
+ *   uint32   counts[vocabulary_size + hashed buckets]
+ *   uint32   offsets[vocabulary_size]
+ *   uint64   document_start[documents + 1]   (padded to 8 bytes)
+ *   feature  features[features]              term frequencies
+ *   uint8    labels[documents]
+ *   char     pool[pool_size]
+ */
+typedef struct corpus_header {
+  uint32_t magic;
+  uint32_t version;
+  corpus_key key;
+  uint32_t flags;
+  uint32_t hash_bits;
+  uint64_t vocabulary_size;
+  uint64_t documents;
+  uint64_t features;
+  uint64_t pool_size;
+} corpus_header;
+
+#define write_cache_field(ptr, size, n, file) do {              \
+    if (fwrite(ptr, size, n, file) != (n)) {                    \
+      return false;                                             \
+    }                                                           \
+  } while(0)
+
+size_t align8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+/*
+ * Describes the dataset file and the tokenizer settings of the model.
+ * Returns false if the dataset can not be read.
+ */
+bool corpus_key_of(const char *dataset, char ***stop_words, const model *m, corpus_key *key) {
+  memset(key, 0, sizeof(*key));
+  int fd = open(dataset, O_RDONLY);
+  if (fd == -1) return false;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return false;
+  }
+  key->size = st.st_size;
+  key->mtime_sec = st.st_mtim.tv_sec;
+  key->mtime_nsec = st.st_mtim.tv_nsec;
+  if (st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    key->content_hash = hash_bytes(data, st.st_size, 0);
+    munmap(data, st.st_size);
+  }
+  close(fd);
+
+  uint64_t h = TOKENIZER_VERSION;
+  for (size_t i = 0; i < arrlenu(*stop_words); ++i) {
+    h = hash_bytes((*stop_words)[i], strlen((*stop_words)[i]) + 1, h);
+  }
+  uint64_t settings[3] = { m->flags, m->hash_bits, CHAR_NGRAM_MIN << 8 | CHAR_NGRAM_MAX };
+  key->settings_hash = hash_bytes(settings, sizeof(settings), h);
+  return true;
+}
+
+/*
+ * Writes the tokenized, not yet IDF weighted, corpus and the vocabulary of
+ * the model to an open cache file. Returns false if a write fails.
+ */
+bool write_corpus_file(FILE *file, const corpus_key *key, const corpus *c, const model *m) {
+  corpus_header header = {
+    .magic = CORPUS_MAGIC,
+    .version = CORPUS_VERSION,
+    .key = *key,
+    .flags = m->flags,
+    .hash_bits = m->hash_bits,
+    .vocabulary_size = m->vocabulary_size,
+    .documents = arrlenu(c->items),
+    .features = 0,
+    .pool_size = arrlenu(m->pool),
+  };
+  for (size_t i = 0; i < arrlenu(c->items); ++i) {
+    header.features += arrlenu(c->items[i].features);
+  }
+
+  const uint64_t padding = 0;
+  size_t arrays = (feature_count(m) + m->vocabulary_size) * sizeof(uint32_t);
+  write_cache_field(&header, sizeof(header), 1, file);
+  write_cache_field(m->counts, sizeof(uint32_t), feature_count(m), file);
+  write_cache_field(m->offsets, sizeof(uint32_t), m->vocabulary_size, file);
+  write_cache_field(&padding, 1, align8(arrays) - arrays, file);
+  uint64_t start = 0;
+  for (size_t i = 0; i < arrlenu(c->items); ++i) {
+    write_cache_field(&start, sizeof(uint64_t), 1, file);
+    start += arrlenu(c->items[i].features);
+  }
+  write_cache_field(&start, sizeof(uint64_t), 1, file);
+  for (size_t i = 0; i < arrlenu(c->items); ++i) {
+    const item *itm = &c->items[i];
+    write_cache_field(itm->features, sizeof(feature), arrlenu(itm->features), file);
+  }
+  for (size_t i = 0; i < arrlenu(c->items); ++i) {
+    uint8_t label = c->items[i].is_spam;
+    write_cache_field(&label, 1, 1, file);
+  }
+  write_cache_field(m->pool, sizeof(char), arrlenu(m->pool), file);
+  return true;
+}
+
+/*
+ * Caches the corpus and vocabulary of the model in a file. The cache is
+ * optional: if it cannot be written, a warning is printed, the partial file
+ * removed, and training goes on.
+ */
+void write_corpus_cache(const char *path, const corpus_key *key, const corpus *c, const model *m) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror("Failed to open corpus cache for writing");
+    return;
+  }
+  bool written = write_corpus_file(file, key, c, m);
+  if (fclose(file) != 0 || !written) {
+    perror("Warning: Failed to write corpus cache");
+    unlink(path);
+    return;
+  }
+  printf("Corpus cached to %s\n", path);
+}
+
+/*
+ * Maps a corpus cache file and loads the corpus and vocabulary from it into
+ * an empty model. The mapping is only used while loading: every section is
+ * copied into the model and into per-message feature arrays, which training
+ * weights in place, and the file is unmapped before returning. Returns
+ * false, leaving both untouched, if the file is missing, malformed or was
+ * built from another dataset or tokenizer.
+ */
+bool read_corpus_cache(const char *path, const corpus_key *key, corpus *c, model *m) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return false;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(corpus_header)) {
+    close(fd);
+    return false;
+  }
+  char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+
+  const corpus_header *header = (const corpus_header *)data;
+  bool valid = header->magic == CORPUS_MAGIC && header->version == CORPUS_VERSION &&
+    memcmp(&header->key, key, sizeof(*key)) == 0 &&
+    header->flags == m->flags && header->hash_bits == m->hash_bits &&
+    header->vocabulary_size < UINT32_MAX && header->documents < UINT32_MAX &&
+    header->features < ((uint64_t)1 << 40) && header->pool_size < UINT32_MAX;
+  if (!valid) {
+    munmap(data, st.st_size);
+    return false;
+  }
+
+  // Section offsets, checked against the file size before anything is read.
+  size_t features = header->vocabulary_size +
+    ((header->flags & HASHED_FEATURES) ? (size_t)1 << header->hash_bits : 0);
+  size_t counts_at = sizeof(corpus_header);
+  size_t offsets_at = counts_at + features * sizeof(uint32_t);
+  size_t starts_at = align8(offsets_at + header->vocabulary_size * sizeof(uint32_t));
+  size_t features_at = starts_at + (header->documents + 1) * sizeof(uint64_t);
+  size_t labels_at = features_at + header->features * sizeof(feature);
+  size_t pool_at = labels_at + header->documents;
+  valid = valid && pool_at + header->pool_size == (size_t)st.st_size;
+
+  const uint32_t *counts = (const uint32_t *)(data + counts_at);
+  const uint32_t *offsets = (const uint32_t *)(data + offsets_at);
+  const uint64_t *starts = (const uint64_t *)(data + starts_at);
+  const feature *terms = (const feature *)(data + features_at);
+  const uint8_t *labels = (const uint8_t *)(data + labels_at);
+  const char *pool = data + pool_at;
+  for (size_t i = 0; valid && i < header->vocabulary_size; ++i) {
+    size_t len;
+    valid = pool_token_checked(pool, header->pool_size, offsets[i], &len) != NULL;
+  }
+  valid = valid && starts[0] == 0;
+  for (size_t i = 0; valid && i < header->documents; ++i) {
+    valid = starts[i] <= starts[i + 1] && starts[i + 1] <= header->features;
+  }
+  for (size_t i = 0; valid && i < header->features; ++i) {
+    valid = terms[i].index < features;
+  }
+  if (!valid) {
+    munmap(data, st.st_size);
+    return false;
+  }
+
+  check_status(resize_model(m, header->vocabulary_size), "Failed to resize model");
+  m->documents += header->documents;
+  memcpy(m->counts, counts, features * sizeof(uint32_t));
+  memcpy(m->offsets, offsets, header->vocabulary_size * sizeof(uint32_t));
+  arrsetlen(m->pool, header->pool_size);
+  memcpy(m->pool, pool, header->pool_size);
+
+  c->items = NULL;
+  c->feature_count = features;
+  arrsetlen(c->items, header->documents);
+  for (size_t i = 0; i < header->documents; ++i) {
+    item *itm = &c->items[i];
+    size_t n = starts[i + 1] - starts[i];
+    itm->is_spam = labels[i] != 0;
+    itm->features = NULL;
+    arrsetlen(itm->features, n);
+    memcpy(itm->features, terms + starts[i], n * sizeof(feature));
+  }
+
+  munmap(data, st.st_size);
+  return true;
+}
+
+/*
+ * build_corpus() through a cache file. A fresh model is loaded from the cache
+ * when it matches the dataset and tokenizer settings, otherwise the dataset
+ * is tokenized and the cache rewritten. Without a cache path, or for a model
+ * that already has a vocabulary, this is plain build_corpus().
+ */
+void load_corpus(char *dataset, char *cache, char ***stop_words, corpus *c, model *m) {
+  corpus_key key;
+  if (cache == NULL || m->vocabulary_size > 0 || !corpus_key_of(dataset, stop_words, m, &key)) {
+    build_corpus(dataset, stop_words, c, m);
+    return;
+  }
+  if (read_corpus_cache(cache, &key, c, m)) {
+    printf("Corpus loaded from %s\n", cache);
+  } else {
+    tokenize_corpus(dataset, stop_words, c, m);
+    write_corpus_cache(cache, &key, c, m);
+  }
+  weight_corpus(c, m);
+}
+
+void free_corpus(corpus *c) {
+  for (size_t i = 0; i < arrlenu(c->items); i++) {
+    arrfree(c->items[i].features);
+  }
+  arrfree(c->items);
+}
+
+/*
+ * Computes the linear score of an item.
+ */
+float item_score(const item *itm, const float *weights, float bias) {
+  float z = 0.0f;
+  for (size_t j = 0; j < arrlenu(itm->features); ++j)
+    z += itm->features[j].value * weights[itm->features[j].index];
+  return z + bias;
+}
+
+/*
+ * One pass of mini-batch gradient descent over every item outside
+ * [test_begin, test_end). The gradients of a batch are computed against the
+ * same weights and collected as sparse (index, value) entries, which are
+ * counting sorted by BATCH_BLOCK sized column block. Each block is then
+ * scattered into an L1 resident buffer and applied together with the L2 decay
+ * in one fused pass, so the weight vector is streamed once per batch instead
+ * of once per example. The step sums the gradients of the batch, which makes
+ * a batch of one the same update as plain SGD.
+ */
+void sgd_minibatch_epoch(const corpus *c, const hyperparams *hp, size_t test_begin,
+                         size_t test_end, float *weights, float *bias) {
+  size_t blocks = (c->feature_count + BATCH_BLOCK - 1) / BATCH_BLOCK;
+  size_t *block_start = SPAM_MALLOC((blocks + 1) * sizeof(size_t));
+  size_t *block_fill = SPAM_MALLOC(blocks * sizeof(size_t));
+  float *block = SPAM_MALLOC(BATCH_BLOCK * sizeof(float));
+  if (block_start == NULL || block_fill == NULL || block == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  feature *entries = NULL, *sorted = NULL;
+  size_t *rows = NULL;
+  float *scores = NULL;
+  float learning_rate = hp->learning_rate;
+
+  size_t i = 0;
+  while (i < arrlenu(c->items)) {
+    arrsetlen(rows, 0);
+    arrsetlen(scores, 0);
+    for (; i < arrlenu(c->items) && arrlenu(rows) < hp->batch_size; ++i) {
+      if (i >= test_begin && i < test_end) continue;
+      arrput(rows, i);
+      arrput(scores, item_score(&c->items[i], weights, *bias));
+    }
+    size_t batch = arrlenu(rows);
+    if (batch == 0) break;
+    sigmoid_batch(scores, scores, batch);
+
+    float bias_gradient_sum = 0.0f;
+    arrsetlen(entries, 0);
+    for (size_t r = 0; r < batch; ++r) {
+      const item *itm = &c->items[rows[r]];
+      float y_cap = scores[r];
+      float y = itm->is_spam ? 1.0f : 0.0f;
+      float gradient_weight = itm->is_spam ? hp->spam_weight : hp->ham_weight;
+      float bias_gradient = gradient_weight * (y_cap - y);
+
+      for (size_t j = 0; j < arrlenu(itm->features); ++j) {
+        feature entry = { itm->features[j].index, bias_gradient * itm->features[j].value };
+        arrput(entries, entry);
+      }
+      bias_gradient_sum += bias_gradient;
+    }
+
+    memset(block_start, 0, (blocks + 1) * sizeof(size_t));
+    for (size_t e = 0; e < arrlenu(entries); ++e) {
+      ++block_start[entries[e].index / BATCH_BLOCK + 1];
+    }
+    for (size_t b = 0; b < blocks; ++b) {
+      block_start[b + 1] += block_start[b];
+      block_fill[b] = block_start[b];
+    }
+    arrsetlen(sorted, arrlenu(entries));
+    for (size_t e = 0; e < arrlenu(entries); ++e) {
+      sorted[block_fill[entries[e].index / BATCH_BLOCK]++] = entries[e];
+    }
+
+    float lambda = hp->lambda * batch;
+    for (size_t b = 0; b < blocks; ++b) {
+      size_t base = b * BATCH_BLOCK;
+      size_t len = c->feature_count - base < BATCH_BLOCK ? c->feature_count - base : BATCH_BLOCK;
+      if (block_start[b] == block_start[b + 1]) {
+        kernel.axpy(-learning_rate * lambda, weights + base, weights + base, len);
+        continue;
+      }
+      memset(block, 0, len * sizeof(float));
+      for (size_t e = block_start[b]; e < block_start[b + 1]; ++e) {
+        block[sorted[e].index - base] += sorted[e].value;
+      }
+      kernel.reg_update(weights + base, block, learning_rate, lambda, len);
+    }
+    *bias -= hp->learning_rate * bias_gradient_sum;
+  }
+
+  arrfree(entries);
+  arrfree(sorted);
+  arrfree(rows);
+  arrfree(scores);
+  SPAM_FREE(block_start);
+  SPAM_FREE(block_fill);
+  SPAM_FREE(block);
+}
+
+/*
+ * One pass of stochastic gradient descent over every item outside
+ * [test_begin, test_end), in mini-batches when hp->batch_size is above one.
+ */
+void sgd_epoch(const corpus *c, const hyperparams *hp, size_t test_begin, size_t test_end,
+               float *weights, float *bias) {
+  if (hp->batch_size > 1) {
+    sgd_minibatch_epoch(c, hp, test_begin, test_end, weights, bias);
+    return;
+  }
+
+  for(size_t i = 0; i < arrlenu(c->items); ++i) {
+    if (i >= test_begin && i < test_end) continue;
+
+    const item *itm = &c->items[i];
+    float y_cap = sigmoid(item_score(itm, weights, *bias)); // Classification predicted by the model.
+    float y = itm->is_spam ? 1.0f : 0.0f; // Actual value.
+
+    float gradient_weight = itm->is_spam ? hp->spam_weight : hp->ham_weight;
+    float bias_gradient = gradient_weight * (y_cap - y);
+
+    // w -= lr * (gradient + lambda * w), as an L2 decay of every weight
+    // followed by the sparse gradient step.
+    kernel.axpy(-(float)(hp->learning_rate * hp->lambda), weights, weights, c->feature_count);
+    for(size_t j = 0; j < arrlenu(itm->features); ++j) {
+      float weight_gradient = bias_gradient * itm->features[j].value;
+      weights[itm->features[j].index] -= hp->learning_rate * weight_gradient;
+    }
+    *bias -= hp->learning_rate * bias_gradient;
+  }
+}
+
+/*
+ * Adds the confusion counts of the items in [test_begin, test_end) to out.
+ * Items are classified by comparing their score against the logit of the
+ * threshold.
+ */
+void evaluate(const corpus *c, size_t test_begin, size_t test_end,
+              const float *weights, float bias, metrics *out) {
+  const float threshold = logit(EVALUATION_THRESHOLD);
+  for(size_t i = test_begin; i < test_end; ++i) {
+    const item *itm = &c->items[i];
+    bool predicted_spam = item_score(itm, weights, bias) > threshold;
+    if (itm->is_spam && predicted_spam) {
+      ++out->true_positives;
+    } else if (!itm->is_spam && predicted_spam) {
+      ++out->false_positives;
+    } else if (itm->is_spam && !predicted_spam) {
+      ++out->false_negatives;
+    }
+  }
+
+  out->precision = (out->true_positives + out->false_positives > 0) ?
+    (float)out->true_positives / (out->true_positives + out->false_positives) : 0.0f;
+  out->recall = (out->true_positives + out->false_negatives > 0) ?
+    (float)out->true_positives / (out->true_positives + out->false_negatives) : 0.0f;
+  out->f1_score = (out->precision + out->recall > 0) ?
+    2.0f * (out->precision * out->recall) / (out->precision + out->recall) : 0.0f;
+}
+
+/*
+ * Trains the weights from zero on every item outside [test_begin, test_end)
+ * and evaluates the trained weights on the items inside it.
+ */
+void fit(const corpus *c, const hyperparams *hp, size_t test_begin, size_t test_end,
+         float *weights, float *bias, metrics *out) {
+  for(size_t i = 0; i < c->feature_count; ++i)
+    weights[i] = 0.0f;
+  *bias = 0.0f;
+  memset(out, 0, sizeof(*out));
+
+  for(size_t x = 1; x <= hp->epochs; ++x) {
+    sgd_epoch(c, hp, test_begin, test_end, weights, bias);
+  }
+  evaluate(c, test_begin, test_end, weights, *bias, out);
+}
+
+/*
+ * Prints the size of the feature space and what it costs in memory and time.
+ */
+void print_feature_stats(const corpus *c, const model *m, double preprocessing, double training) {
+  size_t features = 0;
+  for (size_t i = 0; i < arrlenu(c->items); ++i) {
+    features += arrlenu(c->items[i].features);
+  }
+  size_t model_bytes = feature_count(m) * (sizeof(*m->weights) + sizeof(*m->idf) + sizeof(*m->counts))
+    + m->vocabulary_size * sizeof(*m->offsets) + arrlenu(m->pool);
+
+  printf("Features: %zu tokens + %zu hashed buckets, %.1f per message (%.2f MiB), model %.2f MiB\n",
+         m->vocabulary_size, hashed_buckets(m), (double)features / arrlenu(c->items),
+         features * sizeof(feature) / 1048576.0, model_bytes / 1048576.0);
+  printf("Preprocessing: %.3fs (%.0f messages/s), training: %.3fs\n",
+         preprocessing, arrlenu(c->items) / preprocessing, training);
+}
+
+void train_model(char *dataset, char *cache, char *output, const hyperparams *hp,
+                 const feature_options *opts) {
+  double start = now_seconds();
+
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+
+  model m = { .flags = opts->flags, .hash_bits = opts->hash_bits };
+  corpus c;
+  load_corpus(dataset, cache, &stop_words, &c, &m);
+  double preprocessed = now_seconds();
+
+  const size_t train_size = TRAIN_TEST_SPLIT * ((float)arrlen(c.items) / 100.0f);
+  metrics result;
+  fit(&c, hp, train_size, arrlenu(c.items), m.weights, &m.bias, &result);
+
+  print_feature_stats(&c, &m, preprocessed - start, now_seconds() - preprocessed);
+  printf("Precision: %.2f%%\n", result.precision * 100.0f);
+  printf("Recall: %.2f%%\n", result.recall * 100.0f);
+  printf("F1-Score: %.2f%%\n", result.f1_score * 100.0f);
+
+  if(output != NULL) {
+    check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
+    dump_model(&m, output);
+  }
+
+  free_corpus(&c);
+  free_model(&m);
+
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+typedef struct fold_job {
+  const corpus *c;
+  const hyperparams *hp;
+  size_t test_begin;
+  size_t test_end;
+  float *weights;
+  float bias;
+  metrics result;
+} fold_job;
+
+void *fold_worker(void *arg) {
+  fold_job *job = arg;
+  fit(job->c, job->hp, job->test_begin, job->test_end, job->weights, &job->bias, &job->result);
+  return NULL;
+}
+
+/*
+ * K-fold cross-validation. The corpus is built once and the K fold models are
+ * trained concurrently, one thread per fold, over the shared features.
+ */
+void cross_validate(char *dataset, char *cache, size_t k, const hyperparams *hp,
+                    const feature_options *opts) {
+  double start = now_seconds();
+
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+
+  model m = { .flags = opts->flags, .hash_bits = opts->hash_bits };
+  corpus c;
+  load_corpus(dataset, cache, &stop_words, &c, &m);
+  free_model(&m);
+
+  const size_t n = arrlenu(c.items);
+  if (k < 2 || k > n) {
+    fprintf(stderr, "Error: Number of folds must be between 2 and %zu.\n", n);
+    exit(1);
+  }
+  double preprocessed = now_seconds();
+
+  fold_job *jobs = SPAM_MALLOC(k * sizeof(fold_job));
+  pthread_t *threads = SPAM_MALLOC(k * sizeof(pthread_t));
+  if (jobs == NULL || threads == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t f = 0; f < k; ++f) {
+    jobs[f].c = &c;
+    jobs[f].hp = hp;
+    jobs[f].test_begin = f * n / k;
+    jobs[f].test_end = (f + 1) * n / k;
+    jobs[f].weights = SPAM_MALLOC(c.feature_count * sizeof(float));
+    if (jobs[f].weights == NULL) {
+      printf("Memory allocation failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&threads[f], NULL, fold_worker, &jobs[f]) != 0) {
+      perror("Failed to create thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  metrics mean = {0};
+  for (size_t f = 0; f < k; ++f) {
+    pthread_join(threads[f], NULL);
+    printf("Fold %zu: Precision: %.2f%%  Recall: %.2f%%  F1-Score: %.2f%%\n", f + 1,
+           jobs[f].result.precision * 100.0f, jobs[f].result.recall * 100.0f,
+           jobs[f].result.f1_score * 100.0f);
+    mean.precision += jobs[f].result.precision / k;
+    mean.recall += jobs[f].result.recall / k;
+    mean.f1_score += jobs[f].result.f1_score / k;
+    SPAM_FREE(jobs[f].weights);
+  }
+  double end = now_seconds();
+
+  printf("Mean: Precision: %.2f%%  Recall: %.2f%%  F1-Score: %.2f%%\n",
+         mean.precision * 100.0f, mean.recall * 100.0f, mean.f1_score * 100.0f);
+  printf("Preprocessing: %.3fs, training: %.3fs, total: %.3fs\n",
+         preprocessed - start, end - preprocessed, end - start);
+
+  SPAM_FREE(threads);
+  SPAM_FREE(jobs);
+  free_corpus(&c);
+
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+typedef struct sweep_job {
+  hyperparams hp;
+  metrics result;
+  size_t order;  // Position in the grid, which breaks ties.
+} sweep_job;
+
+typedef struct sweep_context {
+  const corpus *c;
+  sweep_job *jobs;
+  size_t train_size;
+} sweep_context;
+
+void sweep_worker(void *arg, size_t i) {
+  sweep_context *ctx = arg;
+  float *weights = SPAM_MALLOC(ctx->c->feature_count * sizeof(float));
+  if (weights == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  float bias;
+  fit(ctx->c, &ctx->jobs[i].hp, ctx->train_size, arrlenu(ctx->c->items),
+      weights, &bias, &ctx->jobs[i].result);
+  SPAM_FREE(weights);
+}
+
+int compare_sweep_jobs(const void *a, const void *b) {
+  const sweep_job *x = a, *y = b;
+  if (x->result.f1_score != y->result.f1_score) {
+    return (x->result.f1_score < y->result.f1_score) - (x->result.f1_score > y->result.f1_score);
+  }
+  return (x->order > y->order) - (x->order < y->order);
+}
+
+/*
+ * Hyperparameter sweep. The corpus is built once and one model per grid
+ * combination is trained on the thread pool, then ranked by the F1-Score of
+ * its final weights on the test split, so that combinations with more
+ * epochs are not judged on their earlier ones. Ties keep the grid order.
+ */
+void sweep(char *dataset, char *cache, const hyperparam_grid *grid, size_t threads,
+           const feature_options *opts) {
+  double start = now_seconds();
+
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+
+  model m = { .flags = opts->flags, .hash_bits = opts->hash_bits };
+  corpus c;
+  load_corpus(dataset, cache, &stop_words, &c, &m);
+  free_model(&m);
+  double preprocessed = now_seconds();
+
+  sweep_job *jobs = NULL;
+  for (size_t a = 0; a < arrlenu(grid->learning_rates); ++a)
+    for (size_t b = 0; b < arrlenu(grid->lambdas); ++b)
+      for (size_t e = 0; e < arrlenu(grid->epochs); ++e)
+        for (size_t h = 0; h < arrlenu(grid->ham_weights); ++h)
+          for (size_t s = 0; s < arrlenu(grid->spam_weights); ++s)
+            for (size_t z = 0; z < arrlenu(grid->batch_sizes); ++z) {
+              sweep_job job = {0};
+              job.hp.learning_rate = grid->learning_rates[a];
+              job.hp.lambda = grid->lambdas[b];
+              job.hp.epochs = (size_t)grid->epochs[e];
+              job.hp.ham_weight = grid->ham_weights[h];
+              job.hp.spam_weight = grid->spam_weights[s];
+              job.hp.batch_size = (size_t)grid->batch_sizes[z];
+              job.order = arrlenu(jobs);
+              arrput(jobs, job);
+            }
+
+  sweep_context ctx = {
+    .c = &c,
+    .jobs = jobs,
+    .train_size = TRAIN_TEST_SPLIT * ((float)arrlen(c.items) / 100.0f),
+  };
+  parallel_for(arrlenu(jobs), threads, sweep_worker, &ctx);
+  double end = now_seconds();
+
+  qsort(jobs, arrlenu(jobs), sizeof(*jobs), compare_sweep_jobs);
+  printf("%4s  %13s  %8s  %6s  %10s  %11s  %5s  %9s  %6s  %8s\n", "Rank", "Learning rate",
+         "Lambda", "Epochs", "Ham weight", "Spam weight", "Batch", "Precision", "Recall",
+         "F1-Score");
+  for (size_t i = 0; i < arrlenu(jobs); ++i) {
+    printf("%4zu  %13g  %8g  %6zu  %10g  %11g  %5zu  %8.2f%%  %5.2f%%  %7.2f%%\n", i + 1,
+           jobs[i].hp.learning_rate, jobs[i].hp.lambda, jobs[i].hp.epochs,
+           jobs[i].hp.ham_weight, jobs[i].hp.spam_weight, jobs[i].hp.batch_size,
+           jobs[i].result.precision * 100.0f, jobs[i].result.recall * 100.0f,
+           jobs[i].result.f1_score * 100.0f);
+  }
+  printf("%zu models on %zu threads. Preprocessing: %.3fs, training: %.3fs, total: %.3fs\n",
+         arrlenu(jobs), threads, preprocessed - start, end - preprocessed, end - start);
+
+  arrfree(jobs);
+  free_corpus(&c);
+
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+/*
+ * Incremental training. Loads an existing model, grows its vocabulary with
+ * the tokens of the new dataset, updates the token counts and IDF, and runs
+ * SGD passes over just the new messages before writing the model back.
+ */
+void update_model(char *path, char *dataset, const hyperparams *hp) {
+  model m;
+  load_model(&m, path);
+  if (m.counts == NULL) {
+    fprintf(stderr, "Error: %s has no document frequencies, retrain it with --train first.\n", path);
+    exit(1);
+  }
+
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+
+  size_t old_vocabulary_size = m.vocabulary_size;
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+
+  for(size_t x = 1; x <= hp->epochs; ++x) {
+    sgd_epoch(&c, hp, 0, 0, m.weights, &m.bias);
+  }
+
+  printf("Learned from %zu messages, %zu new tokens (vocabulary: %zu tokens, %zu messages).\n",
+         arrlenu(c.items), m.vocabulary_size - old_vocabulary_size,
+         m.vocabulary_size, m.documents);
+  check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
+  dump_model(&m, path);
+
+  free_corpus(&c);
+  free_model(&m);
+
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+/*
+ * Loads a model for classification through the library, exiting on failure.
+ */
+spamclf_model *open_model(const char *path) {
+  spamclf_model *m;
+  check_status(spamclf_load(path, &m), path);
+  return m;
+}
+
+void run_model(char *path, char *input) {
+  char buf[120];
+  if(input == NULL) {
+    printf("Enter model input: ");
+    fflush(stdout);
+    ssize_t n = read(0, buf, sizeof(buf) - 1);
+    if(n == -1) {
+      printf("Failed to read user input from stdin.");
+      exit(1);
+    }
+    buf[n] = '\0';
+    input = buf;
+  }
+
+  spamclf_model *m = open_model(path);
+
+  if(spamclf_is_spam(m, input, strlen(input))) {
+    printf("It is spam.\n");
+  } else {
+    printf("It not a spam.\n");
+  }
+
+  spamclf_free(m);
+}
+
+/*
+ * Batch scoring of a file with one message per line. The mapped file is cut
+ * into SCORE_CHUNK_SIZE chunks at line boundaries, which are scored by the
+ * work-stealing pool one window at a time. Results go through a reorder
+ * buffer: whichever worker completes the oldest pending chunk writes it and
+ * every completed chunk after it, so output keeps the input order while
+ * holding at most one window of results.
+ *
+ * Given a model registry instead of a model, each message is tokenized once
+ * and scored by every model of the registry.
+ */
+typedef struct score_context {
+  const spamclf_model *m;
+  const model_registry *registry;   // Used instead of m if set.
+  const score_shortcuts *shortcuts; // Optional.
+  const char *data;
+  size_t *starts;           // Chunk boundaries, stb_ds array.
+  size_t window_begin;
+  size_t window_end;
+  char **outputs;           // Formatted results of each chunk of the window.
+  bool *ready;
+  size_t next_write;        // Oldest chunk not yet written.
+  size_t messages;
+  pthread_mutex_t lock;
+  FILE *out;
+} score_context;
+
+void score_chunk(void *arg, size_t chunk) {
+  score_context *ctx = arg;
+  const char *p = ctx->data + ctx->starts[chunk];
+  const char *end = ctx->data + ctx->starts[chunk + 1];
+  size_t width = ctx->registry != NULL ? arrlenu(ctx->registry->models) : 1;
+  registry_message tokens = {0};
+  float *scores = NULL;
+
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    size_t len = (newline != NULL ? newline : end) - p;
+    if (len > 0 && p[len - 1] == '\r') --len;
+    token_counts counts = {0};
+    if (ctx->registry != NULL) {
+      registry_tokenize(ctx->registry, p, len, &tokens);
+      for (size_t id = 0; id < width; ++id) {
+        arrput(scores, registry_score(ctx->registry, id, &tokens));
+      }
+    } else {
+      arrput(scores, ctx->shortcuts != NULL ? shortcut_score(ctx->shortcuts, 0, ctx->m, p, len, &counts)
+                                            : spamclf_score(ctx->m, p, len));
+    }
+    p = newline != NULL ? newline + 1 : end;
+  }
+  free_registry_message(&tokens);
+
+  size_t n = arrlenu(scores);
+  float *probabilities = SPAM_MALLOC((n + 1) * sizeof(float));
+  char *out = NULL;
+  if (probabilities == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  sigmoid_batch(scores, probabilities, n);
+  const float threshold = logit(SPAMCLF_THRESHOLD);
+  for (size_t i = 0; i < n; ++i) {
+    char result[32];
+    int len = snprintf(result, sizeof(result), "%s\t%.4f%c",
+                       scores[i] > threshold ? "spam" : "ham", probabilities[i],
+                       (i + 1) % width == 0 ? '\n' : '\t');
+    memcpy(arraddnptr(out, len), result, len);
+  }
+  SPAM_FREE(probabilities);
+  arrfree(scores);
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->outputs[chunk - ctx->window_begin] = out;
+  ctx->ready[chunk - ctx->window_begin] = true;
+  ctx->messages += n / width;
+  while (ctx->next_write < ctx->window_end && ctx->ready[ctx->next_write - ctx->window_begin]) {
+    char **pending = &ctx->outputs[ctx->next_write - ctx->window_begin];
+    fwrite(*pending, 1, arrlenu(*pending), ctx->out);
+    arrfree(*pending);
+    ctx->next_write++;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Scores every line of the file at path with the models and output of setup,
+ * writing results in input order. Returns the number of messages.
+ */
+size_t score_lines(const score_context *setup, const char *path, size_t threads) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror("Error opening file");
+    exit(1);
+  }
+  size_t size = st.st_size;
+  const char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("Failed to map file");
+    exit(1);
+  }
+  if (size > 0) madvise((void *)data, size, MADV_SEQUENTIAL);
+
+  score_context ctx = *setup;
+  ctx.data = data;
+  pthread_mutex_init(&ctx.lock, NULL);
+  arrput(ctx.starts, 0);
+  while (arrlast(ctx.starts) < size) {
+    size_t target = arrlast(ctx.starts) + SCORE_CHUNK_SIZE;
+    const char *newline = target < size ? memchr(data + target, '\n', size - target) : NULL;
+    arrput(ctx.starts, newline != NULL ? (size_t)(newline - data) + 1 : size);
+  }
+
+  size_t chunks = arrlenu(ctx.starts) - 1;
+  size_t window = threads * SCORE_WINDOW_CHUNKS;
+  ctx.outputs = SPAM_MALLOC(window * sizeof(char *));
+  ctx.ready = SPAM_MALLOC(window * sizeof(bool));
+  if (ctx.outputs == NULL || ctx.ready == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t begin = 0; begin < chunks; begin += window) {
+    size_t end = begin + window < chunks ? begin + window : chunks;
+    ctx.window_begin = begin;
+    ctx.window_end = end;
+    memset(ctx.ready, 0, window * sizeof(bool));
+    steal_for(begin, end, threads, score_chunk, &ctx);
+  }
+
+  SPAM_FREE(ctx.outputs);
+  SPAM_FREE(ctx.ready);
+  arrfree(ctx.starts);
+  pthread_mutex_destroy(&ctx.lock);
+  if (size > 0) munmap((void *)data, size);
+  return ctx.messages;
+}
+
+/*
+ * Scores every line of the file at path and writes "spam|ham<TAB>probability"
+ * lines to out in input order, going through the score shortcuts if given.
+ * Returns the number of messages.
+ */
+size_t score_file(const spamclf_model *m, const char *path, size_t threads,
+                  const score_shortcuts *shortcuts, FILE *out) {
+  score_context setup = { .m = m, .shortcuts = shortcuts, .out = out };
+  return score_lines(&setup, path, threads);
+}
+
+/*
+ * score_file() with every model of an indexed registry, each line of out
+ * holding one "spam|ham<TAB>probability" pair per model.
+ */
+size_t score_registry_file(const model_registry *r, const char *path, size_t threads, FILE *out) {
+  score_context setup = { .registry = r, .out = out };
+  return score_lines(&setup, path, threads);
+}
+
+/*
+ * Loads the comma separated model paths into one registry.
+ */
+void open_registry(model_registry *r, const char *paths) {
+  char *list = strdup(paths);
+  if (list == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(r, 0, sizeof(*r));
+  char *save;
+  for (char *path = strtok_r(list, ",", &save); path != NULL; path = strtok_r(NULL, ",", &save)) {
+    size_t id;
+    check_status(registry_load(r, path, &id), path);
+  }
+  check_status(registry_index(r), "Failed to index the models");
+  free(list);
+}
+
+/*
+ * Sets up a result cache of cache_size entries and a near-duplicate index of
+ * near_size entries, each left out if its size is 0. Returns NULL if both
+ * are.
+ */
+score_shortcuts *open_shortcuts(size_t cache_size, size_t near_size) {
+  if (cache_size == 0 && near_size == 0) return NULL;
+  score_shortcuts *s = SPAM_CALLOC(1, sizeof(score_shortcuts));
+  if (s == NULL ||
+      (cache_size > 0 && (s->cache = SPAM_MALLOC(sizeof(result_cache))) == NULL) ||
+      (near_size > 0 && (s->near = SPAM_MALLOC(sizeof(near_dup_index))) == NULL)) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (s->cache != NULL) {
+    check_status(result_cache_init(s->cache, cache_size), "Failed to create the result cache");
+  }
+  if (s->near != NULL) {
+    check_status(near_dup_init(s->near, near_size, NEAR_DUP_DISTANCE),
+                 "Failed to create the near-duplicate index");
+  }
+  return s;
+}
+
+void close_shortcuts(score_shortcuts *s) {
+  if (s == NULL) return;
+  if (s->cache != NULL) {
+    result_cache_free(s->cache);
+    SPAM_FREE(s->cache);
+  }
+  if (s->near != NULL) {
+    near_dup_free(s->near);
+    SPAM_FREE(s->near);
+  }
+  SPAM_FREE(s);
+}
+
+void print_hit_rate(const char *name, uint64_t hits, uint64_t misses) {
+  fprintf(stderr, "%s: %llu hits, %llu misses (%.1f%% hit rate).\n", name,
+          (unsigned long long)hits, (unsigned long long)misses,
+          hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+void score_model(char *path, char *input, size_t threads, size_t cache_size, size_t near_size) {
+  if (input == NULL) {
+    fprintf(stderr, "Error: --score expects a file with one message per line.\n");
+    exit(1);
+  }
+  if (strchr(path, ',') != NULL) {
+    if (cache_size > 0 || near_size > 0) {
+      fprintf(stderr, "Warning: --result-cache and --near-dups are ignored with several models.\n");
+    }
+    model_registry r;
+    open_registry(&r, path);
+    double start = now_seconds();
+    size_t messages = score_registry_file(&r, input, threads, stdout);
+    double elapsed = now_seconds() - start;
+    fflush(stdout);
+    fprintf(stderr, "Scored %zu messages with %zu models in %.3fs (%.0f messages/s) on %zu threads.\n",
+            messages, arrlenu(r.models), elapsed, messages / elapsed, threads);
+    fprintf(stderr, "Registry: %zu shared tokens, %.1f MiB.\n",
+            arrlenu(r.offsets), registry_memory(&r) / 1048576.0);
+    free_registry(&r);
+    return;
+  }
+  spamclf_model *m = open_model(path);
+  score_shortcuts *shortcuts = open_shortcuts(cache_size, near_size);
+
+  double start = now_seconds();
+  size_t messages = score_file(m, input, threads, shortcuts, stdout);
+  double elapsed = now_seconds() - start;
+  fflush(stdout);
+  fprintf(stderr, "Scored %zu messages in %.3fs (%.0f messages/s) on %zu threads.\n",
+          messages, elapsed, messages / elapsed, threads);
+  uint64_t hits, misses;
+  if (shortcuts != NULL && shortcuts->cache != NULL) {
+    result_cache_counts(shortcuts->cache, &hits, &misses);
+    print_hit_rate("Result cache", hits, misses);
+  }
+  if (shortcuts != NULL && shortcuts->near != NULL) {
+    near_dup_counts(shortcuts->near, &hits, &misses);
+    print_hit_rate("Near-duplicates", hits, misses);
+  }
+
+  close_shortcuts(shortcuts);
+  spamclf_free(m);
+}
+
+atomic_bool serve_stop;       // Set by SIGINT and SIGTERM while serving.
+atomic_bool reload_requested; // Set by SIGHUP while serving.
+
+void handle_serve_signal(int signal) {
+  atomic_store(signal == SIGHUP ? &reload_requested : &serve_stop, true);
+}
+
+void handle_serve_signals(void) {
+  struct sigaction action = { .sa_handler = handle_serve_signal };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGHUP, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ * What identifies the contents of a model file, to notice it being replaced.
+ */
+typedef struct file_version {
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+} file_version;
+
+bool read_file_version(const char *path, file_version *v) {
+  struct stat st;
+  if (stat(path, &st) != 0) return false;
+  *v = (file_version){ st.st_dev, st.st_ino, st.st_size, st.st_mtim };
+  return true;
+}
+
+bool same_file_version(const file_version *a, const file_version *b) {
+  return a->device == b->device && a->inode == b->inode && a->size == b->size &&
+    a->modified.tv_sec == b->modified.tv_sec && a->modified.tv_nsec == b->modified.tv_nsec;
+}
+
+typedef struct reload_watch {
+  const char *path;
+  live_model *live;
+} reload_watch;
+
+/*
+ * Reloads the model on SIGHUP, or when its file changes, until serving
+ * stops. The new model is loaded and checked on this thread while the old
+ * one keeps serving, and one that fails to load is not published.
+ */
+void *reload_worker(void *arg) {
+  reload_watch *w = arg;
+  file_version seen = {0};
+  read_file_version(w->path, &seen);
+  while (!atomic_load(&serve_stop)) {
+    usleep(RELOAD_POLL_MS * 1000);
+    file_version current;
+    bool changed = read_file_version(w->path, &current) && !same_file_version(&current, &seen);
+    if (!atomic_exchange(&reload_requested, false) && !changed) continue;
+    if (changed) seen = current;
+
+    double start = now_seconds();
+    model *m;
+    spamclf_status status = load_live_model(w->path, &m);
+    if (status != SPAMCLF_OK) {
+      fprintf(stderr, "Failed to reload %s: %s. Keeping the current model.\n", w->path,
+              spamclf_strerror(status));
+      continue;
+    }
+    live_model_publish(w->live, m);
+    printf("Reloaded %s in %.3fs\n", w->path, now_seconds() - start);
+    fflush(stdout);
+  }
+  return NULL;
+}
+
+/*
+ * Writes the merged metrics and the counters of the score shortcuts to out
+ * in the Prometheus text format.
+ */
+void write_all_stats(const classify_stats *stats, const score_shortcuts *shortcuts, FILE *out) {
+  stats_snapshot snapshot;
+  stats_merge(stats, &snapshot);
+  write_stats(&snapshot, out);
+  if (shortcuts != NULL && shortcuts->cache != NULL) write_cache_stats(shortcuts->cache, out);
+  if (shortcuts != NULL && shortcuts->near != NULL) write_near_dup_stats(shortcuts->near, out);
+}
+
+/*
+ * Writes the metrics to path through a temporary file renamed over it, so
+ * scrapers never read a partial file.
+ */
+void export_stats_file(const classify_stats *stats, const score_shortcuts *shortcuts,
+                       const char *path) {
+  char temp[BUFFER_SIZE];
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  FILE *file = fopen(temp, "w");
+  if (file == NULL) {
+    perror("Failed to write metrics");
+    return;
+  }
+  write_all_stats(stats, shortcuts, file);
+  if (fclose(file) != 0 || rename(temp, path) != 0) {
+    perror("Failed to write metrics");
+    unlink(temp);
+  }
+}
+
+/*
+ * Answers every connection to a Unix socket with the merged metrics as an
+ * HTTP response, e.g. for `curl --unix-socket PATH http://localhost/metrics`.
+ */
+void serve_stats_socket(const classify_stats *stats, const score_shortcuts *shortcuts,
+                        const char *path) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Error: Metrics socket path %s is too long.\n", path);
+    return;
+  }
+  strcpy(address.sun_path, path);
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (server == -1 || bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(server, 16) != 0) {
+    perror("Failed to open metrics socket");
+    if (server != -1) close(server);
+    return;
+  }
+
+  while (!atomic_load(&serve_stop)) {
+    struct pollfd ready = { .fd = server, .events = POLLIN };
+    if (poll(&ready, 1, RELOAD_POLL_MS) <= 0) continue;
+    int client = accept(server, NULL, NULL);
+    if (client == -1) continue;
+    // The request is not parsed, only waited for briefly.
+    char request[BUFFER_SIZE];
+    struct pollfd incoming = { .fd = client, .events = POLLIN };
+    if (poll(&incoming, 1, RELOAD_POLL_MS) > 0) {
+      ssize_t ignored = read(client, request, sizeof(request));
+      (void)ignored;
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (out != NULL) {
+      write_all_stats(stats, shortcuts, out);
+      fclose(out);
+      char header[SMALL_BUFFER_SIZE];
+      int header_len = snprintf(header, sizeof(header),
+                                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n\r\n", body_len);
+      if (write_exact(client, header, header_len)) write_exact(client, body, body_len);
+      free(body);
+    }
+    close(client);
+  }
+  close(server);
+  unlink(path);
+}
+
+typedef struct stats_export {
+  const classify_stats *stats;
+  const score_shortcuts *shortcuts; // Optional.
+  const char *target;  // File path, or unix:PATH for a socket.
+} stats_export;
+
+/*
+ * Exports the metrics until serving stops: answers a Unix socket, or
+ * rewrites a file every STATS_EXPORT_MS and once more at the end.
+ */
+void *stats_export_worker(void *arg) {
+  stats_export *e = arg;
+  if (strncmp(e->target, "unix:", 5) == 0) {
+    serve_stats_socket(e->stats, e->shortcuts, e->target + 5);
+    return NULL;
+  }
+  while (!atomic_load(&serve_stop)) {
+    for (size_t waited = 0; waited < STATS_EXPORT_MS && !atomic_load(&serve_stop);
+         waited += RELOAD_POLL_MS) {
+      usleep(RELOAD_POLL_MS * 1000);
+    }
+    export_stats_file(e->stats, e->shortcuts, e->target);
+  }
+  return NULL;
+}
+
+/*
+ * Classifies messages of clients on this host, sent through the shared
+ * memory ring name (see spamclf_ring_connect()), until interrupted. The model
+ * is swapped for a new one without pausing when its file changes. With a
+ * metrics target, latency and counters are exported for Prometheus.
+ */
+void serve_model(char *path, char *name, char *metrics_target, size_t cache_size,
+                 size_t near_size) {
+  model *m;
+  check_status(load_live_model(path, &m), "Failed to read model");
+  live_model live;
+  live_model_init(&live, m);
+  handle_serve_signals();
+
+  reload_watch watch = { .path = path, .live = &live };
+  pthread_t reloader;
+  if (pthread_create(&reloader, NULL, reload_worker, &watch) != 0) {
+    perror("Failed to create thread");
+    exit(EXIT_FAILURE);
+  }
+  score_shortcuts *shortcuts = open_shortcuts(cache_size, near_size);
+  classify_stats *stats = NULL;
+  stats_export export = { .target = metrics_target, .shortcuts = shortcuts };
+  pthread_t exporter;
+  if (metrics_target != NULL) {
+    stats = SPAM_CALLOC(1, sizeof(classify_stats));
+    if (stats == NULL) {
+      printf("Memory allocation failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    export.stats = stats;
+    if (pthread_create(&exporter, NULL, stats_export_worker, &export) != 0) {
+      perror("Failed to create thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  printf("Serving %s on shared memory ring %s\n", path, name);
+  fflush(stdout);
+  spamclf_status status = serve_ring(&live, stats, shortcuts, name, &serve_stop);
+  atomic_store(&serve_stop, true);
+  pthread_join(reloader, NULL);
+  if (metrics_target != NULL) {
+    pthread_join(exporter, NULL);
+    SPAM_FREE(stats);
+  }
+  close_shortcuts(shortcuts);
+  if (status == SPAMCLF_ERROR_UNAVAILABLE) {
+    fprintf(stderr, "Error: Another server is already serving %s.\n", name);
+    exit(1);
+  }
+  check_status(status, "Failed to serve");
+  live_model_free(&live);
+}
+
+// ---------- Benchmarks ----------
+
+/*
+ * Reads the messages of the dataset, lowercased and without their labels.
+ */
+char **read_messages(char *dataset) {
+  dataset_reader reader;
+  open_dataset(&reader, dataset);
+
+  char **messages = NULL;
+  char *text = NULL;
+  bool is_spam;
+  const char *message;
+  size_t len;
+  while (next_message(&reader, &is_spam, &message, &len)) {
+    arrput(messages, str_dup(str_lwr_copy(&text, message, len)));
+  }
+  arrfree(text);
+  close_dataset(&reader);
+  return messages;
+}
+
+void free_messages(char **messages) {
+  for (size_t i = 0; i < arrlenu(messages); ++i) {
+    SPAM_FREE(messages[i]);
+  }
+  arrfree(messages);
+}
+
+/*
+ * Batch scoring throughput of each feature stream relative to unigrams.
+ */
+void bench_features(char *dataset) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+  size_t bytes = 0;
+  for (size_t i = 0; i < arrlenu(messages); ++i) {
+    bytes += strlen(messages[i]);
+  }
+
+  const struct { const char *name; uint32_t flags; } modes[] = {
+    { "unigrams", 0 },
+    { "+ bigrams", FEATURE_BIGRAMS },
+    { "+ char n-grams", FEATURE_CHAR_NGRAMS },
+    { "+ both", FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS },
+  };
+
+  printf("%-16s %12s %10s %8s\n", "Features", "Messages/s", "MB/s", "Slowdown");
+  double baseline = 0.0;
+  for (size_t k = 0; k < sizeof(modes) / sizeof(modes[0]); ++k) {
+    model m = { .flags = modes[k].flags, .hash_bits = HASH_BITS };
+    corpus c;
+    build_corpus(dataset, &stop_words, &c, &m);
+    free_corpus(&c);
+    check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
+
+    volatile float sink = 0.0f;
+    size_t scored = 0;
+    double start = now_seconds(), elapsed;
+    do {
+      for (size_t i = 0; i < arrlenu(messages); ++i) {
+        sink += classify_score(&m, messages[i], strlen(messages[i]));
+      }
+      scored += arrlenu(messages);
+      elapsed = now_seconds() - start;
+    } while (elapsed < 1.0);
+    (void)sink;
+
+    double rate = scored / elapsed;
+    if (k == 0) baseline = rate;
+    printf("%-16s %12.0f %10.2f %7.2fx\n", modes[k].name, rate,
+           rate * bytes / arrlenu(messages) / 1e6, baseline / rate);
+
+    free_model(&m);
+  }
+
+  free_messages(messages);
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+/*
+ * Token lookup cost of stb_ds, the token table and the vocabulary index over
+ * the token stream of the dataset.
+ */
+void bench_lookup(char *dataset) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+
+  model m = {0};
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+  free_corpus(&c);
+
+  struct { char *key; size_t value; } *stb_table = NULL;
+  sh_new_strdup(stb_table);
+  token_table table = {0};
+  for (size_t i = 0; i < m.vocabulary_size; ++i) {
+    size_t len;
+    const char *token = vocabulary_token(&m, i, &len);
+    char key[BUFFER_SIZE];
+    memcpy(key, token, len);
+    key[len] = '\0';
+    shput(stb_table, key, i);
+    check_status(token_table_insert(&table, m.pool, m.offsets, token, len, i),
+                 "Failed to index vocabulary");
+  }
+  check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
+
+  // Every accepted token of every message, NUL separated.
+  char *stream = NULL;
+  size_t *starts = NULL;
+  for (size_t i = 0; i < arrlenu(messages); ++i) {
+    extract_token_words(messages[i], &stop_words, {
+        arrput(starts, arrlenu(stream));
+        for (char *p = buf; *p; ++p) arrput(stream, *p);
+        arrput(stream, '\0');
+      });
+  }
+  const size_t tokens = arrlenu(starts);
+
+  printf("%-20s %12s %10s\n", "Table", "Lookups/s", "ns/lookup");
+  for (int k = 0; k < 3; ++k) {
+    const char *names[] = { "stb_ds shgeti", "token_table", "vocabulary index" };
+    size_t found = 0, lookups = 0;
+    double start = now_seconds(), elapsed;
+    do {
+      for (size_t i = 0; i < tokens; ++i) {
+        char *token = stream + starts[i];
+        size_t len = (i + 1 < tokens ? starts[i + 1] : arrlenu(stream)) - starts[i] - 1;
+        switch (k) {
+        case 0: found += shgeti(stb_table, token) != -1; break;
+        case 1: found += token_table_find(&table, m.pool, m.offsets, token, len) != -1; break;
+        case 2: found += lookup_token(&m, token, len) != -1; break;
+        }
+      }
+      lookups += tokens;
+      elapsed = now_seconds() - start;
+    } while (elapsed < 1.0);
+    if (found != lookups) {
+      fprintf(stderr, "Error: %s missed %zu tokens.\n", names[k], lookups - found);
+      exit(1);
+    }
+    printf("%-20s %12.0f %10.1f\n", names[k], lookups / elapsed, elapsed * 1e9 / lookups);
+  }
+
+  arrfree(stream);
+  arrfree(starts);
+  shfree(stb_table);
+  free_token_table(&table);
+  free_model(&m);
+  free_messages(messages);
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+/*
+ * Throughput of the dense kernels at every instruction set level the CPU
+ * supports, for a vector that fits in L1 and one that does not fit in L2.
+ */
+void bench_kernels(void) {
+  const size_t sizes[] = { 4096, 1 << 22 };
+  printf("%-8s %10s %12s %12s %16s\n", "Kernels", "Length", "dot GFLOP/s",
+         "axpy GFLOP/s", "update GFLOP/s");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    size_t n = sizes[s];
+    float *x = SPAM_MALLOC(n * sizeof(float));
+    float *y = SPAM_MALLOC(n * sizeof(float));
+    if (x == NULL || y == NULL) {
+      printf("Memory allocation failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      x[i] = (float)(i % 97) / 97.0f;
+      y[i] = (float)(i % 89) / 89.0f;
+    }
+
+    for (size_t k = 0; k < KERNEL_LEVELS; ++k) {
+      const kernels *kn = &kernel_levels[k];
+      if (!kernel_supported(kn)) continue;
+      double gflops[3];
+      for (int op = 0; op < 3; ++op) {
+        volatile float sink = 0.0f;
+        size_t calls = 0;
+        double start = now_seconds(), elapsed;
+        do {
+          for (int r = 0; r < 16; ++r) {
+            switch (op) {
+            case 0: sink += kn->dot(x, y, n); break;
+            case 1: kn->axpy(1e-6f, x, y, n); break;
+            case 2: kn->reg_update(y, x, 1e-6f, 1e-3f, n); break;
+            }
+          }
+          calls += 16;
+          elapsed = now_seconds() - start;
+        } while (elapsed < 0.2);
+        (void)sink;
+        const double flops_per_element[] = { 2, 2, 4 };
+        gflops[op] = calls * n * flops_per_element[op] / elapsed / 1e9;
+      }
+      printf("%-8s %10zu %12.2f %12.2f %16.2f\n", kn->name, n, gflops[0], gflops[1], gflops[2]);
+    }
+    SPAM_FREE(x);
+    SPAM_FREE(y);
+  }
+  printf("Selected: %s\n", kernel.name);
+}
+
+/*
+ * Mean weighted cross-entropy of the items in [begin, end).
+ */
+double log_loss(const corpus *c, size_t begin, size_t end, const float *weights, float bias) {
+  double loss = 0.0;
+  for (size_t i = begin; i < end; ++i) {
+    float p = sigmoidf(item_score(&c->items[i], weights, bias));
+    p = fminf(fmaxf(p, 1e-7f), 1.0f - 1e-7f);
+    loss -= c->items[i].is_spam ? log(p) : log(1.0f - p);
+  }
+  return end > begin ? loss / (end - begin) : 0.0;
+}
+
+/*
+ * Trains on the first TRAIN_TEST_SPLIT percent of the corpus with a range of
+ * batch sizes and prints the epoch time, held-out loss and F1-Score after
+ * every epoch.
+ */
+void bench_batch_sizes(const corpus *c, hyperparams hp) {
+  const size_t batch_sizes[] = { 1, 4, 16, 64, 256, 1024 };
+  size_t train_size = TRAIN_TEST_SPLIT * ((float)arrlen(c->items) / 100.0f);
+  float *weights = SPAM_MALLOC(c->feature_count * sizeof(float));
+  if (weights == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%5s  %5s  %9s  %13s  %9s  %8s\n", "Batch", "Epoch", "Time (s)", "Examples/s",
+         "Log loss", "F1-Score");
+  for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); ++b) {
+    hp.batch_size = batch_sizes[b];
+    memset(weights, 0, c->feature_count * sizeof(float));
+    float bias = 0.0f;
+    for (size_t e = 1; e <= hp.epochs; ++e) {
+      double start = now_seconds();
+      sgd_epoch(c, &hp, train_size, arrlenu(c->items), weights, &bias);
+      double elapsed = now_seconds() - start;
+      metrics result = {0};
+      evaluate(c, train_size, arrlenu(c->items), weights, bias, &result);
+      printf("%5zu  %5zu  %9.3f  %13.0f  %9.4f  %7.2f%%\n", hp.batch_size, e, elapsed,
+             train_size / elapsed, log_loss(c, train_size, arrlenu(c->items), weights, bias),
+             result.f1_score * 100.0f);
+    }
+  }
+  SPAM_FREE(weights);
+}
+
+void bench_batch(char *dataset, const hyperparams *hp) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  model m = {0};
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+  free_model(&m);
+
+  printf("%s: %zu messages, %zu features\n", dataset, arrlenu(c.items), c.feature_count);
+  bench_batch_sizes(&c, *hp);
+
+  free_corpus(&c);
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+/*
+ * Same as bench_batch on SYNTHETIC_ROWS generated messages of SYNTHETIC_TERMS
+ * Zipf-like distributed terms each, labelled by a hidden linear model.
+ */
+void bench_batch_synthetic(const hyperparams *hp) {
+  corpus c = { .items = NULL, .feature_count = SYNTHETIC_FEATURES };
+  uint64_t state = 1;
+  for (size_t i = 0; i < SYNTHETIC_ROWS; ++i) {
+    item itm = { .is_spam = false, .features = NULL };
+    uint32_t terms[SYNTHETIC_TERMS];
+    for (size_t t = 0; t < SYNTHETIC_TERMS; ++t) {
+      double u = (double)((state = mix64(state)) >> 11) / 9007199254740992.0;
+      terms[t] = (uint32_t)(u * u * u * SYNTHETIC_FEATURES);
+    }
+    qsort(terms, SYNTHETIC_TERMS, sizeof(uint32_t), compare_u32);
+
+    float z = 0.0f;
+    for (size_t t = 0; t < SYNTHETIC_TERMS; ++t) {
+      if (t > 0 && terms[t] == terms[t - 1]) continue;
+      feature f = { terms[t], 1.0f };
+      arrput(itm.features, f);
+      z += ((int)(mix64(terms[t]) % 2001) - 1000) / 500.0f;
+    }
+    double u = (double)((state = mix64(state)) >> 11) / 9007199254740992.0;
+    itm.is_spam = u < sigmoidf(z);
+    arrput(c.items, itm);
+  }
+
+  hyperparams synthetic = *hp;
+  synthetic.ham_weight = synthetic.spam_weight = 1.0f;
+  printf("Synthetic: %zu messages, %zu features\n", arrlenu(c.items), c.feature_count);
+  bench_batch_sizes(&c, synthetic);
+  free_corpus(&c);
+}
+
+/*
+ * Accuracy and throughput of the approximate sigmoid at every kernel level
+ * against expf(), and agreement of the thresholded decisions on the scores of
+ * a model trained on --dataset.
+ */
+void bench_sigmoid(char *dataset, const hyperparams *hp) {
+  const size_t n = 1 << 20;
+  float *z = SPAM_MALLOC(n * sizeof(float));
+  float *p = SPAM_MALLOC(n * sizeof(float));
+  if (z == NULL || p == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    z[i] = -100.0f + 200.0f * i / (n - 1);
+  }
+
+  printf("%-8s %14s %14s %12s\n", "Sigmoid", "Max abs error", "Max rel error", "M values/s");
+  for (size_t k = 0; k <= KERNEL_LEVELS; ++k) {
+    const kernels *kn = k < KERNEL_LEVELS ? &kernel_levels[k] : NULL;
+    if (kn != NULL && !kernel_supported(kn)) continue;
+
+    double max_abs = 0.0, max_rel = 0.0;
+    if (kn != NULL) kn->sigmoid(z, p, n);
+    else for (size_t i = 0; i < n; ++i) p[i] = sigmoidf(z[i]);
+    for (size_t i = 0; i < n; ++i) {
+      double exact = 1.0 / (1.0 + exp(-(double)z[i]));
+      double error = fabs(p[i] - exact);
+      if (error > max_abs) max_abs = error;
+      if (exact > 1e-30 && error / exact > max_rel) max_rel = error / exact;
+    }
+
+    size_t calls = 0;
+    double start = now_seconds(), elapsed;
+    do {
+      if (kn != NULL) kn->sigmoid(z, p, n);
+      else for (size_t i = 0; i < n; ++i) p[i] = sigmoidf(z[i]);
+      ++calls;
+      elapsed = now_seconds() - start;
+    } while (elapsed < 0.2);
+    printf("%-8s %14.3g %14.3g %12.1f\n", kn != NULL ? kn->name : "expf", max_abs, max_rel,
+           calls * n / elapsed / 1e6);
+  }
+  SPAM_FREE(z);
+  SPAM_FREE(p);
+
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  model m = {0};
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+  metrics result;
+  fit(&c, hp, arrlenu(c.items), arrlenu(c.items), m.weights, &m.bias, &result);
+
+  const float thresholds[] = { SPAMCLF_THRESHOLD, EVALUATION_THRESHOLD };
+  for (size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); ++t) {
+    size_t fast_changed = 0, logit_changed = 0, spam = 0;
+    for (size_t i = 0; i < arrlenu(c.items); ++i) {
+      float score = item_score(&c.items[i], m.weights, m.bias);
+      float fast;
+      kernel.sigmoid(&score, &fast, 1);
+      bool exact_decision = sigmoidf(score) > thresholds[t];
+      spam += exact_decision;
+      fast_changed += (fast > thresholds[t]) != exact_decision;
+      logit_changed += (score > logit(thresholds[t])) != exact_decision;
+    }
+    printf("Threshold %.2f: %zu of %zu messages spam, decisions changed: %zu approximate, %zu logit\n",
+           thresholds[t], spam, arrlenu(c.items), fast_changed, logit_changed);
+  }
+
+  free_corpus(&c);
+  free_model(&m);
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+/*
+ * Batch scoring throughput against the number of threads, on an archive of
+ * SCORE_BENCH_SIZE bytes made by repeating the messages of --dataset.
+ */
+void bench_score(char *dataset, const hyperparams *hp) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+
+  model m = {0};
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+  metrics result;
+  fit(&c, hp, arrlenu(c.items), arrlenu(c.items), m.weights, &m.bias, &result);
+  free_corpus(&c);
+  check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
+
+  char path[] = "/tmp/spam-score-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *archive = fd != -1 ? fdopen(fd, "w") : NULL;
+  FILE *sink = fopen("/dev/null", "w");
+  if (archive == NULL || sink == NULL) {
+    perror("Failed to create benchmark files");
+    exit(1);
+  }
+  size_t bytes = 0;
+  for (size_t i = 0; bytes < SCORE_BENCH_SIZE; i = (i + 1) % arrlenu(messages)) {
+    bytes += fprintf(archive, "%s\n", messages[i]);
+  }
+  fclose(archive);
+
+  printf("%7s  %9s  %10s  %14s  %7s\n", "Threads", "Time (s)", "MB/s", "Messages/s", "Speedup");
+  double single = 0.0;
+  size_t max_threads = default_threads() > 1 ? default_threads() : 2;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    double start = now_seconds();
+    size_t scored = score_file(&m, path, threads, NULL, sink);
+    double elapsed = now_seconds() - start;
+    if (threads == 1) single = elapsed;
+    printf("%7zu  %9.3f  %10.1f  %14.0f  %6.2fx\n", threads, elapsed, bytes / elapsed / 1e6,
+           scored / elapsed, single / elapsed);
+  }
+
+  fclose(sink);
+  unlink(path);
+  free_model(&m);
+  free_messages(messages);
+  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
+    SPAM_FREE(stop_words[i]);
+  }
+  arrfree(stop_words);
+}
+
+/*
+ * Appends a message as a CSV record, quoting it when it holds a comma, a
+ * quote or a line break. In forced mode every message is quoted and gets an
+ * escaped quote and a line break, the slowest input for the parser.
+ */
+void append_csv_record(char **out, bool is_spam, const char *message, size_t len, bool forced) {
+  const char *label = is_spam ? "spam," : "ham,";
+  memcpy(arraddnptr(*out, strlen(label)), label, strlen(label));
+  bool quote = forced || memchr(message, ',', len) || memchr(message, '"', len) ||
+    memchr(message, '\n', len);
+  if (quote) arrput(*out, '"');
+  for (size_t i = 0; i < len; ++i) {
+    if (message[i] == '"') arrput(*out, '"');
+    arrput(*out, message[i]);
+  }
+  if (forced) {
+    const char *extra = " \"\"quoted\"\"\nsecond line";
+    memcpy(arraddnptr(*out, strlen(extra)), extra, strlen(extra));
+  }
+  if (quote) arrput(*out, '"');
+  arrput(*out, '\n');
+}
+
+/*
+ * Parse throughput of the CSV reader over the messages of --dataset repeated
+ * to CSV_BENCH_SIZE bytes in memory, as written by a CSV writer and with
+ * every message quoted and holding an escaped quote and a line break.
+ */
+void bench_csv(char *dataset) {
+  char *inputs[2] = { NULL, NULL };
+  dataset_reader reader;
+  open_dataset(&reader, dataset);
+  bool is_spam;
+  const char *message;
+  size_t len;
+  while (next_message(&reader, &is_spam, &message, &len)) {
+    append_csv_record(&inputs[0], is_spam, message, len, false);
+    append_csv_record(&inputs[1], is_spam, message, len, true);
+  }
+  close_dataset(&reader);
+
+  const char *names[2] = { "plain", "quoted" };
+  printf("%-7s  %9s  %10s  %9s  %7s\n", "Input", "MB", "Records", "Time (s)", "GB/s");
+  for (size_t k = 0; k < 2; ++k) {
+    size_t once = arrlenu(inputs[k]);
+    if (once == 0) continue;
+    while (arrlenu(inputs[k]) < CSV_BENCH_SIZE) {
+      char *copy = arraddnptr(inputs[k], once);
+      memcpy(copy, inputs[k], once);
+    }
+
+    double best = 0.0;
+    size_t records = 0;
+    for (size_t run = 0; run < 3; ++run) {
+      csv_parser csv;
+      csv_init(&csv, inputs[k], arrlenu(inputs[k]));
+      const char *field;
+      size_t field_len;
+      bool last;
+      records = 0;
+      double start = now_seconds();
+      while (csv_field(&csv, &field, &field_len, &last)) {
+        records += last;
+      }
+      double elapsed = now_seconds() - start;
+      csv_free(&csv);
+      if (run == 0 || elapsed < best) best = elapsed;
+    }
+    printf("%-7s  %9.1f  %10zu  %9.3f  %7.2f\n", names[k], arrlenu(inputs[k]) / 1e6, records,
+           best, arrlenu(inputs[k]) / best / 1e9);
+    arrfree(inputs[k]);
+  }
+}
+
+/*
+ * Tokenizes --dataset repeated to INGEST_BENCH_SIZE bytes with the ingest
+ * pipeline on an increasing number of tokenizer threads, and checks that the
+ * corpus and vocabulary match those of the sequential run.
+ */
+void bench_ingest(char *dataset) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+
+  char *records = NULL;
+  dataset_reader reader;
+  open_dataset(&reader, dataset);
+  bool is_spam;
+  const char *message;
+  size_t len;
+  while (next_message(&reader, &is_spam, &message, &len)) {
+    append_csv_record(&records, is_spam, message, len, false);
+  }
+  close_dataset(&reader);
+
+  char path[] = "/tmp/spam-ingest-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *file = fd != -1 ? fdopen(fd, "w") : NULL;
+  if (file == NULL) {
+    perror("Failed to create benchmark files");
+    exit(1);
+  }
+  size_t bytes = fprintf(file, "v1,v2\n");
+  while (arrlenu(records) > 0 && bytes < INGEST_BENCH_SIZE) {
+    bytes += fwrite(records, 1, arrlenu(records), file);
+  }
+  fclose(file);
+  arrfree(records);
+
+  model reference = { .flags = FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS, .hash_bits = HASH_BITS };
+  corpus expected;
+  size_t saved_threads = ingest_threads;
+  size_t max_threads = default_threads() > 1 ? default_threads() : 2;
+  double single = 0.0;
+  bool failed = false;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    model m = { .flags = reference.flags, .hash_bits = reference.hash_bits };
+    corpus c;
+    ingest_threads = threads;
+    double start = now_seconds();
+    tokenize_corpus(path, &stop_words, &c, &m);
+    double elapsed = now_seconds() - start;
+    if (threads == 1) {
+      single = elapsed;
+      reference = m;
+      expected = c;
+    } else {
+      bool same = m.vocabulary_size == reference.vocabulary_size &&
+        memcmp(m.pool, reference.pool, arrlenu(m.pool)) == 0 &&
+        memcmp(m.counts, reference.counts, feature_count(&m) * sizeof(uint32_t)) == 0 &&
+        arrlenu(c.items) == arrlenu(expected.items);
+      for (size_t i = 0; same && i < arrlenu(c.items); ++i) {
+        same = c.items[i].is_spam == expected.items[i].is_spam &&
+          arrlenu(c.items[i].features) == arrlenu(expected.items[i].features) &&
+          memcmp(c.items[i].features, expected.items[i].features,
+                 arrlenu(c.items[i].features) * sizeof(feature)) == 0;
+      }
+      if (!same) {
+        fprintf(stderr, "Error: Corpus tokenized on %zu threads differs from the sequential one.\n",
+                threads);
+        failed = true;
+      }
+      free_corpus(&c);
+      free_model(&m);
+    }
+    printf("%zu threads: %.3fs, %.1f MB/s, %.2fx\n", threads, elapsed, bytes / elapsed / 1e6,
+           single / elapsed);
+  }
+  ingest_threads = saved_threads;
+
+  unlink(path);
+  free_corpus(&expected);
+  free_model(&reference);
+  free_stop_words(&stop_words);
+  if (failed) exit(EXIT_FAILURE);
+}
+
+/*
+ * Socket server of the ring benchmark: reads length prefixed messages and
+ * writes back their probabilities until the connection is closed.
+ */
+void serve_socket(int fd, const spamclf_model *m) {
+  char *buf = NULL;
+  uint32_t len;
+  while (read_exact(fd, &len, sizeof(len))) {
+    arrsetlen(buf, len + 1);
+    if (!read_exact(fd, buf, len)) break;
+    float probability = spamclf_classify(m, buf, len);
+    if (!write_exact(fd, &probability, sizeof(probability))) break;
+  }
+  arrfree(buf);
+}
+
+pid_t fork_or_exit(void) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("Failed to fork");
+    exit(EXIT_FAILURE);
+  }
+  return pid;
+}
+
+/*
+ * Prints the round trip latency percentiles and throughput of one mode.
+ * Latencies are sorted in place.
+ */
+void print_round_trips(const char *mode, double *latencies, size_t n, double elapsed,
+                       long mismatches) {
+  qsort(latencies, n, sizeof(*latencies), compare_double);
+  char checked[32] = "-";
+  if (mismatches >= 0) snprintf(checked, sizeof(checked), "%ld", mismatches);
+  printf("%-15s  %8zu  %9.1f  %9.1f  %12.0f  %10s\n", mode, n, latencies[n / 2] * 1e6,
+         latencies[n - 1 - n / 100] * 1e6, n / elapsed, checked);
+}
+
+/*
+ * Round trip latency and throughput of classifying the messages of --dataset
+ * through the shared memory ring server, against a Unix socket server and a
+ * new `-r` process per message. Results are checked against the in-process
+ * model, except for `-r`, which only prints a verdict.
+ */
+void bench_ring(char *dataset, const hyperparams *hp) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+  size_t n = arrlenu(messages);
+
+  model trained = { .flags = FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS, .hash_bits = HASH_BITS };
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &trained);
+  metrics result;
+  fit(&c, hp, arrlenu(c.items), arrlenu(c.items), trained.weights, &trained.bias, &result);
+  free_corpus(&c);
+  check_status(index_vocabulary(&trained), "Failed to build the vocabulary index");
+
+  char path[] = "/tmp/spam-ring-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("Failed to create benchmark files");
+    exit(1);
+  }
+  close(fd);
+  check_status(write_model(&trained, path), "Failed to write model");
+  spamclf_model *m = open_model(path);
+
+  size_t rounds = n < RING_BENCH_MESSAGES ? n : RING_BENCH_MESSAGES;
+  float *expected = SPAM_MALLOC(rounds * sizeof(float));
+  double *latencies = SPAM_MALLOC(rounds * sizeof(double));
+  if (expected == NULL || latencies == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < rounds; ++i) {
+    expected[i] = classify(&trained, messages[i], strlen(messages[i]));
+  }
+
+  printf("%-15s  %8s  %9s  %9s  %12s  %10s\n", "Mode", "Messages", "p50 (us)", "p99 (us)",
+         "Messages/s", "Mismatches");
+
+  // A new process per message, as a mail filter running `spam -r` would.
+  size_t processes = rounds < RING_BENCH_PROCESSES ? rounds : RING_BENCH_PROCESSES;
+  double start = now_seconds();
+  for (size_t i = 0; i < processes; ++i) {
+    double sent = now_seconds();
+    pid_t pid = fork_or_exit();
+    if (pid == 0) {
+      int null = open("/dev/null", O_RDWR);
+      dup2(null, 0);
+      dup2(null, 1);
+      execl("/proc/self/exe", "spam", "-r", "-m", path, "-i", messages[i], (char *)NULL);
+      _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Error: `-r` process exited with status %d.\n", status);
+      exit(EXIT_FAILURE);
+    }
+    latencies[i] = now_seconds() - sent;
+  }
+  print_round_trips("process (-r)", latencies, processes, now_seconds() - start, -1);
+
+  // One request at a time over a Unix socket.
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("Failed to create socket");
+    exit(EXIT_FAILURE);
+  }
+  pid_t server = fork_or_exit();
+  if (server == 0) {
+    close(fds[0]);
+    serve_socket(fds[1], m);
+    _exit(0);
+  }
+  close(fds[1]);
+  long mismatches = 0;
+  start = now_seconds();
+  for (size_t i = 0; i < rounds; ++i) {
+    double sent = now_seconds();
+    uint32_t len = strlen(messages[i]);
+    float probability;
+    if (!write_exact(fds[0], &len, sizeof(len)) || !write_exact(fds[0], messages[i], len) ||
+        !read_exact(fds[0], &probability, sizeof(probability))) {
+      fprintf(stderr, "Error: Socket server failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    latencies[i] = now_seconds() - sent;
+    mismatches += probability != expected[i];
+  }
+  print_round_trips("socket", latencies, rounds, now_seconds() - start, mismatches);
+  close(fds[0]);
+  waitpid(server, NULL, 0);
+
+  // The shared memory ring, one request at a time and then pipelined.
+  char name[64];
+  snprintf(name, sizeof(name), "/spam-bench-%d", (int)getpid());
+  server = fork_or_exit();
+  if (server == 0) {
+    handle_serve_signals();
+    model *served;
+    check_status(load_live_model(path, &served), "Failed to read model");
+    live_model live;
+    live_model_init(&live, served);
+    _exit(serve_ring(&live, NULL, NULL, name, &serve_stop) == SPAMCLF_OK ? 0 : 1);
+  }
+  spamclf_ring *ring = NULL;
+  spamclf_status status = SPAMCLF_ERROR_UNAVAILABLE;
+  for (size_t attempt = 0; attempt < 5000 && status == SPAMCLF_ERROR_UNAVAILABLE; ++attempt) {
+    status = spamclf_ring_connect(name, &ring);
+    if (status == SPAMCLF_ERROR_UNAVAILABLE) usleep(1000);
+  }
+  check_status(status, "Failed to connect to the ring server");
 
-void load_model(model *m, const char *path) {
-  FILE *file = fopen(path, "rb");
-  if (!file) {
-    perror("Failed to open file for reading");
-    exit(EXIT_FAILURE);
+  mismatches = 0;
+  start = now_seconds();
+  for (size_t i = 0; i < rounds; ++i) {
+    double sent = now_seconds();
+    float probability;
+    check_status(spamclf_ring_classify(ring, messages[i], strlen(messages[i]), &probability),
+                 "Ring round trip failed");
+    latencies[i] = now_seconds() - sent;
+    mismatches += probability != expected[i];
   }
+  print_round_trips("ring", latencies, rounds, now_seconds() - start, mismatches);
 
-  if (fread(m->weights, sizeof(float), VOCABULARY_SIZE, file) != VOCABULARY_SIZE) {
-    perror("Failed to read model weights.");
+  // Latency here is from submission to result, with up to RING_BENCH_WINDOW
+  // messages in flight.
+  mismatches = 0;
+  double *sent = SPAM_MALLOC(rounds * sizeof(double));
+  if (sent == NULL) {
+    printf("Memory allocation failed.\n");
     exit(EXIT_FAILURE);
   }
-  if (fread(&m->bias, sizeof(float), 1, file) != 1) {
-    perror("Failed to read model bias.");
-    exit(EXIT_FAILURE);
+  start = now_seconds();
+  for (size_t i = 0, received = 0; received < rounds;) {
+    if (i < rounds && i - received < RING_BENCH_WINDOW) {
+      sent[i] = now_seconds();
+      check_status(spamclf_ring_submit(ring, messages[i], strlen(messages[i])), "Ring submit failed");
+      i++;
+    } else {
+      float probability;
+      check_status(spamclf_ring_receive(ring, &probability), "Ring receive failed");
+      latencies[received] = now_seconds() - sent[received];
+      mismatches += probability != expected[received];
+      received++;
+    }
   }
-  if (fread(m->idf, sizeof(float), VOCABULARY_SIZE, file) != VOCABULARY_SIZE) {
-    perror("Failed to read model IDF.");
+  print_round_trips("ring pipelined", latencies, rounds, now_seconds() - start, mismatches);
+  SPAM_FREE(sent);
+
+  spamclf_ring_disconnect(ring);
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  unlink(path);
+  spamclf_free(m);
+  free_model(&trained);
+  SPAM_FREE(latencies);
+  SPAM_FREE(expected);
+  free_messages(messages);
+  free_stop_words(&stop_words);
+}
+
+typedef struct reload_bench {
+  live_model live;
+  char **messages;
+  const float *expected[2];  // Probabilities of each message under either model.
+  atomic_int phase;          // Index into latencies, or 2 to stop.
+  atomic_size_t mismatches;
+} reload_bench;
+
+typedef struct reload_reader_arg {
+  reload_bench *b;
+  double *latencies[2];  // Per phase: without and during reloads.
+} reload_reader_arg;
+
+void *reload_reader(void *arg) {
+  reload_reader_arg *r = arg;
+  reload_bench *b = r->b;
+  ptrdiff_t reader = live_reader_register(&b->live);
+  if (reader == -1) {
+    fprintf(stderr, "Error: Too many reader threads.\n");
     exit(EXIT_FAILURE);
   }
-  for (size_t i = 0; i < VOCABULARY_SIZE; ++i) {
-    if (fread(m->vocabulary[i], sizeof(char), 16, file) != 16) {
-      perror("Failed to read vocabulary.");
-      fclose(file);
-      exit(EXIT_FAILURE);
+  size_t n = arrlenu(b->messages);
+  for (size_t i = 0;; i = (i + 1) % n) {
+    int phase = atomic_load_explicit(&b->phase, memory_order_relaxed);
+    if (phase > 1) break;
+    double start = now_seconds();
+    const model *m = live_model_enter(&b->live, reader);
+    float probability = classify(m, b->messages[i], strlen(b->messages[i]));
+    live_model_exit(&b->live, reader);
+    arrput(r->latencies[phase], now_seconds() - start);
+    if (probability != b->expected[0][i] && probability != b->expected[1][i]) {
+      atomic_fetch_add(&b->mismatches, 1);
     }
-    m->vocabulary[i][15] = '\0';
   }
+  live_reader_unregister(&b->live, reader);
+  return NULL;
+}
 
-  fclose(file);
+void print_reload_latencies(const char *phase, double *latencies) {
+  size_t n = arrlenu(latencies);
+  if (n == 0) return;
+  qsort(latencies, n, sizeof(*latencies), compare_double);
+  printf("%-15s  %10zu  %9.2f  %9.2f  %10.2f  %9.1f\n", phase, n, latencies[n / 2] * 1e6,
+         latencies[n - 1 - n / 100] * 1e6, latencies[n - 1 - n / 1000] * 1e6,
+         latencies[n - 1] * 1e6);
 }
 
 /*
- * Dump the model into a file.
+ * Tail latency of classification while the model is hot reloaded. Reader
+ * threads classify the messages of --dataset for RELOAD_BENCH_MS, and then
+ * for as long again while a unigram and a bigram model saved from the same
+ * corpus are alternately loaded and published every RELOAD_BENCH_INTERVAL_MS.
+ * Every result has to match one of the two models.
  */
-void dump_model(model *m, const char *path) {
-  FILE *file = fopen(path, "wb");
-  if (!file) {
-    perror("Failed to open file for writing");
-    exit(EXIT_FAILURE);
+void bench_reload(char *dataset, const hyperparams *hp) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  reload_bench b = { .messages = read_messages(dataset) };
+  size_t n = arrlenu(b.messages);
+
+  const uint32_t modes[2] = { 0, FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS };
+  char paths[2][32];
+  float *expected[2];
+  for (size_t k = 0; k < 2; ++k) {
+    model m = { .flags = modes[k], .hash_bits = HASH_BITS };
+    corpus c;
+    build_corpus(dataset, &stop_words, &c, &m);
+    metrics result;
+    fit(&c, hp, arrlenu(c.items), arrlenu(c.items), m.weights, &m.bias, &result);
+    free_corpus(&c);
+    check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
+
+    expected[k] = SPAM_MALLOC((n + 1) * sizeof(float));
+    if (expected[k] == NULL) {
+      printf("Memory allocation failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      expected[k][i] = classify(&m, b.messages[i], strlen(b.messages[i]));
+    }
+    b.expected[k] = expected[k];
+
+    strcpy(paths[k], "/tmp/spam-reload-XXXXXX");
+    int fd = mkstemp(paths[k]);
+    if (fd == -1) {
+      perror("Failed to create benchmark files");
+      exit(1);
+    }
+    close(fd);
+    check_status(write_model(&m, paths[k]), "Failed to write model");
+    free_model(&m);
   }
 
-  if (fwrite(m->weights, sizeof(float), VOCABULARY_SIZE, file) != VOCABULARY_SIZE) {
-    perror("Failed to write weights");
-    fclose(file);
+  model *first;
+  check_status(load_live_model(paths[0], &first), "Failed to read model");
+  live_model_init(&b.live, first);
+  atomic_init(&b.phase, 0);
+  atomic_init(&b.mismatches, 0);
+
+  size_t readers = default_threads() > 2 ? default_threads() : 2;
+  pthread_t *threads = SPAM_MALLOC(readers * sizeof(pthread_t));
+  reload_reader_arg *args = SPAM_CALLOC(readers, sizeof(reload_reader_arg));
+  if (threads == NULL || args == NULL) {
+    printf("Memory allocation failed.\n");
     exit(EXIT_FAILURE);
   }
-  if (fwrite(&m->bias, sizeof(float), 1, file) != 1) {
-    perror("Failed to write bias");
-    fclose(file);
-    exit(EXIT_FAILURE);
+  for (size_t t = 0; t < readers; ++t) {
+    args[t].b = &b;
+    if (pthread_create(&threads[t], NULL, reload_reader, &args[t]) != 0) {
+      perror("Failed to create thread");
+      exit(EXIT_FAILURE);
+    }
   }
-  if (fwrite(m->idf, sizeof(float), VOCABULARY_SIZE, file) != VOCABULARY_SIZE) {
-    perror("Failed to write IDF");
-    fclose(file);
-    exit(EXIT_FAILURE);
+
+  usleep(RELOAD_BENCH_MS * 1000);
+  atomic_store(&b.phase, 1);
+  size_t reloads = 0;
+  double load_time = 0.0, publish_time = 0.0;
+  for (double end = now_seconds() + RELOAD_BENCH_MS / 1e3; now_seconds() < end;) {
+    usleep(RELOAD_BENCH_INTERVAL_MS * 1000);
+    double start = now_seconds();
+    model *m;
+    check_status(load_live_model(paths[++reloads % 2], &m), "Failed to read model");
+    double loaded = now_seconds();
+    live_model_publish(&b.live, m);
+    load_time += loaded - start;
+    publish_time += now_seconds() - loaded;
   }
-  for (size_t i = 0; i < VOCABULARY_SIZE; ++i) {
-    if (fwrite(m->vocabulary[i], sizeof(char), 16, file) != 16) {
-      perror("Failed to write vocabulary");
-      fclose(file);
-      exit(EXIT_FAILURE);
+  atomic_store(&b.phase, 2);
+  for (size_t t = 0; t < readers; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+
+  printf("%zu reader threads, %zu reloads (load %.2f ms, publish %.1f us on average)\n",
+         readers, reloads, 1e3 * load_time / reloads, 1e6 * publish_time / reloads);
+  printf("%-15s  %10s  %9s  %9s  %10s  %9s\n", "Phase", "Calls", "p50 (us)", "p99 (us)",
+         "p99.9 (us)", "Max (us)");
+  const char *phases[2] = { "steady", "reloading" };
+  for (size_t phase = 0; phase < 2; ++phase) {
+    double *all = NULL;
+    for (size_t t = 0; t < readers; ++t) {
+      memcpy(arraddnptr(all, arrlenu(args[t].latencies[phase])), args[t].latencies[phase],
+             arrlenu(args[t].latencies[phase]) * sizeof(double));
+      arrfree(args[t].latencies[phase]);
     }
+    print_reload_latencies(phases[phase], all);
+    arrfree(all);
   }
+  size_t mismatches = atomic_load(&b.mismatches);
+  printf("Mismatches: %zu\n", mismatches);
 
-  printf("Model saved to %s\n", path);
-  fclose(file);
+  live_model_free(&b.live);
+  for (size_t k = 0; k < 2; ++k) {
+    unlink(paths[k]);
+    SPAM_FREE(expected[k]);
+  }
+  SPAM_FREE(args);
+  SPAM_FREE(threads);
+  free_messages(b.messages);
+  free_stop_words(&stop_words);
+  if (mismatches > 0) exit(EXIT_FAILURE);
 }
 
-float sigmoidf(float x) {
-  return 1.0f / (1.0f + expf(-x));
-}
+typedef struct stats_bench_arg {
+  classify_stats *stats;
+  double elapsed;
+} stats_bench_arg;
 
-void print_help(char *prog) {
-  printf("Usage: %s [OPTION]...\n", prog);
-  printf("Train spam message detechtion machine learning model\n");
-  printf("Example: %s -t -o model.bin\n", prog);
+void *stats_bench_worker(void *arg) {
+  stats_bench_arg *a = arg;
+  stats_shard *shard = stats_register(a->stats);
+  uint64_t x = 0x9e3779b97f4a7c15ULL ^ (uintptr_t)shard;
+  double start = now_seconds();
+  for (size_t i = 0; i < STATS_BENCH_RECORDS; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    token_counts counts = { .tokens = x & 15, .unknown = (x >> 4) & 3 };
+    stats_record(shard, 1000 + (x >> 50), &counts, x & 1);
+  }
+  a->elapsed = now_seconds() - start;
+  stats_unregister(shard);
+  return NULL;
+}
 
-  printf("\nModel training:\n");
-  printf("  -t, --train     Train the machine learning model.\n");
-  printf("  -o, --output    Output file path where the model has to be stored.\n");
-  printf("  -d, --dataset   Path to dataset file.\n");
+/*
+ * Cost of recording a message in the classifier metrics: on 1, 2, ...
+ * threads recording into their own shards, and end to end over the messages
+ * of --dataset with the clock reads around each classification. Prints the
+ * resulting Prometheus export.
+ */
+void bench_stats(char *dataset, const hyperparams *hp) {
+  classify_stats *stats = SPAM_CALLOC(1, sizeof(classify_stats));
+  if (stats == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
 
-  printf("\nRun model:\n");
-  printf("  -r, --run       Run pre-trained model.\n");
-  printf("  -m, --model     Path to model file.\n");
-  printf("  -i, --input     Input string for the model.\n");
-}
+  printf("%7s  %14s\n", "Threads", "ns per record");
+  size_t max_threads = default_threads() > 1 ? default_threads() : 2;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    pthread_t workers[threads];
+    stats_bench_arg args[threads];
+    for (size_t t = 0; t < threads; ++t) {
+      args[t] = (stats_bench_arg){ .stats = stats };
+      if (pthread_create(&workers[t], NULL, stats_bench_worker, &args[t]) != 0) {
+        perror("Failed to create thread");
+        exit(EXIT_FAILURE);
+      }
+    }
+    double slowest = 0.0;
+    for (size_t t = 0; t < threads; ++t) {
+      pthread_join(workers[t], NULL);
+      if (args[t].elapsed > slowest) slowest = args[t].elapsed;
+    }
+    printf("%7zu  %14.2f\n", threads, 1e9 * slowest / STATS_BENCH_RECORDS);
+  }
+  double start = now_seconds();
+  stats_snapshot snapshot;
+  stats_merge(stats, &snapshot);
+  printf("Merging %d shards: %.1f us\n", STATS_SHARDS, 1e6 * (now_seconds() - start));
 
-void train_model(char *dataset, char *output) {
-  // Building the Vocabulary
   char **stop_words = NULL;
   get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+  model m = { .flags = FEATURE_BIGRAMS, .hash_bits = HASH_BITS };
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+  metrics result;
+  fit(&c, hp, arrlenu(c.items), arrlenu(c.items), m.weights, &m.bias, &result);
+  free_corpus(&c);
+  check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
 
-  FILE *file;
-  char buf[BUFFER_SIZE];
+  memset(stats, 0, sizeof(*stats));
+  stats_shard *shard = stats_register(stats);
+  volatile float sink = 0.0f;
+  double plain = 0.0, recorded = 0.0;
+  for (size_t round = 0; round < STRESS_ROUNDS; ++round) {
+    start = now_seconds();
+    for (size_t i = 0; i < arrlenu(messages); ++i) {
+      sink += classify(&m, messages[i], strlen(messages[i]));
+    }
+    plain += now_seconds() - start;
 
-  file = fopen(dataset, "r");
-  if (file == NULL) {
-    perror("Error opening file");
-    exit(1);
+    start = now_seconds();
+    for (size_t i = 0; i < arrlenu(messages); ++i) {
+      uint64_t sent = now_ns();
+      token_counts counts = {0};
+      float score = classify_score_counted(&m, messages[i], strlen(messages[i]), &counts);
+      sink += sigmoid(score);
+      stats_record(shard, now_ns() - sent, &counts, score > logit(SPAMCLF_THRESHOLD));
+    }
+    recorded += now_seconds() - start;
   }
+  (void)sink;
+  double n = (double)STRESS_ROUNDS * arrlenu(messages);
+  printf("Classify: %.1f ns per message, %.1f ns with timing and recording (%+.1f ns)\n\n",
+         1e9 * plain / n, 1e9 * recorded / n, 1e9 * (recorded - plain) / n);
 
-  model m;
+  stats_merge(stats, &snapshot);
+  write_stats(&snapshot, stdout);
 
-  item *items = NULL;
-  size_t vocabulary_i = 0;
+  stats_unregister(shard);
+  SPAM_FREE(stats);
+  free_model(&m);
+  free_messages(messages);
+  free_stop_words(&stop_words);
+}
 
-  struct { char *key; vocabulary_data value; } *vocabulary_table = NULL;
+/*
+ * Whether two files opened for reading and writing have the same contents.
+ */
+bool same_contents(FILE *a, FILE *b) {
+  rewind(a);
+  rewind(b);
+  int x, y;
+  do {
+    x = fgetc(a);
+    y = fgetc(b);
+  } while (x == y && x != EOF);
+  return x == y;
+}
 
-  fgets(buf, BUFFER_SIZE, file);
-  while (fgets(buf, BUFFER_SIZE, file) != NULL) {
-    buf[strlen(buf) - 1] = '\0';
-    bool is_spam = true;
-    switch(buf[0]) {
-    case 'h': // "ham"
-      is_spam = false;
-      break;
-    case 's': // "spam"
-      is_spam = true;
-      break;
-    default:
-      assert(0);
-      break;
+/*
+ * --score throughput with and without the result cache on a synthetic burst
+ * trace: most lines repeat one of a few messages of the current campaign,
+ * which changes every CACHE_BENCH_CAMPAIGN lines, some with different
+ * capitalization, and the rest are random messages of --dataset.
+ */
+void bench_cache(char *dataset, const hyperparams *hp) {
+  for (unsigned c = 0; c < 256; ++c) {
+    for (size_t shift = 0; shift < 64; shift += 8) {
+      uint64_t lowered = lower_word((uint64_t)c << shift) >> shift;
+      if (lowered != (unsigned)tolower(c)) {
+        fprintf(stderr, "Error: lower_word() lowercases %#x to %#llx.\n", c,
+                (unsigned long long)lowered);
+        exit(EXIT_FAILURE);
+      }
     }
+  }
 
-    item itm;
-    for (int i = 0; i < VOCABULARY_SIZE; i++) {
-      itm.values[i] = 0.0f;
-      m.idf[i] = 0.0f;
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+  size_t n = arrlenu(messages);
+  model m = { .flags = FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS, .hash_bits = HASH_BITS };
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+  metrics result;
+  fit(&c, hp, arrlenu(c.items), arrlenu(c.items), m.weights, &m.bias, &result);
+  free_corpus(&c);
+  check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
+
+  char path[] = "/tmp/spam-cache-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *trace = fd != -1 ? fdopen(fd, "w") : NULL;
+  FILE *outputs[2] = { tmpfile(), tmpfile() };
+  if (trace == NULL || outputs[0] == NULL || outputs[1] == NULL) {
+    perror("Failed to create benchmark files");
+    exit(1);
+  }
+  uint64_t x = 0x2545f4914f6cdd1dULL;
+  for (size_t i = 0; i < CACHE_BENCH_MESSAGES; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    bool campaign = x % 100 < CACHE_BENCH_CAMPAIGN_PERCENT;
+    size_t first = i / CACHE_BENCH_CAMPAIGN * CACHE_BENCH_CAMPAIGN_SIZE;
+    const char *msg = messages[campaign ? (first + (x >> 32) % CACHE_BENCH_CAMPAIGN_SIZE) % n
+                                        : (x >> 32) % n];
+    if (campaign && (x & 0x100)) {
+      fprintf(trace, "%c%s\n", toupper((unsigned char)msg[0]), msg[0] != '\0' ? msg + 1 : msg);
+    } else {
+      fprintf(trace, "%s\n", msg);
     }
+  }
+  fclose(trace);
 
-    char *processed_text = str_lwr(str_remove_first_chars(buf, is_spam ? 5 : 4));
-    itm.text = strdup(processed_text);
-    itm.is_spam = is_spam;
-    arrput(items, itm);
+  size_t threads = default_threads();
+  printf("%-9s  %9s  %14s  %8s\n", "Cache", "Time (s)", "Messages/s", "Hit rate");
+  double uncached = 0.0;
+  for (size_t k = 0; k < 2; ++k) {
+    score_shortcuts *shortcuts = open_shortcuts(k == 0 ? 0 : CACHE_BENCH_ENTRIES, 0);
+    double start = now_seconds();
+    size_t scored = score_file(&m, path, threads, shortcuts, outputs[k]);
+    double elapsed = now_seconds() - start;
+    if (k == 0) {
+      uncached = elapsed;
+      printf("%-9s  %9.3f  %14.0f  %8s\n", "off", elapsed, scored / elapsed, "-");
+    } else {
+      uint64_t hits, misses;
+      result_cache_counts(shortcuts->cache, &hits, &misses);
+      printf("%-9d  %9.3f  %14.0f  %7.1f%%  (%.2fx)\n", CACHE_BENCH_ENTRIES, elapsed,
+             scored / elapsed, 100.0 * hits / (hits + misses), uncached / elapsed);
+    }
+    close_shortcuts(shortcuts);
+  }
+  bool same = same_contents(outputs[0], outputs[1]);
+  printf("Output %s the uncached one.\n", same ? "matches" : "DIFFERS from");
 
-    extract_token_words(processed_text, &stop_words, {
-        ptrdiff_t index = shgeti(vocabulary_table, buf);
-        if (index == -1) {
-          vocabulary_data data;
-          data.index = vocabulary_i;
-          data.count = 1;
+  fclose(outputs[0]);
+  fclose(outputs[1]);
+  unlink(path);
+  free_model(&m);
+  free_messages(messages);
+  free_stop_words(&stop_words);
+  if (!same) exit(EXIT_FAILURE);
+}
 
-          strncpy(m.vocabulary[vocabulary_i], buf, 15);
-          m.vocabulary[vocabulary_i][15] = '\0';
+uint64_t xorshift64(uint64_t *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
 
-          vocabulary_i++;
-          shput(vocabulary_table, buf, data);
-        } else {
-          vocabulary_table[index].value.count += 1;
-        }
-      });
+/*
+ * Appends to *out a copy of msg with one or two of its space separated words
+ * replaced by random lowercase words, as a campaign would vary a name or a
+ * link, followed by a NUL.
+ */
+void append_variant(char **out, const char *msg, uint64_t *x) {
+  size_t words = 1;
+  for (const char *p = msg; *p != '\0'; ++p) words += *p == ' ';
+  size_t first = xorshift64(x) % words;
+  size_t second = xorshift64(x) % 2 ? xorshift64(x) % words : first;
+  size_t word = 0;
+  bool replaced = false;
+  for (const char *p = msg;; ++p) {
+    if (*p == ' ' || *p == '\0') {
+      replaced = false;
+      if (*p == '\0') break;
+      arrput(*out, ' ');
+      word++;
+    } else if (word != first && word != second) {
+      arrput(*out, *p);
+    } else if (!replaced) {
+      size_t len = 4 + xorshift64(x) % 5;
+      for (size_t i = 0; i < len; ++i) arrput(*out, 'a' + xorshift64(x) % 26);
+      replaced = true;
+    }
   }
-  fclose(file);
+  arrput(*out, '\0');
+}
+
+/*
+ * Near-duplicate index on a synthetic campaign trace: most lines are fresh
+ * variants of a few long messages of the current campaign, which changes
+ * every NEAR_DUP_BENCH_CAMPAIGN lines, and the rest are random messages of
+ * --dataset. For each Hamming distance, reports how often a score is reused,
+ * how often the reused verdict agrees with classifying the message itself,
+ * the cost of a lookup (SimHash and probes) and the throughput against
+ * classifying every message, on one thread.
+ */
+void bench_near_dup(char *dataset, const hyperparams *hp) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+  size_t n = arrlenu(messages);
+  model m = { .flags = FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS, .hash_bits = HASH_BITS };
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+  metrics result;
+  fit(&c, hp, arrlenu(c.items), arrlenu(c.items), m.weights, &m.bias, &result);
+  free_corpus(&c);
+  check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
 
-  if (vocabulary_i > VOCABULARY_SIZE) {
-    fprintf(stderr, "Error: Vocabulary size exceeded.\n");
+  size_t *templates = NULL;
+  for (size_t i = 0; i < n; ++i) {
+    size_t tokens;
+    message_simhash(messages[i], strlen(messages[i]), &tokens);
+    if (tokens >= 2 * NEAR_DUP_MIN_TOKENS) arrput(templates, i);
+  }
+  if (arrlenu(templates) == 0) {
+    fprintf(stderr, "Error: No message of the dataset is long enough for a campaign.\n");
     exit(1);
   }
 
-  // Calculate Term Frequency (TF)
-  for (size_t i = 0; i < arrlen(items); ++i) {
-    size_t total_terms = 0;
-    extract_token_words(items[i].text, &stop_words, {
-        ptrdiff_t index = shgeti(vocabulary_table, buf);
-        assert(index != -1);
-        if (index == -1) {
-          printf("Token not found in vocabulary: %s\n", buf);
-          continue;
-        }
-        assert(vocabulary_table[index].value.index <= VOCABULARY_SIZE);
-        items[i].values[vocabulary_table[index].value.index] += 1.0f;
-        total_terms++;
-      });
+  char *text = NULL;
+  size_t *starts = NULL;
+  bool *campaign = NULL;
+  uint64_t x = 0x2545f4914f6cdd1dULL;
+  for (size_t i = 0; i < NEAR_DUP_BENCH_MESSAGES; ++i) {
+    arrput(starts, arrlenu(text));
+    bool variant = xorshift64(&x) % 100 < NEAR_DUP_BENCH_CAMPAIGN_PERCENT;
+    arrput(campaign, variant);
+    if (variant) {
+      size_t first = i / NEAR_DUP_BENCH_CAMPAIGN * NEAR_DUP_BENCH_TEMPLATES;
+      size_t t = (first + xorshift64(&x) % NEAR_DUP_BENCH_TEMPLATES) % arrlenu(templates);
+      append_variant(&text, messages[templates[t]], &x);
+    } else {
+      const char *msg = messages[xorshift64(&x) % n];
+      memcpy(arraddnptr(text, strlen(msg) + 1), msg, strlen(msg) + 1);
+    }
+  }
 
-    for (size_t j = 0; j < VOCABULARY_SIZE; ++j) {
-      if (items[i].values[j] > 0.0f) {
-        items[i].values[j] /= (float)total_terms;
-      }
+  float *truth = SPAM_MALLOC(NEAR_DUP_BENCH_MESSAGES * sizeof(float));
+  bool *eligible = SPAM_MALLOC(NEAR_DUP_BENCH_MESSAGES * sizeof(bool));
+  if (truth == NULL || eligible == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  float sink = 0.0f;
+  double start = now_seconds();
+  for (size_t i = 0; i < NEAR_DUP_BENCH_MESSAGES; ++i) {
+    const char *msg = text + starts[i];
+    truth[i] = classify_score(&m, msg, strlen(msg));
+  }
+  double classify_time = now_seconds() - start;
+  for (size_t i = 0; i < NEAR_DUP_BENCH_MESSAGES; ++i) {
+    size_t tokens;
+    message_simhash(text + starts[i], strlen(text + starts[i]), &tokens);
+    eligible[i] = tokens >= NEAR_DUP_MIN_TOKENS;
+  }
+  printf("%zu messages, %d%% campaign variants. Classifying each: %.0f ns/message.\n",
+         (size_t)NEAR_DUP_BENCH_MESSAGES, NEAR_DUP_BENCH_CAMPAIGN_PERCENT,
+         classify_time / NEAR_DUP_BENCH_MESSAGES * 1e9);
+  printf("%-8s  %8s  %9s  %9s  %9s  %9s  %11s  %10s\n", "Distance", "Hit rate", "Campaign",
+         "Other", "Agreement", "Max error", "Lookup (ns)", "Throughput");
+
+  const float threshold = logit(SPAMCLF_THRESHOLD);
+  for (unsigned distance = 0; distance < 2 * NEAR_DUP_BANDS; ++distance) {
+    near_dup_index near;
+    check_status(near_dup_init(&near, NEAR_DUP_BENCH_ENTRIES, distance),
+                 "Failed to create the near-duplicate index");
+    score_shortcuts shortcuts = { .near = &near };
+    size_t hits[2] = {0}, lines[2] = {0}, agree = 0;
+    float max_error = 0.0f;
+    start = now_seconds();
+    for (size_t i = 0; i < NEAR_DUP_BENCH_MESSAGES; ++i) {
+      const char *msg = text + starts[i];
+      token_counts counts = {0};
+      float score = shortcut_score(&shortcuts, 0, &m, msg, strlen(msg), &counts);
+      bool hit = eligible[i] && counts.tokens == 0;
+      lines[campaign[i]]++;
+      hits[campaign[i]] += hit;
+      agree += hit && (score > threshold) == (truth[i] > threshold);
+      float error = fabsf(sigmoid(score) - sigmoid(truth[i]));
+      if (error > max_error) max_error = error;
+      sink += score;
     }
+    double elapsed = now_seconds() - start;
 
-    if (total_terms == 0) {
-      fprintf(stderr, "Warning: No valid tokens in message.\n");
-      continue;
+    // Lookups alone, against the index as the trace left it.
+    start = now_seconds();
+    for (size_t i = 0; i < NEAR_DUP_BENCH_MESSAGES; ++i) {
+      const char *msg = text + starts[i];
+      size_t tokens;
+      float score = 0.0f;
+      uint64_t simhash = message_simhash(msg, strlen(msg), &tokens);
+      if (tokens >= NEAR_DUP_MIN_TOKENS) near_dup_get(&near, simhash, 0, &score);
+      sink += score;
     }
+    double lookup = now_seconds() - start;
+
+    size_t hit_count = hits[0] + hits[1];
+    printf("%-8u  %7.1f%%  %8.1f%%  %8.1f%%  %8.2f%%  %9.4f  %11.0f  %9.2fx\n", distance,
+           100.0 * hit_count / NEAR_DUP_BENCH_MESSAGES, 100.0 * hits[1] / lines[1],
+           100.0 * hits[0] / lines[0], hit_count > 0 ? 100.0 * agree / hit_count : 100.0,
+           max_error, lookup / NEAR_DUP_BENCH_MESSAGES * 1e9, classify_time / elapsed);
+    near_dup_free(&near);
   }
+  if (sink == 1.0f) printf("\n");
 
-  // Multiply by Inverse Document Frequency (IDF)
-  for(size_t i = 0; i < arrlen(items); ++i) {
-    extract_token_words(items[i].text, &stop_words, {
-        ptrdiff_t index = shgeti(vocabulary_table, buf);
-        assert(index != -1);
-        assert(vocabulary_table[index].value.index <= VOCABULARY_SIZE);
+  SPAM_FREE(truth);
+  SPAM_FREE(eligible);
+  arrfree(text);
+  arrfree(starts);
+  arrfree(campaign);
+  arrfree(templates);
+  free_model(&m);
+  free_messages(messages);
+  free_stop_words(&stop_words);
+}
 
-        float idf = logf((float)arrlen(items) / (1 + vocabulary_table[index].value.count));
-        if(idf > 0.0f) {
-          m.idf[index] = idf;
-        }
-        items[i].values[vocabulary_table[index].value.index] *= idf;
+/*
+ * Messages of random lowercase words, none of them likely in the vocabulary.
+ */
+void append_noise(char **out, uint64_t *x) {
+  size_t words = 5 + xorshift64(x) % 20;
+  for (size_t w = 0; w < words; ++w) {
+    size_t len = 3 + xorshift64(x) % 8;
+    for (size_t i = 0; i < len; ++i) arrput(*out, 'a' + xorshift64(x) % 26);
+    arrput(*out, w + 1 < words ? ' ' : '\0');
+  }
+}
+
+/*
+ * Every token of the messages at starts in text, as classification splits
+ * them, NUL separated.
+ */
+void append_token_stream(char **stream, size_t **token_starts, const char *text,
+                         const size_t *starts) {
+  char buf[BUFFER_SIZE];
+  size_t j;
+  for (size_t i = 0; i < arrlenu(starts); ++i) {
+    const char *msg = text + starts[i];
+    for_each_token(msg, strlen(msg), buf, j, {
+        arrput(*token_starts, arrlenu(*stream));
+        memcpy(arraddnptr(*stream, j + 1), buf, j + 1);
       });
   }
+}
 
-  // Training the model
-  for(size_t i = 0; i < VOCABULARY_SIZE; ++i)
-    m.weights[i] = 0.0f;
-  m.bias = 0.0f;
+/*
+ * Vocabulary Bloom filter: its false positive rate on random tokens outside
+ * the vocabulary, and the cost of token lookups and classification
+ * throughput with and without it on three message mixes: the messages of
+ * --dataset, variants of them with a word or two replaced as campaigns do,
+ * and messages of random words. The model trained on --dataset is measured
+ * as is and with BLOOM_BENCH_EXTRA_TOKENS random tokens added to its
+ * vocabulary, as a model trained on a large corpus would have. Exits with an
+ * error if any score changes.
+ */
+void bench_bloom(char *dataset, const hyperparams *hp) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+  size_t n = arrlenu(messages);
+  model m = {0};
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &m);
+  metrics result;
+  fit(&c, hp, arrlenu(c.items), arrlenu(c.items), m.weights, &m.bias, &result);
+  free_corpus(&c);
 
-  size_t true_positives = 0, false_positives = 0, false_negatives = 0;
-  const size_t train_size = TRAIN_TEST_SPLIT * ((float)arrlen(items) / 100.0f);
+  uint64_t x = 0x2545f4914f6cdd1dULL;
+  const char *names[] = { "dataset", "variants", "noise" };
+  char *texts[3] = {0};
+  size_t *starts[3] = {0};
+  for (size_t mix = 0; mix < 3; ++mix) {
+    for (size_t i = 0; i < n; ++i) {
+      arrput(starts[mix], arrlenu(texts[mix]));
+      if (mix == 0) {
+        memcpy(arraddnptr(texts[mix], strlen(messages[i]) + 1), messages[i], strlen(messages[i]) + 1);
+      } else if (mix == 1) {
+        append_variant(&texts[mix], messages[i], &x);
+      } else {
+        append_noise(&texts[mix], &x);
+      }
+    }
+  }
 
-  for(size_t x = 1; x <= EPOCHS; ++x) {
-    for(size_t i = 0; i < arrlen(items); ++i) {
-      float z = 0.0f;
-      for(size_t j = 0; j < VOCABULARY_SIZE; ++j)
-        z += items[i].values[j] * m.weights[j];
-      z += m.bias;
+  bool same = true;
+  for (size_t size = 0; size < 2; ++size) {
+    if (size == 1) {
+      size_t base = m.vocabulary_size;
+      check_status(resize_model(&m, base + BLOOM_BENCH_EXTRA_TOKENS), "Failed to grow the model");
+      for (size_t i = base; i < m.vocabulary_size; ++i) {
+        char token[TOKEN_MAX_LENGTH];
+        size_t len = BLOOM_BENCH_EXTRA_LENGTH + xorshift64(&x) % (TOKEN_MAX_LENGTH - BLOOM_BENCH_EXTRA_LENGTH + 1);
+        for (size_t k = 0; k < len; ++k) token[k] = 'a' + xorshift64(&x) % 26;
+        m.offsets[i] = pool_append(&m.pool, token, len);
+        m.weights[i] = m.idf[i] = 0.0f;
+      }
+    }
+    check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
+    bloom_filter bloom = m.bloom;
 
-      float y_cap = sigmoidf(z); // Classification predicted by the model.
-      float y = items[i].is_spam ? 1.0f : 0.0f; // Actual value.
+    size_t outside = 0, passed = 0;
+    for (size_t i = 0; i < BLOOM_BENCH_PROBES; ++i) {
+      char token[TOKEN_MAX_LENGTH];
+      size_t len = TOKEN_MIN_LENGTH + xorshift64(&x) % (TOKEN_MAX_LENGTH - TOKEN_MIN_LENGTH + 1);
+      for (size_t k = 0; k < len; ++k) token[k] = 'a' + xorshift64(&x) % 26;
+      if (lookup_token(&m, token, len) != -1) continue;
+      outside++;
+      passed += bloom_may_contain(&bloom, hash_bytes(token, len, m.index.seed));
+    }
+    printf("%sVocabulary of %zu tokens, filter of %zu bytes (%d bits per token).\n",
+           size > 0 ? "\n" : "", m.vocabulary_size, (size_t)bloom.blocks * BLOOM_BLOCK_WORDS * 8,
+           BLOOM_BITS_PER_TOKEN);
+    printf("False positive rate: %.3f%% of %zu random tokens outside the vocabulary.\n",
+           100.0 * passed / outside, outside);
+    printf("%-9s  %8s  %21s  %21s  %8s\n", "Messages", "Unknown", "Lookup (ns)",
+           "Messages/s", "Speedup");
+    printf("%-9s  %8s  %10s %10s  %10s %10s\n", "", "", "unfiltered", "filtered",
+           "unfiltered", "filtered");
 
-      if (i < train_size) { // Train
-        float gradient_weight = items[i].is_spam ? SPAM_WEIGHT : HAM_WEIGHT;
-        float bias_gradient = gradient_weight * (y_cap - y);
+    for (size_t mix = 0; mix < 3; ++mix) {
+      char *stream = NULL;
+      size_t *token_starts = NULL;
+      append_token_stream(&stream, &token_starts, texts[mix], starts[mix]);
+      size_t tokens = arrlenu(token_starts);
 
-        for(size_t j = 0; j < VOCABULARY_SIZE; ++j) {
-          float weight_gradient = bias_gradient * items[i].values[j];
-          m.weights[j] -= LEARNING_RATE * (weight_gradient + LAMBDA * m.weights[j]);
-        }
-        m.bias -= LEARNING_RATE * bias_gradient;
-      } else {
-        if (items[i].is_spam && y_cap > 0.5f) {
-          ++true_positives;
-        } else if (!items[i].is_spam && y_cap > 0.5f) {
-          ++false_positives;
-        } else if (items[i].is_spam && y_cap <= 0.5f) {
-          ++false_negatives;
+      double lookup[2], rates[2];
+      float *scores[2];
+      token_counts counts = {0};
+      size_t found = 0;
+      for (size_t k = 0; k < 2; ++k) {
+        m.bloom = k == 0 ? (bloom_filter){0} : bloom;
+        size_t lookups = 0;
+        double start = now_seconds(), elapsed;
+        do {
+          for (size_t i = 0; i < tokens; ++i) {
+            found += lookup_token(&m, stream + token_starts[i], strlen(stream + token_starts[i])) != -1;
+          }
+          lookups += tokens;
+          elapsed = now_seconds() - start;
+        } while (elapsed < 0.5);
+        lookup[k] = elapsed * 1e9 / lookups;
+
+        scores[k] = SPAM_MALLOC(n * sizeof(float));
+        if (scores[k] == NULL) {
+          printf("Memory allocation failed.\n");
+          exit(EXIT_FAILURE);
         }
+        size_t classified = 0;
+        start = now_seconds();
+        do {
+          for (size_t i = 0; i < n; ++i) {
+            const char *msg = texts[mix] + starts[mix][i];
+            scores[k][i] = classify_score_counted(&m, msg, strlen(msg), &counts);
+          }
+          classified += n;
+          elapsed = now_seconds() - start;
+        } while (elapsed < 0.5);
+        rates[k] = classified / elapsed;
       }
+      m.bloom = bloom;
+      same = same && memcmp(scores[0], scores[1], n * sizeof(float)) == 0;
+      printf("%-9s  %7.1f%%  %10.1f %10.1f  %10.0f %10.0f  %7.2fx\n", names[mix],
+             100.0 * counts.unknown / counts.tokens, lookup[0], lookup[1], rates[0], rates[1],
+             rates[1] / rates[0]);
+      SPAM_FREE(scores[0]);
+      SPAM_FREE(scores[1]);
+      arrfree(stream);
+      arrfree(token_starts);
+      if (found == 1) printf("\n");
     }
   }
+  printf("Scores %s without the filter.\n", same ? "match" : "DIFFER from");
 
-  float precision = (true_positives + false_positives > 0) ?
-    (float)true_positives / (true_positives + false_positives) : 0.0f;
-  float recall = (true_positives + false_negatives > 0) ?
-    (float)true_positives / (true_positives + false_negatives) : 0.0f;
-  float f1_score = (precision + recall > 0) ?
-    2.0f * (precision * recall) / (precision + recall) : 0.0f;
+  for (size_t mix = 0; mix < 3; ++mix) {
+    arrfree(texts[mix]);
+    arrfree(starts[mix]);
+  }
+  free_model(&m);
+  free_messages(messages);
+  free_stop_words(&stop_words);
+  if (!same) exit(EXIT_FAILURE);
+}
 
-  printf("Precision: %.2f%%\n", precision * 100.0f);
-  printf("Recall: %.2f%%\n", recall * 100.0f);
-  printf("F1-Score: %.2f%%\n", f1_score * 100.0f);
+/*
+ * Bytes a loaded model needs to classify.
+ */
+size_t model_memory(const model *m) {
+  size_t features = m->vocabulary_size + hashed_buckets(m);
+  return arrlenu(m->pool) + m->vocabulary_size * sizeof(uint32_t) +
+    m->index.buckets * sizeof(uint32_t) + (size_t)m->bloom.blocks * BLOOM_BLOCK_WORDS * 8 +
+    2 * features * sizeof(float);
+}
 
-  if(output != NULL) {
-    dump_model(&m, output);
+/*
+ * Tenant models derived from one model per feature set: each keeps a random
+ * part of its base vocabulary with rescaled weights and adds tokens of its
+ * own. Checks that a registry of them scores every message exactly as the
+ * models do, and compares memory and scoring every message with every model.
+ */
+void bench_registry(char *dataset, const hyperparams *hp) {
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+  size_t n = arrlenu(messages);
+  const uint32_t modes[] = {
+    0, FEATURE_BIGRAMS, FEATURE_CHAR_NGRAMS, FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS,
+  };
+  const size_t mode_count = sizeof(modes) / sizeof(modes[0]);
+  model bases[sizeof(modes) / sizeof(modes[0])];
+  for (size_t k = 0; k < mode_count; ++k) {
+    bases[k] = (model){ .flags = modes[k], .hash_bits = REGISTRY_BENCH_HASH_BITS };
+    corpus c;
+    build_corpus(dataset, &stop_words, &c, &bases[k]);
+    metrics result;
+    fit(&c, hp, arrlenu(c.items), arrlenu(c.items), bases[k].weights, &bases[k].bias, &result);
+    free_corpus(&c);
+  }
+
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  model *tenants = NULL;
+  model_registry r = {0};
+  size_t separate = 0, tokens = 0;
+  for (size_t i = 0; i < REGISTRY_BENCH_MODELS; ++i) {
+    const model *base = &bases[i % mode_count];
+    size_t hashed = hashed_buckets(base);
+    model t = { .flags = base->flags, .hash_bits = base->hash_bits, .bias = base->bias };
+    check_status(resize_model(&t, base->vocabulary_size + REGISTRY_BENCH_PRIVATE_TOKENS),
+                 "Failed to resize model");
+    memcpy(t.weights + t.vocabulary_size, base->weights + base->vocabulary_size, hashed * sizeof(float));
+    memcpy(t.idf + t.vocabulary_size, base->idf + base->vocabulary_size, hashed * sizeof(float));
+    size_t kept = 0;
+    for (size_t k = 0; k < base->vocabulary_size; ++k) {
+      if (xorshift64(&x) % 100 >= REGISTRY_BENCH_KEEP_PERCENT) continue;
+      size_t len;
+      const char *token = vocabulary_token(base, k, &len);
+      t.offsets[kept] = pool_append(&t.pool, token, len);
+      t.weights[kept] = base->weights[k] * (0.5f + (xorshift64(&x) % 1000) / 1000.0f);
+      t.idf[kept] = base->idf[k];
+      kept++;
+    }
+    for (size_t k = 0; k < REGISTRY_BENCH_PRIVATE_TOKENS; ++k) {
+      char token[TOKEN_MAX_LENGTH];
+      size_t len = TOKEN_MIN_LENGTH + xorshift64(&x) % (TOKEN_MAX_LENGTH - TOKEN_MIN_LENGTH + 1);
+      for (size_t j = 0; j < len; ++j) token[j] = 'a' + xorshift64(&x) % 26;
+      t.offsets[kept] = pool_append(&t.pool, token, len);
+      t.weights[kept] = (xorshift64(&x) % 1000) / 1000.0f - 0.5f;
+      t.idf[kept] = 1.0f;
+      kept++;
+    }
+    check_status(resize_model(&t, kept), "Failed to resize model");
+    check_status(index_vocabulary(&t), "Failed to build the vocabulary index");
+    size_t id;
+    check_status(registry_add(&r, &t, &id), "Failed to add the model");
+    separate += model_memory(&t);
+    tokens += t.vocabulary_size;
+    arrput(tenants, t);
+  }
+  check_status(registry_index(&r), "Failed to index the models");
+  size_t models = arrlenu(tenants);
+
+  printf("%zu models of %zu tokens in total, %zu distinct.\n", models, tokens, arrlenu(r.offsets));
+  printf("Memory: %.1f MiB as separate models, %.1f MiB in the registry (%.1fx less).\n",
+         separate / 1048576.0, registry_memory(&r) / 1048576.0, (double)separate / registry_memory(&r));
+
+  float *expected = SPAM_MALLOC(n * models * sizeof(float) + 1);
+  float *actual = SPAM_MALLOC(n * models * sizeof(float) + 1);
+  if (expected == NULL || actual == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  double rates[2];
+  registry_message message = {0};
+  for (size_t k = 0; k < 2; ++k) {
+    size_t scored = 0;
+    double start = now_seconds(), elapsed;
+    do {
+      for (size_t i = 0; i < n; ++i) {
+        size_t len = strlen(messages[i]);
+        if (k == 0) {
+          for (size_t id = 0; id < models; ++id) {
+            expected[i * models + id] = classify_score(&tenants[id], messages[i], len);
+          }
+        } else {
+          registry_tokenize(&r, messages[i], len, &message);
+          for (size_t id = 0; id < models; ++id) {
+            actual[i * models + id] = registry_score(&r, id, &message);
+          }
+        }
+      }
+      scored += n;
+      elapsed = now_seconds() - start;
+    } while (elapsed < 1.0);
+    rates[k] = scored / elapsed;
   }
+  bool same = memcmp(expected, actual, n * models * sizeof(float)) == 0;
+  printf("Scoring every message with every model: %.0f messages/s separately, "
+         "%.0f messages/s through the registry (%.2fx).\n", rates[0], rates[1], rates[1] / rates[0]);
+  printf("Scores %s the separate models.\n", same ? "match" : "DIFFER from");
+
+  free_registry_message(&message);
+  SPAM_FREE(expected);
+  SPAM_FREE(actual);
+  free_registry(&r);
+  for (size_t i = 0; i < models; ++i) free_model(&tenants[i]);
+  arrfree(tenants);
+  for (size_t k = 0; k < mode_count; ++k) free_model(&bases[k]);
+  free_messages(messages);
+  free_stop_words(&stop_words);
+  if (!same) exit(EXIT_FAILURE);
+}
+
+/*
+ * Checks that classify() makes no heap allocation, by counting the calls
+ * through the allocation hooks while every message of --dataset is
+ * classified by models with each feature stream. Exits with an error if any
+ * allocation was made.
+ */
+void bench_alloc(char *dataset, const hyperparams *hp) {
+#ifdef SPAM_COUNT_ALLOCATIONS
+  char **stop_words = NULL;
+  get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
 
-  shfree(vocabulary_table);
+  const uint32_t modes[] = { 0, FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS };
+  bool failed = false;
+  for (size_t k = 0; k < sizeof(modes) / sizeof(modes[0]); ++k) {
+    model m = { .flags = modes[k], .hash_bits = HASH_BITS };
+    corpus c;
+    build_corpus(dataset, &stop_words, &c, &m);
+    metrics result;
+    fit(&c, hp, arrlenu(c.items), arrlenu(c.items), m.weights, &m.bias, &result);
+    free_corpus(&c);
+    check_status(index_vocabulary(&m), "Failed to build the vocabulary index");
 
-  for (size_t i = 0; i < arrlen(items); i++) {
-    free(items[i].text);
+    size_t before = atomic_load(&allocations);
+    volatile float sink = 0.0f;
+    for (size_t i = 0; i < arrlenu(messages); ++i) {
+      sink += classify(&m, messages[i], strlen(messages[i]));
+    }
+    (void)sink;
+    size_t made = atomic_load(&allocations) - before;
+    printf("Flags %u: %zu allocations in %zu classifications\n", modes[k], made,
+           arrlenu(messages));
+    failed = failed || made > 0;
+    free_model(&m);
   }
-  arrfree(items);
 
+  free_messages(messages);
   for (size_t i = 0; i < arrlenu(stop_words); ++i) {
-    free(stop_words[i]);
+    SPAM_FREE(stop_words[i]);
   }
   arrfree(stop_words);
+  if (failed) {
+    fprintf(stderr, "Error: classify() allocated memory.\n");
+    exit(1);
+  }
+#else
+  (void)dataset;
+  (void)hp;
+  fprintf(stderr, "Allocation counting needs the default allocation hooks.\n");
+  exit(1);
+#endif
 }
 
-void run_model(char *path, char *input) {
-  bool should_free = false;
-  if(input == NULL) {
-    char buf[120];
-    printf("Enter model input: ");
-    fflush(stdout);
-    if(read(0, buf, 120) == -1) {
-      printf("Failed to read user input from stdin.");
-      exit(1);
-    }
+/*
+ * Stress test of the library: many threads classify the messages of
+ * --dataset at once with one shared model handle, each starting at a
+ * different message, and every score is compared bit for bit against a
+ * single-threaded reference. Reports throughput per thread count and exits
+ * with an error on any mismatch.
+ */
+typedef struct stress_context {
+  const spamclf_model *m;
+  char **messages;
+  const float *expected;
+  size_t threads;
+  pthread_barrier_t start;
+  atomic_size_t mismatches;
+} stress_context;
 
-    input = (char *)malloc(strlen(buf) + 1);
-    if (input == NULL) {
-      printf("Memory allocation failed.\n");
-      exit(EXIT_FAILURE);
+typedef struct stress_worker_arg {
+  stress_context *ctx;
+  size_t id;
+} stress_worker_arg;
+
+void *stress_worker(void *arg) {
+  stress_worker_arg *a = arg;
+  stress_context *ctx = a->ctx;
+  size_t n = arrlenu(ctx->messages);
+  size_t first = a->id * n / ctx->threads;
+  size_t mismatches = 0;
+
+  pthread_barrier_wait(&ctx->start);
+  for (size_t round = 0; round < STRESS_ROUNDS; ++round) {
+    for (size_t k = 0; k < n; ++k) {
+      size_t i = (first + k) % n;
+      float z = spamclf_score(ctx->m, ctx->messages[i], strlen(ctx->messages[i]));
+      if (memcmp(&z, &ctx->expected[i], sizeof(float)) != 0) mismatches++;
     }
-    strcpy(input, buf);
-    should_free = true;
   }
+  atomic_fetch_add(&ctx->mismatches, mismatches);
+  return NULL;
+}
 
+void bench_stress(char *dataset, const hyperparams *hp) {
   char **stop_words = NULL;
   get_stop_words(&stop_words);
+  char **messages = read_messages(dataset);
+  size_t n = arrlenu(messages);
 
-  model m;
-  load_model(&m, path);
+  // Reference scores come from the in-memory model, and the threads use a
+  // copy saved and loaded through the library.
+  model trained = { .flags = FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS, .hash_bits = HASH_BITS };
+  corpus c;
+  build_corpus(dataset, &stop_words, &c, &trained);
+  metrics result;
+  fit(&c, hp, arrlenu(c.items), arrlenu(c.items), trained.weights, &trained.bias, &result);
+  free_corpus(&c);
+  check_status(index_vocabulary(&trained), "Failed to build the vocabulary index");
 
-  // Calculate Term Frequency (TF)
-  struct { char *key; float value; } *vocabulary_count = NULL;
-  for(size_t i = 0; i < VOCABULARY_SIZE; ++i) {
-    shput(vocabulary_count, m.vocabulary[i], 0.0f);
+  float *expected = SPAM_MALLOC((n + 1) * sizeof(float));
+  if (expected == NULL) {
+    printf("Memory allocation failed.\n");
+    exit(EXIT_FAILURE);
   }
-
-  size_t total = 0;
-  extract_token_words(str_lwr(input), &stop_words, {
-      ptrdiff_t index = shgeti(vocabulary_count, buf);
-      if (index != -1) {
-        size_t current_value = vocabulary_count[index].value;
-        shput(vocabulary_count, buf, current_value + 1.0f);
-        total++;
-      }
-    });
-
-
-  for (size_t i = 0; i < shlenu(vocabulary_count); ++i) {
-    vocabulary_count[i].value /= (float)total;
-    vocabulary_count[i].value *= m.idf[i];
+  for (size_t i = 0; i < n; ++i) {
+    expected[i] = classify_score(&trained, messages[i], strlen(messages[i]));
   }
 
-  float z = 0.0f;
-  for (size_t i = 0; i < shlenu(vocabulary_count); ++i) {
-    if (vocabulary_count[i].value > 0) {
-      size_t vocab_index = shget(vocabulary_count, m.vocabulary[i]);
-      z += vocabulary_count[i].value * m.weights[vocab_index];
-    }
+  char path[] = "/tmp/spam-stress-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("Failed to create benchmark files");
+    exit(1);
   }
-  z += m.bias;
+  close(fd);
+  check_status(write_model(&trained, path), "Failed to write model");
+  spamclf_model *shared = open_model(path);
+  unlink(path);
 
-  float y_cap = sigmoidf(z);
+  size_t max_threads = 2 * default_threads() > 8 ? 2 * default_threads() : 8;
+  printf("%7s  %9s  %14s  %7s  %10s\n", "Threads", "Time (s)", "Messages/s", "Speedup", "Mismatches");
+  double single = 0.0;
+  size_t total_mismatches = 0;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    stress_context ctx = { .m = shared, .messages = messages, .expected = expected, .threads = threads };
+    atomic_init(&ctx.mismatches, 0);
+    pthread_barrier_init(&ctx.start, NULL, threads + 1);
+    pthread_t *workers = SPAM_MALLOC(threads * sizeof(pthread_t));
+    stress_worker_arg *args = SPAM_MALLOC(threads * sizeof(stress_worker_arg));
+    if (workers == NULL || args == NULL) {
+      printf("Memory allocation failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t t = 0; t < threads; ++t) {
+      args[t] = (stress_worker_arg){ .ctx = &ctx, .id = t };
+      if (pthread_create(&workers[t], NULL, stress_worker, &args[t]) != 0) {
+        perror("Failed to create thread");
+        exit(EXIT_FAILURE);
+      }
+    }
+    pthread_barrier_wait(&ctx.start);
+    double start = now_seconds();
+    for (size_t t = 0; t < threads; ++t) {
+      pthread_join(workers[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    pthread_barrier_destroy(&ctx.start);
+    SPAM_FREE(args);
+    SPAM_FREE(workers);
 
-  if(y_cap > 0.45f) {
-    printf("It is spam.\n");
-  } else {
-    printf("It not a spam.\n");
+    double classified = (double)threads * STRESS_ROUNDS * n;
+    if (threads == 1) single = classified / elapsed;
+    size_t mismatches = atomic_load(&ctx.mismatches);
+    total_mismatches += mismatches;
+    printf("%7zu  %9.3f  %14.0f  %6.2fx  %10zu\n", threads, elapsed, classified / elapsed,
+           classified / elapsed / single, mismatches);
   }
 
-  if(should_free) free(input);
-
-  for (size_t i = 0; i < arrlenu(stop_words); ++i) {
-    free(stop_words[i]);
+  spamclf_free(shared);
+  SPAM_FREE(expected);
+  free_model(&trained);
+  free_messages(messages);
+  free_stop_words(&stop_words);
+  if (total_mismatches > 0) {
+    fprintf(stderr, "Error: %zu scores differ from the single-threaded reference.\n",
+            total_mismatches);
+    exit(1);
   }
-  arrfree(stop_words);
+}
 
-  shfree(vocabulary_count);
+void bench(char *name, char *dataset, const hyperparams *hp) {
+  if (name != NULL && strcmp(name, "features") == 0) {
+    bench_features(dataset);
+  } else if (name != NULL && strcmp(name, "lookup") == 0) {
+    bench_lookup(dataset);
+  } else if (name != NULL && strcmp(name, "kernels") == 0) {
+    bench_kernels();
+  } else if (name != NULL && strcmp(name, "batch") == 0) {
+    bench_batch(dataset, hp);
+  } else if (name != NULL && strcmp(name, "batch-synthetic") == 0) {
+    bench_batch_synthetic(hp);
+  } else if (name != NULL && strcmp(name, "sigmoid") == 0) {
+    bench_sigmoid(dataset, hp);
+  } else if (name != NULL && strcmp(name, "score") == 0) {
+    bench_score(dataset, hp);
+  } else if (name != NULL && strcmp(name, "alloc") == 0) {
+    bench_alloc(dataset, hp);
+  } else if (name != NULL && strcmp(name, "stress") == 0) {
+    bench_stress(dataset, hp);
+  } else if (name != NULL && strcmp(name, "csv") == 0) {
+    bench_csv(dataset);
+  } else if (name != NULL && strcmp(name, "ingest") == 0) {
+    bench_ingest(dataset);
+  } else if (name != NULL && strcmp(name, "ring") == 0) {
+    bench_ring(dataset, hp);
+  } else if (name != NULL && strcmp(name, "reload") == 0) {
+    bench_reload(dataset, hp);
+  } else if (name != NULL && strcmp(name, "metrics") == 0) {
+    bench_stats(dataset, hp);
+  } else if (name != NULL && strcmp(name, "cache") == 0) {
+    bench_cache(dataset, hp);
+  } else if (name != NULL && strcmp(name, "neardup") == 0) {
+    bench_near_dup(dataset, hp);
+  } else if (name != NULL && strcmp(name, "bloom") == 0) {
+    bench_bloom(dataset, hp);
+  } else if (name != NULL && strcmp(name, "registry") == 0) {
+    bench_registry(dataset, hp);
+  } else {
+    fprintf(stderr, "Unknown benchmark. Available: features, lookup, kernels, batch,\n"
+            "batch-synthetic, sigmoid, score, alloc, stress, csv, ingest, ring,\n"
+            "reload, metrics, cache, neardup, bloom, registry\n");
+    exit(1);
+  }
 }
 
 enum action {
   UNKNOWN,
   HELP,
   TRAIN,
-  RUN
+  KFOLD,
+  SWEEP,
+  UPDATE,
+  BENCH,
+  RUN,
+  SCORE,
+  SERVE
 };
 
 int main(int argc, char *argv[]) {
+  select_kernels();
+
   char *dataset = "dataset/spam.csv";
   char *model = "model.bin";
   char *input = NULL;
+  char *benchmark = NULL;
+  char *cache = NULL;
+  char *ring = "/spamclf";
+  char *metrics_target = NULL;
+  size_t cache_size = 0;
+  size_t near_size = 0;
+  size_t folds = 0;
+  size_t threads = default_threads();
+  hyperparam_grid grid = {0};
+  feature_options opts = { .flags = 0, .hash_bits = HASH_BITS };
   enum action a = UNKNOWN;
 
   if (argc > 1) {
@@ -523,12 +4435,83 @@ int main(int argc, char *argv[]) {
         if(x+1 < argc && argv[x+1][0] != '-') {
           dataset = argv[x+1];
         }
+      } else if (strcmp(argv[x], "--exact-sigmoid") == 0) {
+        exact_sigmoid = true;
+      } else if (strcmp(argv[x], "--cache") == 0) {
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          cache = argv[x+1];
+        }
+      } else if (strcmp(argv[x], "-k") == 0 || strcmp(argv[x], "--kfold") == 0) {
+        a = KFOLD;
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          folds = strtoul(argv[x+1], NULL, 10);
+        }
+      } else if (strcmp(argv[x], "-s") == 0 || strcmp(argv[x], "--sweep") == 0) {
+        a = SWEEP;
+      } else if (strcmp(argv[x], "-j") == 0 || strcmp(argv[x], "--threads") == 0) {
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          threads = strtoul(argv[x+1], NULL, 10);
+        }
+      } else if (strcmp(argv[x], "--bigrams") == 0 || strcmp(argv[x], "--char-ngrams") == 0) {
+        opts.flags |= strcmp(argv[x], "--bigrams") == 0 ? FEATURE_BIGRAMS : FEATURE_CHAR_NGRAMS;
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          opts.hash_bits = strtoul(argv[x+1], NULL, 10);
+          if (opts.hash_bits == 0 || opts.hash_bits > 30) {
+            fprintf(stderr, "Error: %s expects between 1 and 30 bits.\n", argv[x]);
+            return 1;
+          }
+        }
+      } else if (strcmp(argv[x], "--learning-rate") == 0 || strcmp(argv[x], "--lambda") == 0 ||
+                 strcmp(argv[x], "--epochs") == 0 || strcmp(argv[x], "--ham-weight") == 0 ||
+                 strcmp(argv[x], "--spam-weight") == 0 || strcmp(argv[x], "--batch-size") == 0) {
+        double **list = strcmp(argv[x], "--learning-rate") == 0 ? &grid.learning_rates
+          : strcmp(argv[x], "--lambda") == 0 ? &grid.lambdas
+          : strcmp(argv[x], "--epochs") == 0 ? &grid.epochs
+          : strcmp(argv[x], "--ham-weight") == 0 ? &grid.ham_weights
+          : strcmp(argv[x], "--spam-weight") == 0 ? &grid.spam_weights
+          : &grid.batch_sizes;
+        if(x+1 >= argc || !parse_number_list(argv[x+1], list)) {
+          fprintf(stderr, "Error: %s expects a comma separated list of numbers.\n", argv[x]);
+          return 1;
+        }
+      } else if (strcmp(argv[x], "-u") == 0 || strcmp(argv[x], "--update") == 0) {
+        a = UPDATE;
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          model = argv[x+1];
+        }
+      } else if (strcmp(argv[x], "-b") == 0 || strcmp(argv[x], "--bench") == 0) {
+        a = BENCH;
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          benchmark = argv[x+1];
+        }
       } else if (strcmp(argv[x], "-r") == 0 || strcmp(argv[x], "--run") == 0) {
         a = RUN;
       } else if (strcmp(argv[x], "-m") == 0 || strcmp(argv[x], "--model") == 0) {
         if(x+1 < argc && argv[x+1][0] != '-') {
           model = argv[x+1];
         }
+      } else if (strcmp(argv[x], "--score") == 0) {
+        a = SCORE;
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          input = argv[x+1];
+        }
+      } else if (strcmp(argv[x], "--serve") == 0) {
+        a = SERVE;
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          ring = argv[x+1];
+        }
+      } else if (strcmp(argv[x], "--result-cache") == 0) {
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          cache_size = strtoul(argv[x+1], NULL, 10);
+        }
+      } else if (strcmp(argv[x], "--near-dups") == 0) {
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          near_size = strtoul(argv[x+1], NULL, 10);
+        }
+      } else if (strcmp(argv[x], "--metrics") == 0) {
+        if(x+1 < argc && argv[x+1][0] != '-') {
+          metrics_target = argv[x+1];
+        }
       } else if (strcmp(argv[x], "-i") == 0 || strcmp(argv[x], "--input") == 0) {
         if(x+1 < argc && argv[x+1][0] != '-') {
           input = argv[x+1];
@@ -537,16 +4520,58 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (arrlenu(grid.learning_rates) == 0) arrput(grid.learning_rates, LEARNING_RATE);
+  if (arrlenu(grid.lambdas) == 0) arrput(grid.lambdas, LAMBDA);
+  if (arrlenu(grid.epochs) == 0) arrput(grid.epochs, EPOCHS);
+  if (arrlenu(grid.ham_weights) == 0) arrput(grid.ham_weights, HAM_WEIGHT);
+  if (arrlenu(grid.spam_weights) == 0) arrput(grid.spam_weights, SPAM_WEIGHT);
+  if (arrlenu(grid.batch_sizes) == 0) arrput(grid.batch_sizes, BATCH_SIZE);
+  for (size_t i = 0; i < arrlenu(grid.batch_sizes); ++i) {
+    if (grid.batch_sizes[i] < 1) {
+      fprintf(stderr, "Error: --batch-size must be at least 1.\n");
+      return 1;
+    }
+  }
+  if (threads == 0) threads = 1;
+  ingest_threads = threads;
+
+  hyperparams hp = {
+    .learning_rate = grid.learning_rates[0],
+    .lambda = grid.lambdas[0],
+    .epochs = (size_t)grid.epochs[0],
+    .ham_weight = grid.ham_weights[0],
+    .spam_weight = grid.spam_weights[0],
+    .batch_size = (size_t)grid.batch_sizes[0],
+  };
+
   switch(a) {
   case HELP:
     print_help(argv[0]);
     break;
   case TRAIN:
-    train_model(dataset, model);
+    train_model(dataset, cache, model, &hp, &opts);
+    break;
+  case KFOLD:
+    cross_validate(dataset, cache, folds, &hp, &opts);
+    break;
+  case SWEEP:
+    sweep(dataset, cache, &grid, threads, &opts);
+    break;
+  case UPDATE:
+    update_model(model, dataset, &hp);
+    break;
+  case BENCH:
+    bench(benchmark, dataset, &hp);
     break;
   case RUN:
     run_model(model, input);
     break;
+  case SCORE:
+    score_model(model, input, threads, cache_size, near_size);
+    break;
+  case SERVE:
+    serve_model(model, ring, metrics_target, cache_size, near_size);
+    break;
   default:
     printf("Usage: %s [OPTION]...\n", argv[0]);
     printf("Try '%s --help' for more information.\n", argv[0]);
@@ -0,0 +1,2623 @@
+#define STB_DS_IMPLEMENTATION
+#include "spamclf_internal.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// ---------- Memory ----------
+
+#ifdef SPAM_COUNT_ALLOCATIONS
+atomic_size_t allocations; // No. of allocations made through the hooks.
+
+void *spam_malloc(size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return malloc(size);
+}
+
+void *spam_calloc(size_t n, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return calloc(n, size);
+}
+
+void *spam_realloc(void *ptr, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return realloc(ptr, size);
+}
+#endif
+
+// ---------- String functions ----------
+
+/*
+ * Copy of the given string, allocated through SPAM_MALLOC.
+ */
+char *str_dup(const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = SPAM_MALLOC(len);
+  if (copy != NULL) memcpy(copy, str, len);
+  return copy;
+}
+
+// ---------- Utilities ----------
+
+/*
+ * Final avalanche step of MurmurHash3.
+ */
+uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+/*
+ * 64-bit FNV-1a hash of a byte string, finalized with mix64.
+ */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *p = data;
+  uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return mix64(h);
+}
+
+// ---------- Kernels ----------
+
+/*
+ * The approximate sigmoid computes e^-z as 2^n * e^r, with n = round(-z /
+ * ln 2) and |r| <= ln(2) / 2, where e^r is the degree 6 Taylor polynomial and
+ * ln 2 is split in two so that r is exact. The relative error of e^-z is
+ * below 2e-7, and z is clamped to +-87 so that 2^n stays a normal float.
+ */
+#define SIGMOID_CLAMP 87.0f
+#define LOG2E 1.44269504f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+#define ROUND_MAGIC 12582912.0f // 1.5 * 2^23, rounds to an integer when added.
+
+/*
+ * Exact mode: every sigmoid goes through expf().
+ */
+bool exact_sigmoid = false;
+
+float sigmoidf(float x) {
+  return 1.0f / (1.0f + expf(-x));
+}
+
+float sigmoid_approx(float z) {
+  float x = -z;
+  x = x > -SIGMOID_CLAMP ? x : -SIGMOID_CLAMP;
+  x = x < SIGMOID_CLAMP ? x : SIGMOID_CLAMP;
+  float n = (x * LOG2E + ROUND_MAGIC) - ROUND_MAGIC;
+  float r = x - n * LN2_HI - n * LN2_LO;
+  float e = 1.0f + r * (1.0f + r * (0.5f + r * (1.0f / 6 + r * (1.0f / 24 + r * (1.0f / 120 + r * (1.0f / 720))))));
+  union { uint32_t u; float f; } scale = { .u = (uint32_t)((int32_t)n + 127) << 23 };
+  return 1.0f / (1.0f + e * scale.f);
+}
+
+/*
+ * Sigmoid of a single score, for the per-example paths.
+ */
+float sigmoid(float z) {
+  return exact_sigmoid ? sigmoidf(z) : sigmoid_approx(z);
+}
+
+/*
+ * Inverse of the sigmoid. sigmoid(z) > p exactly when z > logit(p), so
+ * thresholded decisions need no exponential at all.
+ */
+float logit(float p) {
+  return logf(p / (1.0f - p));
+}
+
+float dot_scalar(const float *x, const float *y, size_t n) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n; ++i) sum += x[i] * y[i];
+  return sum;
+}
+
+void axpy_scalar(float a, const float *x, float *y, size_t n) {
+  for (size_t i = 0; i < n; ++i) y[i] += a * x[i];
+}
+
+void reg_update_scalar(float *w, const float *g, float learning_rate, float lambda, size_t n) {
+  for (size_t i = 0; i < n; ++i) w[i] -= learning_rate * (g[i] + lambda * w[i]);
+}
+
+void sigmoid_scalar(const float *z, float *p, size_t n) {
+  for (size_t i = 0; i < n; ++i) p[i] = sigmoid_approx(z[i]);
+}
+
+#ifdef HAVE_X86_KERNELS
+float horizontal_sum_sse(__m128 v) {
+  __m128 shuffled = _mm_movehl_ps(v, v);
+  v = _mm_add_ps(v, shuffled);
+  shuffled = _mm_shuffle_ps(v, v, 0x55);
+  return _mm_cvtss_f32(_mm_add_ss(v, shuffled));
+}
+
+float dot_sse(const float *x, const float *y, size_t n) {
+  __m128 a = _mm_setzero_ps(), b = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(y + i + 4)));
+  }
+  float sum = horizontal_sum_sse(_mm_add_ps(a, b));
+  for (; i < n; ++i) sum += x[i] * y[i];
+  return sum;
+}
+
+void axpy_sse(float a, const float *x, float *y, size_t n) {
+  __m128 va = _mm_set1_ps(a);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i))));
+  }
+  for (; i < n; ++i) y[i] += a * x[i];
+}
+
+void reg_update_sse(float *w, const float *g, float learning_rate, float lambda, size_t n) {
+  __m128 lr = _mm_set1_ps(learning_rate), l2 = _mm_set1_ps(lambda);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 vw = _mm_loadu_ps(w + i);
+    __m128 step = _mm_add_ps(_mm_loadu_ps(g + i), _mm_mul_ps(l2, vw));
+    _mm_storeu_ps(w + i, _mm_sub_ps(vw, _mm_mul_ps(lr, step)));
+  }
+  for (; i < n; ++i) w[i] -= learning_rate * (g[i] + lambda * w[i]);
+}
+
+void sigmoid_sse(const float *z, float *p, size_t n) {
+  const __m128 clamp = _mm_set1_ps(SIGMOID_CLAMP), one = _mm_set1_ps(1.0f);
+  const __m128 magic = _mm_set1_ps(ROUND_MAGIC);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(z + i));
+    x = _mm_min_ps(_mm_max_ps(x, _mm_sub_ps(_mm_setzero_ps(), clamp)), clamp);
+    __m128 k = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(LOG2E)), magic), magic);
+    __m128 r = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(LN2_HI))),
+                          _mm_mul_ps(k, _mm_set1_ps(LN2_LO)));
+    __m128 e = _mm_set1_ps(1.0f / 720);
+    e = _mm_add_ps(_mm_mul_ps(e, r), _mm_set1_ps(1.0f / 120));
+    e = _mm_add_ps(_mm_mul_ps(e, r), _mm_set1_ps(1.0f / 24));
+    e = _mm_add_ps(_mm_mul_ps(e, r), _mm_set1_ps(1.0f / 6));
+    e = _mm_add_ps(_mm_mul_ps(e, r), _mm_set1_ps(0.5f));
+    e = _mm_add_ps(_mm_mul_ps(e, r), one);
+    e = _mm_add_ps(_mm_mul_ps(e, r), one);
+    __m128i scale = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(k), _mm_set1_epi32(127)), 23);
+    e = _mm_mul_ps(e, _mm_castsi128_ps(scale));
+    _mm_storeu_ps(p + i, _mm_div_ps(one, _mm_add_ps(one, e)));
+  }
+  for (; i < n; ++i) p[i] = sigmoid_approx(z[i]);
+}
+
+__attribute__((target("avx2,fma")))
+float dot_avx2(const float *x, const float *y, size_t n) {
+  __m256 a = _mm256_setzero_ps(), b = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    a = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), a);
+    b = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), b);
+  }
+  a = _mm256_add_ps(a, b);
+  float sum = horizontal_sum_sse(_mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1)));
+  for (; i < n; ++i) sum += x[i] * y[i];
+  return sum;
+}
+
+__attribute__((target("avx2,fma")))
+void axpy_avx2(float a, const float *x, float *y, size_t n) {
+  __m256 va = _mm256_set1_ps(a);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+void reg_update_avx2(float *w, const float *g, float learning_rate, float lambda, size_t n) {
+  __m256 lr = _mm256_set1_ps(-learning_rate), l2 = _mm256_set1_ps(lambda);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 vw = _mm256_loadu_ps(w + i);
+    __m256 step = _mm256_fmadd_ps(l2, vw, _mm256_loadu_ps(g + i));
+    _mm256_storeu_ps(w + i, _mm256_fmadd_ps(lr, step, vw));
+  }
+  for (; i < n; ++i) w[i] -= learning_rate * (g[i] + lambda * w[i]);
+}
+
+__attribute__((target("avx2,fma")))
+void sigmoid_avx2(const float *z, float *p, size_t n) {
+  const __m256 clamp = _mm256_set1_ps(SIGMOID_CLAMP), one = _mm256_set1_ps(1.0f);
+  const __m256 magic = _mm256_set1_ps(ROUND_MAGIC);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(z + i));
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_sub_ps(_mm256_setzero_ps(), clamp)), clamp);
+    __m256 k = _mm256_sub_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(LOG2E), magic), magic);
+    __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(LN2_HI), x);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(LN2_LO), r);
+    __m256 e = _mm256_set1_ps(1.0f / 720);
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(1.0f / 120));
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(1.0f / 24));
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(1.0f / 6));
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(0.5f));
+    e = _mm256_fmadd_ps(e, r, one);
+    e = _mm256_fmadd_ps(e, r, one);
+    __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23);
+    e = _mm256_mul_ps(e, _mm256_castsi256_ps(scale));
+    _mm256_storeu_ps(p + i, _mm256_div_ps(one, _mm256_add_ps(one, e)));
+  }
+  for (; i < n; ++i) p[i] = sigmoid_approx(z[i]);
+}
+
+__attribute__((target("avx512f")))
+float dot_avx512(const float *x, const float *y, size_t n) {
+  __m512 a = _mm512_setzero_ps(), b = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    a = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), a);
+    b = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), b);
+  }
+  for (; i < n; i += 16) {
+    __mmask16 mask = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    a = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i), a);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(a, b));
+}
+
+__attribute__((target("avx512f")))
+void axpy_avx512(float a, const float *x, float *y, size_t n) {
+  __m512 va = _mm512_set1_ps(a);
+  for (size_t i = 0; i < n; i += 16) {
+    __mmask16 mask = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    __m512 vy = _mm512_maskz_loadu_ps(mask, y + i);
+    _mm512_mask_storeu_ps(y + i, mask, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(mask, x + i), vy));
+  }
+}
+
+__attribute__((target("avx512f")))
+void reg_update_avx512(float *w, const float *g, float learning_rate, float lambda, size_t n) {
+  __m512 lr = _mm512_set1_ps(-learning_rate), l2 = _mm512_set1_ps(lambda);
+  for (size_t i = 0; i < n; i += 16) {
+    __mmask16 mask = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    __m512 vw = _mm512_maskz_loadu_ps(mask, w + i);
+    __m512 step = _mm512_fmadd_ps(l2, vw, _mm512_maskz_loadu_ps(mask, g + i));
+    _mm512_mask_storeu_ps(w + i, mask, _mm512_fmadd_ps(lr, step, vw));
+  }
+}
+
+__attribute__((target("avx512f")))
+void sigmoid_avx512(const float *z, float *p, size_t n) {
+  const __m512 clamp = _mm512_set1_ps(SIGMOID_CLAMP), one = _mm512_set1_ps(1.0f);
+  for (size_t i = 0; i < n; i += 16) {
+    __mmask16 mask = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    __m512 x = _mm512_sub_ps(_mm512_setzero_ps(), _mm512_maskz_loadu_ps(mask, z + i));
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_sub_ps(_mm512_setzero_ps(), clamp)), clamp);
+    __m512 k = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(LOG2E)),
+                                    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(k, _mm512_set1_ps(LN2_HI), x);
+    r = _mm512_fnmadd_ps(k, _mm512_set1_ps(LN2_LO), r);
+    __m512 e = _mm512_set1_ps(1.0f / 720);
+    e = _mm512_fmadd_ps(e, r, _mm512_set1_ps(1.0f / 120));
+    e = _mm512_fmadd_ps(e, r, _mm512_set1_ps(1.0f / 24));
+    e = _mm512_fmadd_ps(e, r, _mm512_set1_ps(1.0f / 6));
+    e = _mm512_fmadd_ps(e, r, _mm512_set1_ps(0.5f));
+    e = _mm512_fmadd_ps(e, r, one);
+    e = _mm512_fmadd_ps(e, r, one);
+    e = _mm512_scalef_ps(e, k);
+    _mm512_mask_storeu_ps(p + i, mask, _mm512_div_ps(one, _mm512_add_ps(one, e)));
+  }
+}
+#endif
+
+/*
+ * Every kernel level, narrowest first.
+ */
+const kernels kernel_levels[] = {
+  { "scalar", dot_scalar, axpy_scalar, reg_update_scalar, sigmoid_scalar },
+#ifdef HAVE_X86_KERNELS
+  { "sse", dot_sse, axpy_sse, reg_update_sse, sigmoid_sse },
+  { "avx2", dot_avx2, axpy_avx2, reg_update_avx2, sigmoid_avx2 },
+  { "avx512", dot_avx512, axpy_avx512, reg_update_avx512, sigmoid_avx512 },
+#endif
+};
+const size_t kernel_level_count = sizeof(kernel_levels) / sizeof(kernel_levels[0]);
+
+kernels kernel = { "scalar", dot_scalar, axpy_scalar, reg_update_scalar, sigmoid_scalar };
+
+bool kernel_supported(const kernels *k) {
+#ifdef HAVE_X86_KERNELS
+  if (strcmp(k->name, "sse") == 0) return __builtin_cpu_supports("sse2");
+  if (strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (strcmp(k->name, "avx512") == 0) return __builtin_cpu_supports("avx512f");
+#endif
+  return true;
+}
+
+/*
+ * Sigmoid of n scores, with the selected kernel or, in exact mode, expf().
+ */
+void sigmoid_batch(const float *z, float *p, size_t n) {
+  if (exact_sigmoid) {
+    for (size_t i = 0; i < n; ++i) p[i] = sigmoidf(z[i]);
+  } else {
+    kernel.sigmoid(z, p, n);
+  }
+}
+
+pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+
+void select_kernels_once(void) {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+#endif
+  for (size_t i = 0; i < KERNEL_LEVELS; ++i) {
+    if (kernel_supported(&kernel_levels[i])) kernel = kernel_levels[i];
+  }
+}
+
+/*
+ * Picks the widest kernel level supported by the CPU. Only the first call
+ * does anything, so it is safe to call from every entry point.
+ */
+void select_kernels(void) {
+  pthread_once(&kernels_selected, select_kernels_once);
+}
+
+// ---------- NLP ----------
+
+/*
+ * Loads a list of stop words, one per line, into the given dynamic array.
+ */
+spamclf_status read_stop_words(const char *path, char ***words) {
+  FILE *file;
+  char buf[SMALL_BUFFER_SIZE];
+
+  file = fopen(path, "r");
+  if (file == NULL) {
+    return SPAMCLF_ERROR_IO;
+  }
+
+  while (fgets(buf, SMALL_BUFFER_SIZE, file) != NULL) {
+    buf[strcspn(buf, "\r\n")] = '\0'; // Remove newline or carriage return
+    char *word = str_dup(buf);
+    if (word == NULL) {
+      fclose(file);
+      return SPAMCLF_ERROR_MEMORY;
+    }
+    arrput(*words, word);
+  }
+
+  fclose(file);
+  return SPAMCLF_OK;
+}
+
+void free_stop_words(char ***words) {
+  for (size_t i = 0; i < arrlenu(*words); ++i) {
+    SPAM_FREE((*words)[i]);
+  }
+  arrfree(*words);
+}
+
+/*
+ * Checks whether the word is a valid token. The word should be of length
+ * TOKEN_MIN_LENGTH-TOKEN_MAX_LENGTH and should not be a stop word.
+ */
+bool accept_string(char **const *stop_words, const char *str) {
+  size_t str_len = strlen(str);
+  if (str_len < TOKEN_MIN_LENGTH || str_len > TOKEN_MAX_LENGTH) return false;
+
+  for (size_t i = 0; i < arrlenu(*stop_words); ++i) {
+    if (strcmp((*stop_words)[i], str) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ---------- String pool ----------
+
+/*
+ * Tokens are stored back to back in a string pool (a stb_ds char array), each
+ * prefixed with its length as a LEB128 varint, and referenced by offset.
+ */
+uint32_t pool_append(char **pool, const char *token, size_t len) {
+  uint32_t offset = arrlenu(*pool);
+  size_t value = len;
+  while (value >= 0x80) {
+    arrput(*pool, (char)(value | 0x80));
+    value >>= 7;
+  }
+  arrput(*pool, (char)value);
+  for (size_t i = 0; i < len; ++i) {
+    arrput(*pool, token[i]);
+  }
+  return offset;
+}
+
+/*
+ * The token stored at the given offset. Its length is written to len.
+ */
+const char *pool_token(const char *pool, uint32_t offset, size_t *len) {
+  const unsigned char *p = (const unsigned char *)pool + offset;
+  size_t value = 0;
+  int shift = 0;
+  while (*p & 0x80) {
+    value |= (size_t)(*p++ & 0x7f) << shift;
+    shift += 7;
+  }
+  value |= (size_t)*p++ << shift;
+  *len = value;
+  return (const char *)p;
+}
+
+/*
+ * pool_token() for a pool of pool_size bytes read from a file. Returns NULL
+ * if the offset, the length prefix or the token runs past the pool, or the
+ * prefix is longer than POOL_PREFIX_MAX bytes.
+ */
+const char *pool_token_checked(const char *pool, size_t pool_size, size_t offset, size_t *len) {
+  if (offset >= pool_size) return NULL;
+  const unsigned char *p = (const unsigned char *)pool + offset;
+  const unsigned char *end = (const unsigned char *)pool + pool_size;
+  size_t value = 0;
+  for (int i = 0;; ++i) {
+    if (p == end || i == POOL_PREFIX_MAX) return NULL;
+    unsigned char byte = *p++;
+    value |= (size_t)(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80)) break;
+  }
+  if (value > (size_t)(end - p)) return NULL;
+  *len = value;
+  return (const char *)p;
+}
+
+uint32_t token_fingerprint(uint64_t hash) {
+  uint32_t fingerprint = hash >> 32;
+  return fingerprint ? fingerprint : 1;
+}
+
+bool token_slot_matches(const token_slot *slot, uint32_t fingerprint, const char *pool,
+                        const uint32_t *offsets, const char *token, size_t len) {
+  if (slot->fingerprint != fingerprint) return false;
+  if (len <= TOKEN_INLINE_MAX) {
+    return slot->len == len && memcmp(slot->key, token, len) == 0;
+  }
+  if (slot->len != TOKEN_LONG) return false;
+  size_t stored_len;
+  const char *stored = pool_token(pool, offsets[slot->value], &stored_len);
+  return stored_len == len && memcmp(stored, token, len) == 0;
+}
+
+/*
+ * Value of the token, or -1 if it is not in the table. pool and offsets are
+ * only read for tokens longer than TOKEN_INLINE_MAX.
+ */
+ptrdiff_t token_table_find(const token_table *t, const char *pool, const uint32_t *offsets,
+                           const char *token, size_t len) {
+  return token_table_find_hashed(t, pool, offsets, token, len, hash_bytes(token, len, 0));
+}
+
+/*
+ * As token_table_find(), given hash_bytes(token, len, 0) already computed.
+ */
+ptrdiff_t token_table_find_hashed(const token_table *t, const char *pool, const uint32_t *offsets,
+                                  const char *token, size_t len, uint64_t hash) {
+  if (t->slots == NULL) return -1;
+  uint32_t fingerprint = token_fingerprint(hash);
+  for (size_t i = hash & t->mask;; i = (i + 1) & t->mask) {
+    const token_slot *slot = &t->slots[i];
+    if (slot->fingerprint == 0) return -1;
+    if (token_slot_matches(slot, fingerprint, pool, offsets, token, len)) return slot->value;
+  }
+}
+
+void token_table_place(token_table *t, uint64_t hash, const token_slot *slot) {
+  size_t i = hash & t->mask;
+  while (t->slots[i].fingerprint != 0) i = (i + 1) & t->mask;
+  t->slots[i] = *slot;
+}
+
+/*
+ * Adds a token with the given value. The token must not be in the table.
+ */
+spamclf_status token_table_insert(token_table *t, const char *pool, const uint32_t *offsets,
+                                  const char *token, size_t len, uint32_t value) {
+  if (t->slots == NULL || 2 * (t->count + 1) > t->mask + 1) {
+    token_table grown = { .mask = t->slots ? 2 * t->mask + 1 : 255, .count = t->count };
+    grown.slots = SPAM_CALLOC(grown.mask + 1, sizeof(token_slot));
+    if (grown.slots == NULL) {
+      return SPAMCLF_ERROR_MEMORY;
+    }
+    for (size_t i = 0; t->slots && i <= t->mask; ++i) {
+      const token_slot *slot = &t->slots[i];
+      if (slot->fingerprint == 0) continue;
+      size_t stored_len = slot->len;
+      const char *stored = slot->key;
+      if (slot->len == TOKEN_LONG) {
+        stored = pool_token(pool, offsets[slot->value], &stored_len);
+      }
+      token_table_place(&grown, hash_bytes(stored, stored_len, 0), slot);
+    }
+    SPAM_FREE(t->slots);
+    *t = grown;
+  }
+
+  uint64_t hash = hash_bytes(token, len, 0);
+  token_slot slot = { .fingerprint = token_fingerprint(hash), .value = value };
+  if (len <= TOKEN_INLINE_MAX) {
+    slot.len = len;
+    memcpy(slot.key, token, len);
+  } else {
+    slot.len = TOKEN_LONG;
+  }
+  token_table_place(t, hash, &slot);
+  t->count++;
+  return SPAMCLF_OK;
+}
+
+void free_token_table(token_table *t) {
+  SPAM_FREE(t->slots);
+  memset(t, 0, sizeof(*t));
+}
+
+// ---------- Minimal perfect hash ----------
+
+uint32_t fastrange32(uint32_t x, uint32_t n) {
+  return ((uint64_t)x * n) >> 32;
+}
+
+uint32_t mphf_position(uint64_t hash, uint32_t displacement, uint32_t n) {
+  return fastrange32((uint32_t)mix64(hash ^ ((uint64_t)(displacement + 1) * 0x9e3779b97f4a7c15ULL)), n);
+}
+
+/*
+ * Slot of a key. Keys outside the set map to an arbitrary slot, so callers
+ * have to compare against the key stored there.
+ */
+uint32_t mphf_slot(const mphf *h, const char *key, size_t len) {
+  return mphf_slot_hashed(h, hash_bytes(key, len, h->seed));
+}
+
+/*
+ * As mphf_slot(), given hash_bytes(key, len, h->seed) already computed.
+ */
+uint32_t mphf_slot_hashed(const mphf *h, uint64_t hash) {
+  uint32_t d = h->displacements[fastrange32(hash >> 32, h->buckets)];
+  if (d & MPHF_DIRECT) return d & ~MPHF_DIRECT;
+  return mphf_position(hash, d, h->size);
+}
+
+/*
+ * Builds the function over n distinct pooled keys, trying seeds until every
+ * bucket can be placed.
+ */
+spamclf_status index_tokens(mphf *h, const char *pool, const uint32_t *offsets, size_t n) {
+  spamclf_status status = SPAMCLF_ERROR_INDEX;
+  for (uint64_t seed = 0; seed < MPHF_MAX_SEEDS; ++seed) {
+    status = build_mphf(h, pool, offsets, n, seed);
+    if (status != SPAMCLF_ERROR_INDEX) break;
+  }
+  return status;
+}
+
+void free_mphf(mphf *h) {
+  SPAM_FREE(h->displacements);
+  memset(h, 0, sizeof(*h));
+}
+
+// ---------- Bloom filter ----------
+
+/*
+ * Odd multipliers spreading the high half of a key hash over the bit
+ * positions of each word of its block, as in Parquet's split block filters.
+ */
+const uint32_t bloom_salts[BLOOM_BLOCK_WORDS] = {
+  0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+  0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+};
+
+/*
+ * Blocks of a filter over n keys at BLOOM_BITS_PER_TOKEN bits per key.
+ */
+uint32_t bloom_blocks(size_t n) {
+  size_t bits = BLOOM_BLOCK_WORDS * 64;
+  return (n * BLOOM_BITS_PER_TOKEN + bits - 1) / bits + 1;
+}
+
+spamclf_status bloom_init(bloom_filter *b, uint32_t blocks) {
+  memset(b, 0, sizeof(*b));
+  size_t size = (size_t)blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+  b->allocation = SPAM_CALLOC(size + 64, 1);
+  if (b->allocation == NULL) return SPAMCLF_ERROR_MEMORY;
+  b->words = (uint64_t *)(((uintptr_t)b->allocation + 63) & ~(uintptr_t)63);
+  b->blocks = blocks;
+  return SPAMCLF_OK;
+}
+
+uint64_t *bloom_block(const bloom_filter *b, uint64_t hash) {
+  return &b->words[(size_t)fastrange32((uint32_t)hash, b->blocks) * BLOOM_BLOCK_WORDS];
+}
+
+void bloom_add(bloom_filter *b, uint64_t hash) {
+  uint64_t *block = bloom_block(b, hash);
+  for (size_t i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+    block[i] |= 1ULL << (((uint32_t)(hash >> 32) * bloom_salts[i]) >> 26);
+  }
+}
+
+/*
+ * False only if no key with this hash was added.
+ */
+bool bloom_may_contain(const bloom_filter *b, uint64_t hash) {
+  if (b->blocks == 0) return true;
+  const uint64_t *block = bloom_block(b, hash);
+  uint64_t present = 1;
+  for (size_t i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+    present &= block[i] >> (((uint32_t)(hash >> 32) * bloom_salts[i]) >> 26);
+  }
+  return present;
+}
+
+/*
+ * Filter over n pooled tokens, hashed with the seed of their index.
+ */
+spamclf_status build_token_bloom(bloom_filter *b, const char *pool, const uint32_t *offsets,
+                                 size_t n, uint64_t seed) {
+  spamclf_status status = bloom_init(b, bloom_blocks(n));
+  if (status != SPAMCLF_OK) return status;
+  for (size_t i = 0; i < n; ++i) {
+    size_t len;
+    const char *token = pool_token(pool, offsets[i], &len);
+    bloom_add(b, hash_bytes(token, len, seed));
+  }
+  return SPAMCLF_OK;
+}
+
+void free_bloom(bloom_filter *b) {
+  SPAM_FREE(b->allocation);
+  memset(b, 0, sizeof(*b));
+}
+
+/*
+ * Builds the function over n distinct pooled keys with the given seed.
+ * Returns SPAMCLF_ERROR_INDEX if some bucket could not be placed, in which
+ * case the caller retries with another seed.
+ */
+spamclf_status build_mphf(mphf *h, const char *pool, const uint32_t *offsets, size_t n, uint64_t seed) {
+  h->seed = seed;
+  h->size = n;
+  h->buckets = n / MPHF_BUCKET_LOAD + 1;
+  h->displacements = SPAM_CALLOC(h->buckets, sizeof(uint32_t));
+
+  uint64_t *hashes = SPAM_MALLOC(n * sizeof(uint64_t) + 1);
+  uint32_t *bucket_start = SPAM_CALLOC(h->buckets + 1, sizeof(uint32_t));
+  uint32_t *bucket_keys = SPAM_MALLOC(n * sizeof(uint32_t) + 1);
+  uint32_t *order = SPAM_MALLOC(h->buckets * sizeof(uint32_t));
+  uint32_t *positions = NULL;
+  bool *taken = SPAM_CALLOC(n + 1, sizeof(bool));
+  uint32_t *fill = NULL;
+  uint32_t *size_start = NULL;
+  spamclf_status status = SPAMCLF_OK;
+  if (h->displacements == NULL || hashes == NULL || bucket_start == NULL ||
+      bucket_keys == NULL || order == NULL || taken == NULL) {
+    status = SPAMCLF_ERROR_MEMORY;
+    goto done;
+  }
+
+  // Group the keys by bucket (counting sort).
+  for (size_t i = 0; i < n; ++i) {
+    size_t len;
+    const char *key = pool_token(pool, offsets[i], &len);
+    hashes[i] = hash_bytes(key, len, seed);
+    bucket_start[fastrange32(hashes[i] >> 32, h->buckets) + 1]++;
+  }
+  size_t largest = 0;
+  for (size_t b = 0; b < h->buckets; ++b) {
+    if (bucket_start[b + 1] > largest) largest = bucket_start[b + 1];
+    bucket_start[b + 1] += bucket_start[b];
+  }
+  fill = SPAM_MALLOC((h->buckets + 1) * sizeof(uint32_t));
+  size_start = SPAM_CALLOC(largest + 2, sizeof(uint32_t));
+  if (fill == NULL || size_start == NULL) {
+    status = SPAMCLF_ERROR_MEMORY;
+    goto done;
+  }
+  memcpy(fill, bucket_start, (h->buckets + 1) * sizeof(uint32_t));
+  for (size_t i = 0; i < n; ++i) {
+    bucket_keys[fill[fastrange32(hashes[i] >> 32, h->buckets)]++] = i;
+  }
+
+  // Place the largest buckets first, while most slots are still free.
+  for (size_t b = 0; b < h->buckets; ++b) {
+    size_start[largest - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+  }
+  for (size_t k = 0; k <= largest; ++k) {
+    size_start[k + 1] += size_start[k];
+  }
+  for (size_t b = 0; b < h->buckets; ++b) {
+    order[size_start[largest - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+  }
+
+  size_t next_free = 0;
+  for (size_t o = 0; o < h->buckets && status == SPAMCLF_OK; ++o) {
+    uint32_t b = order[o];
+    uint32_t *members = bucket_keys + bucket_start[b];
+    size_t size = bucket_start[b + 1] - bucket_start[b];
+    if (size == 0) break;
+
+    if (size == 1) {
+      while (taken[next_free]) ++next_free;
+      taken[next_free] = true;
+      h->displacements[b] = MPHF_DIRECT | next_free;
+      continue;
+    }
+
+    arrsetlen(positions, size);
+    uint32_t d;
+    for (d = 0; d < MPHF_MAX_DISPLACEMENT; ++d) {
+      size_t k;
+      for (k = 0; k < size; ++k) {
+        positions[k] = mphf_position(hashes[members[k]], d, n);
+        if (taken[positions[k]]) break;
+        size_t l;
+        for (l = 0; l < k && positions[l] != positions[k]; ++l);
+        if (l < k) break;
+      }
+      if (k == size) break;
+    }
+    if (d == MPHF_MAX_DISPLACEMENT) {
+      status = SPAMCLF_ERROR_INDEX;
+      break;
+    }
+    for (size_t k = 0; k < size; ++k) {
+      taken[positions[k]] = true;
+    }
+    h->displacements[b] = d;
+  }
+
+done:
+  arrfree(positions);
+  SPAM_FREE(taken);
+  SPAM_FREE(size_start);
+  SPAM_FREE(fill);
+  SPAM_FREE(order);
+  SPAM_FREE(bucket_keys);
+  SPAM_FREE(bucket_start);
+  SPAM_FREE(hashes);
+  if (status != SPAMCLF_OK) free_mphf(h);
+  return status;
+}
+
+// ---------- Model ----------
+
+/*
+ * The i-th vocabulary token. Its length is written to len.
+ */
+const char *vocabulary_token(const model *m, size_t i, size_t *len) {
+  return pool_token(m->pool, m->offsets[i], len);
+}
+
+size_t hashed_buckets(const model *m) {
+  return (m->flags & HASHED_FEATURES) ? (size_t)1 << m->hash_bits : 0;
+}
+
+size_t feature_count(const model *m) {
+  return m->vocabulary_size + hashed_buckets(m);
+}
+
+/*
+ * Hash of a pair of consecutive tokens, given the hashes of both. Its high
+ * bits are the hashed bucket.
+ */
+uint64_t bigram_hash(uint64_t previous, uint64_t current) {
+  return mix64(previous * 0x9e3779b97f4a7c15ULL ^ current ^ BIGRAM_SEED);
+}
+
+/*
+ * Hashed bucket of a pair of consecutive tokens, given the hashes of both.
+ */
+size_t bigram_bucket(const model *m, uint64_t previous, uint64_t current) {
+  return bigram_hash(previous, current) >> (64 - m->hash_bits);
+}
+
+/*
+ * Resizes the vocabulary of the model, keeping the hashed buckets after it.
+ * New tokens start with zero weight, IDF and count, and have to be given a
+ * pool offset by the caller. On failure the model can only be freed.
+ */
+spamclf_status resize_model(model *m, size_t vocabulary_size) {
+  size_t old_size = m->vocabulary_size;
+  size_t hashed = hashed_buckets(m);
+  size_t features = vocabulary_size + hashed;
+  bool allocated = m->weights != NULL;
+
+#define move_hashed_buckets() do {                                       \
+    memmove(m->weights + vocabulary_size, m->weights + old_size,        \
+            hashed * sizeof(*m->weights));                              \
+    memmove(m->idf + vocabulary_size, m->idf + old_size,                \
+            hashed * sizeof(*m->idf));                                  \
+    if (m->counts)                                                      \
+      memmove(m->counts + vocabulary_size, m->counts + old_size,        \
+              hashed * sizeof(*m->counts));                             \
+  } while(0)
+
+  if (allocated && vocabulary_size < old_size) move_hashed_buckets();
+  float *weights = SPAM_REALLOC(m->weights, features * sizeof(*m->weights) + 1);
+  if (weights != NULL) m->weights = weights;
+  float *idf = SPAM_REALLOC(m->idf, features * sizeof(*m->idf) + 1);
+  if (idf != NULL) m->idf = idf;
+  uint32_t *counts = SPAM_REALLOC(m->counts, features * sizeof(*m->counts) + 1);
+  if (counts != NULL) m->counts = counts;
+  uint32_t *offsets = SPAM_REALLOC(m->offsets, vocabulary_size * sizeof(*m->offsets) + 1);
+  if (offsets != NULL) m->offsets = offsets;
+  if (weights == NULL || idf == NULL || counts == NULL || offsets == NULL) {
+    return SPAMCLF_ERROR_MEMORY;
+  }
+  if (allocated && vocabulary_size > old_size) move_hashed_buckets();
+#undef move_hashed_buckets
+
+  size_t first_new = allocated ? old_size : 0;
+  size_t last_new = allocated ? vocabulary_size : features;
+  for (size_t i = first_new; i < last_new; ++i) {
+    m->weights[i] = 0.0f;
+    m->idf[i] = 0.0f;
+    m->counts[i] = 0;
+  }
+  m->vocabulary_size = vocabulary_size;
+  return SPAMCLF_OK;
+}
+
+void free_model(model *m) {
+  SPAM_FREE(m->weights);
+  SPAM_FREE(m->idf);
+  SPAM_FREE(m->counts);
+  arrfree(m->pool);
+  SPAM_FREE(m->offsets);
+  free_mphf(&m->index);
+  free_bloom(&m->bloom);
+  memset(m, 0, sizeof(*m));
+}
+
+/*
+ * Slot of a token in a non-empty set of pooled tokens ordered by their slot
+ * in index, or -1 if it is not in the set. Costs one hash and one Bloom
+ * filter block, and for the tokens that pass it one displacement fetch and
+ * one compare against the stored token.
+ */
+ptrdiff_t find_indexed_token(const mphf *index, const bloom_filter *bloom, const char *pool,
+                             const uint32_t *offsets, const char *token, size_t len) {
+  uint64_t hash = hash_bytes(token, len, index->seed);
+  __builtin_prefetch(&index->displacements[fastrange32(hash >> 32, index->buckets)]);
+  if (!bloom_may_contain(bloom, hash)) return -1;
+  uint32_t slot = mphf_slot_hashed(index, hash);
+  size_t stored_len;
+  const char *stored = pool_token(pool, offsets[slot], &stored_len);
+  if (stored_len != len || memcmp(stored, token, len) != 0) return -1;
+  return slot;
+}
+
+/*
+ * Vocabulary index of a token, or -1 if it is not in the vocabulary.
+ */
+ptrdiff_t lookup_token(const model *m, const char *token, size_t len) {
+  if (m->vocabulary_size == 0) return -1;
+  return find_indexed_token(&m->index, &m->bloom, m->pool, m->offsets, token, len);
+}
+
+/*
+ * Builds the Bloom filter of the vocabulary from the index hashes of its
+ * tokens, replacing any previous one.
+ */
+spamclf_status build_vocabulary_bloom(model *m) {
+  free_bloom(&m->bloom);
+  return build_token_bloom(&m->bloom, m->pool, m->offsets, m->vocabulary_size, m->index.seed);
+}
+
+/*
+ * Builds the vocabulary index and its Bloom filter, and reorders the tokens
+ * so that each one sits at its slot. Duplicate tokens, which only headerless
+ * models can contain, are dropped first since only the first copy was ever
+ * looked up.
+ */
+spamclf_status index_vocabulary(model *m) {
+  spamclf_status status = SPAMCLF_OK;
+  token_table seen = {0};
+  size_t unique = 0;
+  for (size_t i = 0; i < m->vocabulary_size; ++i) {
+    size_t len;
+    const char *token = vocabulary_token(m, i, &len);
+    if (token_table_find(&seen, m->pool, m->offsets, token, len) != -1) continue;
+    if (unique != i) {
+      m->weights[unique] = m->weights[i];
+      m->idf[unique] = m->idf[i];
+      if (m->counts) m->counts[unique] = m->counts[i];
+      m->offsets[unique] = m->offsets[i];
+    }
+    status = token_table_insert(&seen, m->pool, m->offsets, token, len, unique);
+    if (status != SPAMCLF_OK) break;
+    unique++;
+  }
+  free_token_table(&seen);
+  if (status != SPAMCLF_OK) return status;
+  if (unique != m->vocabulary_size) {
+    bool has_counts = m->counts != NULL;
+    status = resize_model(m, unique);
+    if (status != SPAMCLF_OK) return status;
+    if (!has_counts) {
+      SPAM_FREE(m->counts);
+      m->counts = NULL;
+    }
+  }
+
+  free_mphf(&m->index);
+  status = index_tokens(&m->index, m->pool, m->offsets, m->vocabulary_size);
+  if (status != SPAMCLF_OK) return status;
+
+  // Reorder by slot, rewriting the pool compactly in the same order.
+  size_t n = m->vocabulary_size;
+  float *weights = SPAM_MALLOC(n * sizeof(float) + 1);
+  float *idf = SPAM_MALLOC(n * sizeof(float) + 1);
+  uint32_t *counts = SPAM_MALLOC(n * sizeof(uint32_t) + 1);
+  uint32_t *order = SPAM_MALLOC(n * sizeof(uint32_t) + 1);
+  if (weights == NULL || idf == NULL || counts == NULL || order == NULL) {
+    status = SPAMCLF_ERROR_MEMORY;
+    goto done;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    size_t len;
+    const char *token = vocabulary_token(m, i, &len);
+    uint32_t slot = mphf_slot(&m->index, token, len);
+    weights[slot] = m->weights[i];
+    idf[slot] = m->idf[i];
+    if (m->counts) counts[slot] = m->counts[i];
+    order[slot] = i;
+  }
+  char *pool = NULL;
+  for (size_t slot = 0; slot < n; ++slot) {
+    size_t len;
+    const char *token = vocabulary_token(m, order[slot], &len);
+    order[slot] = pool_append(&pool, token, len);
+  }
+  memcpy(m->weights, weights, n * sizeof(float));
+  memcpy(m->idf, idf, n * sizeof(float));
+  if (m->counts) memcpy(m->counts, counts, n * sizeof(uint32_t));
+  memcpy(m->offsets, order, n * sizeof(uint32_t));
+  arrfree(m->pool);
+  m->pool = pool;
+  status = build_vocabulary_bloom(m);
+
+done:
+  SPAM_FREE(weights);
+  SPAM_FREE(idf);
+  SPAM_FREE(counts);
+  SPAM_FREE(order);
+  return status;
+}
+
+#define read_model_field(ptr, size, n, file) do {               \
+    if (fread(ptr, size, n, file) != (n)) {                     \
+      return SPAMCLF_ERROR_FORMAT;                              \
+    }                                                           \
+  } while(0)
+
+#define write_model_field(ptr, size, n, file) do {              \
+    if (fwrite(ptr, size, n, file) != (n)) {                    \
+      fclose(file);                                             \
+      return SPAMCLF_ERROR_IO;                                  \
+    }                                                           \
+  } while(0)
+
+/*
+ * Reads vocabulary stored as fixed 16 byte records, as saved before model
+ * version 5, into the string pool.
+ */
+spamclf_status read_fixed_vocabulary(model *m, FILE *file) {
+  char token[16];
+  for (size_t i = 0; i < m->vocabulary_size; ++i) {
+    read_model_field(token, sizeof(char), 16, file);
+    token[15] = '\0';
+    m->offsets[i] = pool_append(&m->pool, token, strlen(token));
+  }
+  return SPAMCLF_OK;
+}
+
+spamclf_status read_model_file(model *m, FILE *file) {
+  spamclf_status status;
+  uint32_t header[2];
+  if (fread(header, sizeof(uint32_t), 2, file) == 2 && header[0] == MODEL_MAGIC) {
+    if (header[1] < 2) return SPAMCLF_ERROR_FORMAT;
+    if (header[1] > MODEL_VERSION) return SPAMCLF_ERROR_VERSION;
+    uint64_t sizes[2];
+    read_model_field(sizes, sizeof(uint64_t), 2, file);
+    if (header[1] >= 3) {
+      uint32_t options[2];
+      read_model_field(options, sizeof(uint32_t), 2, file);
+      m->flags = options[0];
+      m->hash_bits = options[1];
+      if (hashed_buckets(m) > 0 && (m->hash_bits == 0 || m->hash_bits > 30)) {
+        return SPAMCLF_ERROR_FORMAT;
+      }
+    }
+    if (sizes[0] > UINT32_MAX) return SPAMCLF_ERROR_FORMAT;
+    status = resize_model(m, sizes[0]);
+    if (status != SPAMCLF_OK) return status;
+    m->documents = sizes[1];
+    read_model_field(m->weights, sizeof(float), feature_count(m), file);
+    read_model_field(&m->bias, sizeof(float), 1, file);
+    read_model_field(m->idf, sizeof(float), feature_count(m), file);
+    read_model_field(m->counts, sizeof(uint32_t), feature_count(m), file);
+    if (header[1] >= 5) {
+      uint64_t pool_size;
+      read_model_field(&pool_size, sizeof(uint64_t), 1, file);
+      if (pool_size > UINT32_MAX) return SPAMCLF_ERROR_FORMAT;
+      arrsetlen(m->pool, pool_size);
+      read_model_field(m->pool, sizeof(char), pool_size, file);
+      read_model_field(m->offsets, sizeof(uint32_t), m->vocabulary_size, file);
+      for (size_t i = 0; i < m->vocabulary_size; ++i) {
+        size_t len;
+        if (pool_token_checked(m->pool, pool_size, m->offsets[i], &len) == NULL) {
+          return SPAMCLF_ERROR_FORMAT;
+        }
+      }
+    } else {
+      status = read_fixed_vocabulary(m, file);
+      if (status != SPAMCLF_OK) return status;
+    }
+    if (header[1] >= 4) {
+      uint32_t buckets;
+      read_model_field(&m->index.seed, sizeof(uint64_t), 1, file);
+      read_model_field(&buckets, sizeof(uint32_t), 1, file);
+      if (buckets != m->vocabulary_size / MPHF_BUCKET_LOAD + 1) {
+        return SPAMCLF_ERROR_FORMAT;
+      }
+      m->index.size = m->vocabulary_size;
+      m->index.buckets = buckets;
+      m->index.displacements = SPAM_MALLOC(buckets * sizeof(uint32_t));
+      if (m->index.displacements == NULL) {
+        return SPAMCLF_ERROR_MEMORY;
+      }
+      read_model_field(m->index.displacements, sizeof(uint32_t), buckets, file);
+      // Direct slots, including those of buckets no stored token hashes to,
+      // have to be inside the vocabulary, and every stored token has to be
+      // found at its own slot.
+      for (size_t b = 0; b < buckets; ++b) {
+        uint32_t d = m->index.displacements[b];
+        if ((d & MPHF_DIRECT) && (d & ~MPHF_DIRECT) >= m->vocabulary_size) {
+          return SPAMCLF_ERROR_FORMAT;
+        }
+      }
+      for (size_t i = 0; i < m->vocabulary_size; ++i) {
+        size_t len;
+        const char *token = vocabulary_token(m, i, &len);
+        if (mphf_slot(&m->index, token, len) != i) return SPAMCLF_ERROR_FORMAT;
+      }
+    }
+    if (header[1] >= 6) {
+      uint32_t blocks;
+      read_model_field(&blocks, sizeof(uint32_t), 1, file);
+      if (blocks != bloom_blocks(m->vocabulary_size)) return SPAMCLF_ERROR_FORMAT;
+      status = bloom_init(&m->bloom, blocks);
+      if (status != SPAMCLF_OK) return status;
+      read_model_field(m->bloom.words, sizeof(uint64_t), (size_t)blocks * BLOOM_BLOCK_WORDS, file);
+    }
+    // Counts saved before version 7 are token occurrences rather than
+    // document frequencies, and cannot be updated consistently.
+    if (header[1] < 7) {
+      SPAM_FREE(m->counts);
+      m->counts = NULL;
+    }
+  } else {
+    rewind(file);
+    status = resize_model(m, LEGACY_VOCABULARY_SIZE);
+    if (status != SPAMCLF_OK) return status;
+    SPAM_FREE(m->counts);
+    m->counts = NULL;
+    read_model_field(m->weights, sizeof(float), m->vocabulary_size, file);
+    read_model_field(&m->bias, sizeof(float), 1, file);
+    read_model_field(m->idf, sizeof(float), m->vocabulary_size, file);
+    status = read_fixed_vocabulary(m, file);
+    if (status != SPAMCLF_OK) return status;
+  }
+
+  // Models saved before the vocabulary index or its Bloom filter existed get
+  // them built now.
+  if (m->index.displacements == NULL) {
+    return index_vocabulary(m);
+  }
+  if (m->bloom.blocks == 0) {
+    return build_vocabulary_bloom(m);
+  }
+  return SPAMCLF_OK;
+}
+
+/*
+ * Loads a model file. Files without the MODEL_MAGIC header are read in the
+ * original fixed-size layout, which carries no token counts. On failure the
+ * model is left empty.
+ */
+spamclf_status read_model(model *m, const char *path) {
+  memset(m, 0, sizeof(*m));
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return SPAMCLF_ERROR_IO;
+  }
+  spamclf_status status = read_model_file(m, file);
+  fclose(file);
+  if (status != SPAMCLF_OK) free_model(m);
+  return status;
+}
+
+/*
+ * Writes the model and closes the file.
+ */
+spamclf_status write_model_file(const model *m, FILE *file) {
+  uint32_t header[2] = { MODEL_MAGIC, MODEL_VERSION };
+  uint64_t sizes[2] = { m->vocabulary_size, m->documents };
+  uint32_t options[2] = { m->flags, m->hash_bits };
+  write_model_field(header, sizeof(uint32_t), 2, file);
+  write_model_field(sizes, sizeof(uint64_t), 2, file);
+  write_model_field(options, sizeof(uint32_t), 2, file);
+  write_model_field(m->weights, sizeof(float), feature_count(m), file);
+  write_model_field(&m->bias, sizeof(float), 1, file);
+  write_model_field(m->idf, sizeof(float), feature_count(m), file);
+  write_model_field(m->counts, sizeof(uint32_t), feature_count(m), file);
+  uint64_t pool_size = arrlenu(m->pool);
+  write_model_field(&pool_size, sizeof(uint64_t), 1, file);
+  write_model_field(m->pool, sizeof(char), pool_size, file);
+  write_model_field(m->offsets, sizeof(uint32_t), m->vocabulary_size, file);
+  write_model_field(&m->index.seed, sizeof(uint64_t), 1, file);
+  write_model_field(&m->index.buckets, sizeof(uint32_t), 1, file);
+  write_model_field(m->index.displacements, sizeof(uint32_t), m->index.buckets, file);
+  write_model_field(&m->bloom.blocks, sizeof(uint32_t), 1, file);
+  write_model_field(m->bloom.words, sizeof(uint64_t), (size_t)m->bloom.blocks * BLOOM_BLOCK_WORDS,
+                    file);
+
+  if (fclose(file) != 0) {
+    return SPAMCLF_ERROR_IO;
+  }
+  return SPAMCLF_OK;
+}
+
+/*
+ * Saves the model into a file. The vocabulary has to be indexed with
+ * index_vocabulary() first. The model is written next to the file and renamed
+ * over it, so a process reloading the file never sees it half written.
+ */
+spamclf_status write_model(const model *m, const char *path) {
+  char *temp = SPAM_MALLOC(strlen(path) + sizeof(".tmp"));
+  if (temp == NULL) return SPAMCLF_ERROR_MEMORY;
+  strcpy(temp, path);
+  strcat(temp, ".tmp");
+
+  spamclf_status status = SPAMCLF_ERROR_IO;
+  FILE *file = fopen(temp, "wb");
+  if (file != NULL) {
+    status = write_model_file(m, file);
+    if (status == SPAMCLF_OK && rename(temp, path) != 0) status = SPAMCLF_ERROR_IO;
+    if (status != SPAMCLF_OK) {
+      int error = errno;
+      unlink(temp);
+      errno = error;
+    }
+  }
+  SPAM_FREE(temp);
+  return status;
+}
+
+/*
+ * Runs body for every character n-gram of a message of len bytes, with its
+ * hash in the variable named ngram, whose high bits are its hashed bucket.
+ * Rolling hashes as in extract_char_ngrams(), with the last characters kept
+ * in a ring instead of being read back from the input.
+ */
+#define for_each_char_ngram(msg, len, ngram, body) do {                 \
+    uint64_t hash_[CHAR_NGRAM_MAX + 1] = {0};                           \
+    uint64_t power_[CHAR_NGRAM_MAX + 1];                                \
+    unsigned char ring_[8];                                             \
+    power_[0] = 1;                                                      \
+    for (size_t n_ = 1; n_ <= CHAR_NGRAM_MAX; ++n_) power_[n_] = power_[n_ - 1] * 0x100000001b3ULL; \
+    for (size_t i_ = 0; i_ < (len) && (msg)[i_] != '\0'; ++i_) {        \
+      ring_[i_ % 8] = (unsigned char)tolower((unsigned char)(msg)[i_]); \
+      for (size_t n_ = CHAR_NGRAM_MIN; n_ <= CHAR_NGRAM_MAX; ++n_) {    \
+        hash_[n_] = hash_[n_] * 0x100000001b3ULL + ring_[i_ % 8] + 1;   \
+        if (i_ >= n_) hash_[n_] -= (ring_[(i_ - n_) % 8] + 1) * power_[n_]; \
+        if (i_ + 1 >= n_) {                                             \
+          uint64_t ngram = mix64(hash_[n_] ^ (CHAR_NGRAM_SEED * n_));   \
+          body                                                          \
+        }                                                               \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+/*
+ * Computes the linear score of a message. TF-IDF is linear in the term
+ * counts, so every occurrence adds idf * weight directly and the sums are
+ * divided by the number of terms at the end, without a per-message term table.
+ *
+ * The message is lowercased on the fly while it is tokenized as by
+ * extract_token_words() and extract_char_ngrams(), into fixed stack scratch.
+ * Nothing is allocated, so this can be called on a loaded model from any
+ * number of threads.
+ *
+ * Stop words are never added to the vocabulary, so instead of scanning the
+ * stop word list only the length rule of accept_string() is applied and a
+ * stop word is dropped as out of vocabulary by the lookup, with the same
+ * score.
+ *
+ * The number of tokens looked up and of those out of vocabulary are added to
+ * *counts.
+ */
+float classify_score_counted(const model *m, const char *msg, size_t len, token_counts *counts) {
+  float z = 0.0f;
+
+  size_t tokens = 0, total = 0;
+  float sum = 0.0f;
+  uint64_t previous = 0;
+  char buf[BUFFER_SIZE];
+  size_t j;
+  for_each_token(msg, len, buf, j, {
+      tokens++;
+      ptrdiff_t index = lookup_token(m, buf, j);
+      if (index != -1) {
+        size_t feature = index;
+        sum += m->idf[feature] * m->weights[feature];
+        if (m->flags & FEATURE_BIGRAMS) {
+          uint64_t current = hash_bytes(buf, j, 0);
+          if (total > 0) {
+            feature = m->vocabulary_size + bigram_bucket(m, previous, current);
+            sum += m->idf[feature] * m->weights[feature];
+          }
+          previous = current;
+        }
+        total++;
+      }
+    });
+  if (total > 0) {
+    z += sum / (float)total;
+  }
+  counts->tokens += tokens;
+  counts->unknown += tokens - total;
+
+  if (m->flags & FEATURE_CHAR_NGRAMS) {
+    size_t char_total = 0;
+    float char_sum = 0.0f;
+    const float *idf = m->idf + m->vocabulary_size;
+    const float *weights = m->weights + m->vocabulary_size;
+    for_each_char_ngram(msg, len, ngram, {
+        size_t bucket = ngram >> (64 - m->hash_bits);
+        char_sum += idf[bucket] * weights[bucket];
+        char_total++;
+      });
+    if (char_total > 0) {
+      z += char_sum / (float)char_total;
+    }
+  }
+
+  return z + m->bias;
+}
+
+float classify_score(const model *m, const char *msg, size_t len) {
+  token_counts counts = {0};
+  return classify_score_counted(m, msg, len, &counts);
+}
+
+/*
+ * Spam probability of a message. See classify_score().
+ */
+float classify(const model *m, const char *msg, size_t len) {
+  return sigmoid(classify_score(m, msg, len));
+}
+
+// ---------- Model registry ----------
+
+/*
+ * Sets the weights of a tenant from dense, which holds a weight for each of
+ * span shared token IDs and NAN for those the model does not have.
+ */
+spamclf_status tenant_pack(tenant_model *t, const float *dense, size_t span) {
+  size_t words = (span + 63) / 64;
+  uint64_t *present = SPAM_CALLOC(words + 1, sizeof(uint64_t));
+  uint32_t *ranks = SPAM_MALLOC((words + 1) * sizeof(uint32_t));
+  float *weights = SPAM_MALLOC(t->vocabulary_size * sizeof(float) + 1);
+  if (present == NULL || ranks == NULL || weights == NULL) {
+    SPAM_FREE(present);
+    SPAM_FREE(ranks);
+    SPAM_FREE(weights);
+    return SPAMCLF_ERROR_MEMORY;
+  }
+  size_t count = 0;
+  for (size_t w = 0; w < words; ++w) {
+    ranks[w] = count;
+    for (size_t i = w * 64; i < span && i < (w + 1) * 64; ++i) {
+      if (isnan(dense[i])) continue;
+      present[w] |= 1ULL << (i % 64);
+      weights[count++] = dense[i];
+    }
+  }
+  SPAM_FREE(t->present);
+  SPAM_FREE(t->ranks);
+  SPAM_FREE(t->weights);
+  t->present = present;
+  t->ranks = ranks;
+  t->weights = weights;
+  t->span = span;
+  return SPAMCLF_OK;
+}
+
+/*
+ * Position in t->weights of the weight of shared token id, or -1 if the
+ * model does not have it.
+ */
+ptrdiff_t tenant_rank(const tenant_model *t, uint32_t id) {
+  if (id >= t->span) return -1;
+  uint64_t word = t->present[id / 64];
+  uint64_t below = word & ((1ULL << (id % 64)) - 1);
+  if (!(word >> (id % 64) & 1)) return -1;
+  return t->ranks[id / 64] + __builtin_popcountll(below);
+}
+
+/*
+ * Adds a copy of the weights of m, interning its tokens, and sets *id to
+ * the index of the model in the registry. m can be freed afterwards. The
+ * registry has to be indexed again before scoring.
+ */
+spamclf_status registry_add(model_registry *r, const model *m, size_t *id) {
+  spamclf_status status = SPAMCLF_OK;
+  // The interned tokens are dropped by registry_index(), as token IDs change.
+  if (r->interned.slots == NULL) {
+    for (size_t i = 0; i < arrlenu(r->offsets) && status == SPAMCLF_OK; ++i) {
+      size_t len;
+      const char *token = pool_token(r->pool, r->offsets[i], &len);
+      status = token_table_insert(&r->interned, r->pool, r->offsets, token, len, i);
+    }
+  }
+  uint32_t *ids = SPAM_MALLOC(m->vocabulary_size * sizeof(uint32_t) + 1);
+  if (ids == NULL) return SPAMCLF_ERROR_MEMORY;
+  for (size_t i = 0; i < m->vocabulary_size && status == SPAMCLF_OK; ++i) {
+    size_t len;
+    const char *token = vocabulary_token(m, i, &len);
+    ptrdiff_t found = token_table_find(&r->interned, r->pool, r->offsets, token, len);
+    if (found == -1) {
+      found = arrlenu(r->offsets);
+      arrput(r->offsets, pool_append(&r->pool, token, len));
+      status = token_table_insert(&r->interned, r->pool, r->offsets, token, len, found);
+    }
+    ids[i] = found;
+  }
+
+  size_t span = arrlenu(r->offsets);
+  size_t hashed = hashed_buckets(m);
+  tenant_model t = {
+    .flags = m->flags, .hash_bits = m->hash_bits, .bias = m->bias,
+    .vocabulary_size = m->vocabulary_size,
+  };
+  float *dense = SPAM_MALLOC(span * sizeof(float) + 1);
+  t.hashed = SPAM_MALLOC(hashed * sizeof(float) + 1);
+  if (status == SPAMCLF_OK && (dense == NULL || t.hashed == NULL)) {
+    status = SPAMCLF_ERROR_MEMORY;
+  }
+  if (status == SPAMCLF_OK) {
+    for (size_t i = 0; i < span; ++i) dense[i] = NAN;
+    for (size_t i = 0; i < m->vocabulary_size; ++i) {
+      dense[ids[i]] = m->idf[i] * m->weights[i];
+    }
+    status = tenant_pack(&t, dense, span);
+  }
+  SPAM_FREE(dense);
+  SPAM_FREE(ids);
+  if (status != SPAMCLF_OK) {
+    SPAM_FREE(t.hashed);
+    return status;
+  }
+  for (size_t i = 0; i < hashed; ++i) {
+    t.hashed[i] = m->idf[m->vocabulary_size + i] * m->weights[m->vocabulary_size + i];
+  }
+
+  arrput(r->models, t);
+  r->flags |= m->flags;
+  r->indexed = false;
+  *id = arrlenu(r->models) - 1;
+  return SPAMCLF_OK;
+}
+
+/*
+ * registry_add() of the model saved at path.
+ */
+spamclf_status registry_load(model_registry *r, const char *path, size_t *id) {
+  model m;
+  spamclf_status status = read_model(&m, path);
+  if (status != SPAMCLF_OK) return status;
+  status = registry_add(r, &m, id);
+  free_model(&m);
+  return status;
+}
+
+/*
+ * Builds the shared index and Bloom filter, reordering the shared tokens and
+ * the weights of every model by slot.
+ */
+spamclf_status registry_index(model_registry *r) {
+  size_t n = arrlenu(r->offsets);
+  free_mphf(&r->index);
+  free_bloom(&r->bloom);
+  free_token_table(&r->interned);
+  spamclf_status status = index_tokens(&r->index, r->pool, r->offsets, n);
+  if (status != SPAMCLF_OK) return status;
+
+  uint32_t *slots = SPAM_MALLOC(n * sizeof(uint32_t) + 1);
+  uint32_t *order = SPAM_MALLOC(n * sizeof(uint32_t) + 1);
+  float *dense = SPAM_MALLOC(n * sizeof(float) + 1);
+  if (slots == NULL || order == NULL || dense == NULL) {
+    status = SPAMCLF_ERROR_MEMORY;
+    goto done;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    size_t len;
+    const char *token = pool_token(r->pool, r->offsets[i], &len);
+    slots[i] = mphf_slot(&r->index, token, len);
+    order[slots[i]] = i;
+  }
+  for (size_t i = 0; i < arrlenu(r->models); ++i) {
+    tenant_model *t = &r->models[i];
+    for (size_t k = 0; k < n; ++k) dense[k] = NAN;
+    for (size_t k = 0; k < t->span; ++k) {
+      ptrdiff_t rank = tenant_rank(t, k);
+      if (rank != -1) dense[slots[k]] = t->weights[rank];
+    }
+    status = tenant_pack(t, dense, n);
+    if (status != SPAMCLF_OK) goto done;
+  }
+  char *pool = NULL;
+  for (size_t slot = 0; slot < n; ++slot) {
+    size_t len;
+    const char *token = pool_token(r->pool, r->offsets[order[slot]], &len);
+    order[slot] = pool_append(&pool, token, len);
+  }
+  memcpy(r->offsets, order, n * sizeof(uint32_t));
+  arrfree(r->pool);
+  r->pool = pool;
+  status = build_token_bloom(&r->bloom, r->pool, r->offsets, n, r->index.seed);
+  r->indexed = status == SPAMCLF_OK;
+
+done:
+  SPAM_FREE(slots);
+  SPAM_FREE(order);
+  SPAM_FREE(dense);
+  return status;
+}
+
+void free_registry(model_registry *r) {
+  for (size_t i = 0; i < arrlenu(r->models); ++i) {
+    SPAM_FREE(r->models[i].present);
+    SPAM_FREE(r->models[i].ranks);
+    SPAM_FREE(r->models[i].weights);
+    SPAM_FREE(r->models[i].hashed);
+  }
+  arrfree(r->models);
+  arrfree(r->pool);
+  arrfree(r->offsets);
+  free_token_table(&r->interned);
+  free_mphf(&r->index);
+  free_bloom(&r->bloom);
+  memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Bytes held by the registry: the shared tokens with their index and filter,
+ * and the weights of every model.
+ */
+size_t registry_memory(const model_registry *r) {
+  size_t bytes = arrlenu(r->pool) + arrlenu(r->offsets) * sizeof(uint32_t) +
+    r->index.buckets * sizeof(uint32_t) + (size_t)r->bloom.blocks * BLOOM_BLOCK_WORDS * 8 +
+    (r->interned.slots != NULL ? (r->interned.mask + 1) * sizeof(token_slot) : 0);
+  for (size_t i = 0; i < arrlenu(r->models); ++i) {
+    const tenant_model *t = &r->models[i];
+    bytes += sizeof(*t) + (t->span + 63) / 64 * (sizeof(uint64_t) + sizeof(uint32_t)) +
+      t->vocabulary_size * sizeof(float);
+    if (t->flags & HASHED_FEATURES) bytes += ((size_t)1 << t->hash_bits) * sizeof(float);
+  }
+  return bytes;
+}
+
+/*
+ * Splits a message and looks its tokens up in the shared vocabulary, keeping
+ * what any of the models needs to score it.
+ */
+void registry_tokenize(const model_registry *r, const char *msg, size_t len, registry_message *t) {
+  arrsetlen(t->ids, 0);
+  arrsetlen(t->hashes, 0);
+  arrsetlen(t->char_ngrams, 0);
+  t->tokens = 0;
+  size_t n = arrlenu(r->offsets);
+  char buf[BUFFER_SIZE];
+  size_t j;
+  for_each_token(msg, len, buf, j, {
+      t->tokens++;
+      ptrdiff_t id = n > 0 ? find_indexed_token(&r->index, &r->bloom, r->pool, r->offsets, buf, j) : -1;
+      if (id != -1) {
+        arrput(t->ids, id);
+        if (r->flags & FEATURE_BIGRAMS) arrput(t->hashes, hash_bytes(buf, j, 0));
+      }
+    });
+  if (r->flags & FEATURE_CHAR_NGRAMS) {
+    for_each_char_ngram(msg, len, ngram, {
+        arrput(t->char_ngrams, ngram);
+      });
+  }
+}
+
+/*
+ * Linear score of a tokenized message by model id of an indexed registry,
+ * summed in the same order as classify_score() so that the two agree
+ * exactly.
+ */
+float registry_score(const model_registry *r, size_t id, const registry_message *t) {
+  const tenant_model *m = &r->models[id];
+  float z = 0.0f;
+  size_t total = 0;
+  float sum = 0.0f;
+  uint64_t previous = 0;
+  for (size_t i = 0; i < arrlenu(t->ids); ++i) {
+    ptrdiff_t rank = tenant_rank(m, t->ids[i]);
+    if (rank == -1) continue;
+    sum += m->weights[rank];
+    if (m->flags & FEATURE_BIGRAMS) {
+      uint64_t current = t->hashes[i];
+      if (total > 0) sum += m->hashed[bigram_hash(previous, current) >> (64 - m->hash_bits)];
+      previous = current;
+    }
+    total++;
+  }
+  if (total > 0) {
+    z += sum / (float)total;
+  }
+  if ((m->flags & FEATURE_CHAR_NGRAMS) && arrlenu(t->char_ngrams) > 0) {
+    float char_sum = 0.0f;
+    for (size_t i = 0; i < arrlenu(t->char_ngrams); ++i) {
+      char_sum += m->hashed[t->char_ngrams[i] >> (64 - m->hash_bits)];
+    }
+    z += char_sum / (float)arrlenu(t->char_ngrams);
+  }
+  return z + m->bias;
+}
+
+void free_registry_message(registry_message *t) {
+  arrfree(t->ids);
+  arrfree(t->hashes);
+  arrfree(t->char_ngrams);
+}
+
+// ---------- Metrics ----------
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * Claims a shard for the calling thread, or returns NULL if all
+ * STATS_SHARDS are taken. A shard keeps its counts once released, and the
+ * next thread to claim it adds to them.
+ */
+stats_shard *stats_register(classify_stats *s) {
+  for (size_t i = 0; i < STATS_SHARDS; ++i) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&s->shards[i].used, &expected, true)) return &s->shards[i];
+  }
+  return NULL;
+}
+
+void stats_unregister(stats_shard *shard) {
+  if (shard != NULL) atomic_store(&shard->used, false);
+}
+
+size_t histogram_bucket(uint64_t value) {
+  if (value < (1u << STATS_SUB_BITS)) return value;
+  size_t exponent = 63 - __builtin_clzll(value);
+  size_t sub = (value >> (exponent - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1);
+  return ((exponent - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+/*
+ * Midpoint of the values falling into a bucket.
+ */
+uint64_t histogram_value(size_t bucket) {
+  if (bucket < (1u << STATS_SUB_BITS)) return bucket;
+  size_t exponent = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+  uint64_t sub = bucket & ((1u << STATS_SUB_BITS) - 1);
+  uint64_t width = 1ull << (exponent - STATS_SUB_BITS);
+  return ((1ull << exponent) | (sub << (exponent - STATS_SUB_BITS))) + width / 2;
+}
+
+/*
+ * Adds one message to the shard. Only the owning thread writes a shard, so
+ * the counters are bumped with relaxed loads and stores instead of atomic
+ * read-modify-write instructions.
+ */
+#define stats_add(counter, n)                                          \
+  atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+                        memory_order_relaxed)
+
+void stats_record(stats_shard *shard, uint64_t latency_ns, const token_counts *counts, bool spam) {
+  stats_add(shard->messages, 1);
+  stats_add(shard->spam, spam);
+  stats_add(shard->tokens, counts->tokens);
+  stats_add(shard->unknown_tokens, counts->unknown);
+  stats_add(shard->latency_ns, latency_ns);
+  stats_add(shard->latency[histogram_bucket(latency_ns)], 1);
+}
+
+/*
+ * Sums the shards. Counts recorded meanwhile may or may not be included.
+ */
+void stats_merge(const classify_stats *s, stats_snapshot *out) {
+  memset(out, 0, sizeof(*out));
+  for (size_t i = 0; i < STATS_SHARDS; ++i) {
+    const stats_shard *shard = &s->shards[i];
+    out->messages += atomic_load_explicit(&shard->messages, memory_order_relaxed);
+    out->spam += atomic_load_explicit(&shard->spam, memory_order_relaxed);
+    out->tokens += atomic_load_explicit(&shard->tokens, memory_order_relaxed);
+    out->unknown_tokens += atomic_load_explicit(&shard->unknown_tokens, memory_order_relaxed);
+    out->latency_ns += atomic_load_explicit(&shard->latency_ns, memory_order_relaxed);
+    for (size_t b = 0; b < STATS_BUCKETS; ++b) {
+      out->latency[b] += atomic_load_explicit(&shard->latency[b], memory_order_relaxed);
+    }
+  }
+}
+
+/*
+ * Latency in nanoseconds below which the fraction q of messages fall.
+ */
+uint64_t stats_quantile(const stats_snapshot *snapshot, double q) {
+  uint64_t total = 0;
+  for (size_t b = 0; b < STATS_BUCKETS; ++b) total += snapshot->latency[b];
+  if (total == 0) return 0;
+  uint64_t rank = (uint64_t)ceil(q * total);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < STATS_BUCKETS; ++b) {
+    seen += snapshot->latency[b];
+    if (seen >= rank) return histogram_value(b);
+  }
+  return histogram_value(STATS_BUCKETS - 1);
+}
+
+/*
+ * Writes the metrics in the Prometheus text exposition format. Throughput is
+ * the rate() of spamclf_messages_total.
+ */
+void write_stats(const stats_snapshot *snapshot, FILE *out) {
+  const struct { const char *name, *help; uint64_t value; } counters[] = {
+    { "spamclf_messages_total", "Messages classified.", snapshot->messages },
+    { "spamclf_spam_total", "Messages classified as spam.", snapshot->spam },
+    { "spamclf_tokens_total", "Tokens looked up in the vocabulary.", snapshot->tokens },
+    { "spamclf_unknown_tokens_total", "Tokens not in the vocabulary.", snapshot->unknown_tokens },
+  };
+  for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counters[i].name, counters[i].help,
+            counters[i].name, counters[i].name, (unsigned long long)counters[i].value);
+  }
+  fprintf(out, "# HELP spamclf_spam_ratio Fraction of messages classified as spam.\n"
+          "# TYPE spamclf_spam_ratio gauge\nspamclf_spam_ratio %g\n",
+          snapshot->messages > 0 ? (double)snapshot->spam / snapshot->messages : 0.0);
+  fprintf(out, "# HELP spamclf_unknown_token_ratio Fraction of tokens not in the vocabulary.\n"
+          "# TYPE spamclf_unknown_token_ratio gauge\nspamclf_unknown_token_ratio %g\n",
+          snapshot->tokens > 0 ? (double)snapshot->unknown_tokens / snapshot->tokens : 0.0);
+
+  const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  fprintf(out, "# HELP spamclf_classify_latency_seconds Time to classify a message.\n"
+          "# TYPE spamclf_classify_latency_seconds summary\n");
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+    fprintf(out, "spamclf_classify_latency_seconds{quantile=\"%g\"} %.9f\n", quantiles[i],
+            stats_quantile(snapshot, quantiles[i]) / 1e9);
+  }
+  fprintf(out, "spamclf_classify_latency_seconds_sum %.9f\n", snapshot->latency_ns / 1e9);
+  fprintf(out, "spamclf_classify_latency_seconds_count %llu\n", (unsigned long long)snapshot->messages);
+}
+
+// ---------- Result cache ----------
+
+#define CACHE_NONE UINT32_MAX
+
+/*
+ * Lowercases the ASCII letters of 8 bytes at once, as tolower() does in the
+ * C locale: bytes in 'A'..'Z' get 0x20 added.
+ */
+uint64_t lower_word(uint64_t w) {
+  uint64_t low = w & 0x7f7f7f7f7f7f7f7fULL;
+  uint64_t above_z = low + 0x2525252525252525ULL;   // High bit set if > 'Z'.
+  uint64_t from_a = low + 0x3f3f3f3f3f3f3f3fULL;    // High bit set if >= 'A'.
+  uint64_t upper = ~w & (from_a ^ above_z) & 0x8080808080808080ULL;
+  return w | (upper >> 2);
+}
+
+/*
+ * 128-bit key of a message: two independently seeded hashes of its lowercase
+ * text, read 8 bytes at a time, with the model generation mixed in so that a
+ * cache outlives a model swap without returning stale scores.
+ */
+void cache_key(const result_cache *c, const char *msg, size_t len, uint64_t generation,
+               uint64_t key[2]) {
+  uint64_t a = c->seed ^ len, b = mix64(c->seed + len) ^ generation;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, msg + i, 8);
+    w = lower_word(w);
+    a = (a ^ w) * 0x9e3779b97f4a7c15ULL;
+    a ^= a >> 32;
+    b = (b ^ w) * 0xc2b2ae3d27d4eb4fULL;
+    b ^= b >> 29;
+  }
+  if (i < len) {
+    uint64_t w = 0;
+    memcpy(&w, msg + i, len - i);
+    w = lower_word(w);
+    a = (a ^ w) * 0x9e3779b97f4a7c15ULL;
+    b = (b ^ w) * 0xc2b2ae3d27d4eb4fULL;
+  }
+  key[0] = mix64(a ^ generation);
+  key[1] = mix64(b);
+}
+
+/*
+ * Cache of up to capacity scores, split evenly over CACHE_SHARDS shards.
+ */
+spamclf_status result_cache_init(result_cache *c, size_t capacity) {
+  memset(c, 0, sizeof(*c));
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  c->seed = mix64(((uint64_t)ts.tv_sec << 30) ^ ts.tv_nsec ^ (uintptr_t)c);
+  size_t per_shard = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+  if (per_shard == 0 || per_shard >= CACHE_NONE) return SPAMCLF_ERROR_ARGUMENT;
+  size_t buckets = 1;
+  while (buckets < per_shard) buckets *= 2;
+
+  for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+    cache_shard *s = &c->shards[i];
+    pthread_mutex_init(&s->lock, NULL);
+    // Set first, so that result_cache_free() releases a partly built shard.
+    s->capacity = per_shard;
+    s->entries = SPAM_MALLOC(per_shard * sizeof(cache_entry));
+    s->buckets = SPAM_MALLOC(buckets * sizeof(uint32_t));
+    if (s->entries == NULL || s->buckets == NULL) {
+      result_cache_free(c);
+      return SPAMCLF_ERROR_MEMORY;
+    }
+    memset(s->buckets, 0xff, buckets * sizeof(uint32_t));
+    s->mask = buckets - 1;
+    s->head = s->tail = CACHE_NONE;
+  }
+  return SPAMCLF_OK;
+}
+
+void result_cache_free(result_cache *c) {
+  for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+    cache_shard *s = &c->shards[i];
+    if (s->capacity == 0) continue;
+    SPAM_FREE(s->entries);
+    SPAM_FREE(s->buckets);
+    pthread_mutex_destroy(&s->lock);
+    s->capacity = 0;
+  }
+}
+
+cache_shard *cache_shard_of(result_cache *c, const uint64_t key[2]) {
+  return &c->shards[key[1] % CACHE_SHARDS];
+}
+
+void cache_unlink(cache_shard *s, uint32_t i) {
+  cache_entry *e = &s->entries[i];
+  if (e->prev != CACHE_NONE) s->entries[e->prev].next = e->next; else s->head = e->next;
+  if (e->next != CACHE_NONE) s->entries[e->next].prev = e->prev; else s->tail = e->prev;
+}
+
+void cache_push_front(cache_shard *s, uint32_t i) {
+  cache_entry *e = &s->entries[i];
+  e->prev = CACHE_NONE;
+  e->next = s->head;
+  if (s->head != CACHE_NONE) s->entries[s->head].prev = i; else s->tail = i;
+  s->head = i;
+}
+
+uint32_t cache_find(const cache_shard *s, const uint64_t key[2]) {
+  uint32_t i = s->buckets[key[0] & s->mask];
+  while (i != CACHE_NONE && (s->entries[i].key[0] != key[0] || s->entries[i].key[1] != key[1])) {
+    i = s->entries[i].chain;
+  }
+  return i;
+}
+
+/*
+ * Looks up the score cached for key, marking it most recently used.
+ */
+bool result_cache_get(result_cache *c, const uint64_t key[2], float *score) {
+  cache_shard *s = cache_shard_of(c, key);
+  pthread_mutex_lock(&s->lock);
+  uint32_t i = cache_find(s, key);
+  if (i != CACHE_NONE) {
+    *score = s->entries[i].score;
+    if (s->head != i) {
+      cache_unlink(s, i);
+      cache_push_front(s, i);
+    }
+    s->hits++;
+  } else {
+    s->misses++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return i != CACHE_NONE;
+}
+
+/*
+ * Caches the score of key, evicting the least recently used score of its
+ * shard when full.
+ */
+void result_cache_put(result_cache *c, const uint64_t key[2], float score) {
+  cache_shard *s = cache_shard_of(c, key);
+  pthread_mutex_lock(&s->lock);
+  uint32_t i = cache_find(s, key);
+  if (i == CACHE_NONE) {
+    if (s->count < s->capacity) {
+      i = s->count++;
+    } else {
+      i = s->tail;
+      uint32_t *link = &s->buckets[s->entries[i].key[0] & s->mask];
+      while (*link != i) link = &s->entries[*link].chain;
+      *link = s->entries[i].chain;
+      cache_unlink(s, i);
+    }
+    cache_entry *e = &s->entries[i];
+    e->key[0] = key[0];
+    e->key[1] = key[1];
+    e->chain = s->buckets[key[0] & s->mask];
+    s->buckets[key[0] & s->mask] = i;
+    cache_push_front(s, i);
+  }
+  s->entries[i].score = score;
+  pthread_mutex_unlock(&s->lock);
+}
+
+void result_cache_counts(result_cache *c, uint64_t *hits, uint64_t *misses) {
+  *hits = *misses = 0;
+  for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+    cache_shard *s = &c->shards[i];
+    if (s->capacity == 0) continue;
+    pthread_mutex_lock(&s->lock);
+    *hits += s->hits;
+    *misses += s->misses;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+/*
+ * Writes the hit and miss counters in the Prometheus text format.
+ */
+void write_cache_stats(result_cache *c, FILE *out) {
+  uint64_t hits, misses;
+  result_cache_counts(c, &hits, &misses);
+  fprintf(out, "# HELP spamclf_cache_hits_total Messages answered from the result cache.\n"
+          "# TYPE spamclf_cache_hits_total counter\nspamclf_cache_hits_total %llu\n",
+          (unsigned long long)hits);
+  fprintf(out, "# HELP spamclf_cache_misses_total Messages not found in the result cache.\n"
+          "# TYPE spamclf_cache_misses_total counter\nspamclf_cache_misses_total %llu\n",
+          (unsigned long long)misses);
+}
+
+// ---------- Near-duplicates ----------
+
+#define SIMHASH_LANES 0x0101010101010101ULL
+
+/*
+ * 64-bit SimHash of a message: bit b is set when more than half of its
+ * tokens (as split by classify_score()) hash to a value with bit b set, so
+ * messages sharing most of their tokens get hashes a few bits apart. Every
+ * token counts, whether in the vocabulary or not, so no vocabulary probe is
+ * needed. Votes are kept 8 bits per bit position in 8 words and flushed
+ * every 255 tokens. Sets *tokens to the number of tokens.
+ */
+uint64_t message_simhash(const char *msg, size_t len, size_t *tokens) {
+  uint32_t votes[64] = {0};
+  uint64_t lanes[8] = {0};
+  size_t count = 0, pending = 0;
+  char buf[BUFFER_SIZE];
+  size_t j;
+  for_each_token(msg, len, buf, j, {
+      uint64_t h = hash_bytes(buf, j, SIMHASH_SEED);
+      for (size_t k = 0; k < 8; ++k) lanes[k] += (h >> k) & SIMHASH_LANES;
+      count++;
+      if (++pending == 255) {
+        for (size_t b = 0; b < 64; ++b) votes[b] += (lanes[b % 8] >> (b / 8 * 8)) & 0xff;
+        memset(lanes, 0, sizeof(lanes));
+        pending = 0;
+      }
+    });
+  uint64_t simhash = 0;
+  for (size_t b = 0; b < 64; ++b) {
+    uint32_t ones = votes[b] + ((lanes[b % 8] >> (b / 8 * 8)) & 0xff);
+    if (2 * ones > count) simhash |= 1ULL << b;
+  }
+  *tokens = count;
+  return simhash;
+}
+
+/*
+ * Index of up to about capacity recent scores, reused for hashes within
+ * max_distance bits, at most 2 * NEAR_DUP_BANDS - 1.
+ */
+spamclf_status near_dup_init(near_dup_index *n, size_t capacity, unsigned max_distance) {
+  memset(n, 0, sizeof(*n));
+  if (capacity == 0 || max_distance >= 2 * NEAR_DUP_BANDS) return SPAMCLF_ERROR_ARGUMENT;
+  n->max_distance = max_distance;
+  uint32_t bits = 1;
+  while (bits < 16 && ((size_t)NEAR_DUP_WAYS << bits) < capacity) bits++;
+  for (size_t i = 0; i < NEAR_DUP_BANDS; ++i) {
+    near_dup_band *b = &n->bands[i];
+    b->slots = SPAM_MALLOC(((size_t)NEAR_DUP_WAYS << bits) * sizeof(near_dup_slot));
+    if (b->slots == NULL) {
+      near_dup_free(n);
+      return SPAMCLF_ERROR_MEMORY;
+    }
+    for (size_t k = 0; k < (size_t)NEAR_DUP_WAYS << bits; ++k) {
+      b->slots[k] = (near_dup_slot){ .score = NAN };
+    }
+    b->bits = bits;
+    pthread_mutex_init(&b->lock, NULL);
+  }
+  return SPAMCLF_OK;
+}
+
+void near_dup_free(near_dup_index *n) {
+  for (size_t i = 0; i < NEAR_DUP_BANDS; ++i) {
+    near_dup_band *b = &n->bands[i];
+    if (b->slots == NULL) continue;
+    SPAM_FREE(b->slots);
+    pthread_mutex_destroy(&b->lock);
+    b->slots = NULL;
+  }
+}
+
+near_dup_slot *near_dup_bucket(const near_dup_band *b, uint32_t value) {
+  return &b->slots[(size_t)((value * 0x9e3779b1u) >> (32 - b->bits)) * NEAR_DUP_WAYS];
+}
+
+bool near_dup_match(const near_dup_slot *bucket, uint64_t simhash, uint32_t generation,
+                    unsigned max_distance, float *score) {
+  for (size_t w = 0; w < NEAR_DUP_WAYS; ++w) {
+    const near_dup_slot *s = &bucket[w];
+    if (!isnan(s->score) && s->generation == generation &&
+        (unsigned)__builtin_popcountll(s->simhash ^ simhash) <= max_distance) {
+      *score = s->score;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Looks up a score stored for a hash within max_distance bits of simhash
+ * under the same model generation. Each band is probed under its own lock,
+ * with its one-bit neighbours only when max_distance needs them.
+ */
+bool near_dup_get(near_dup_index *n, uint64_t simhash, uint64_t generation, float *score) {
+  bool found = false;
+  for (size_t i = 0; i < NEAR_DUP_BANDS && !found; ++i) {
+    near_dup_band *b = &n->bands[i];
+    uint32_t value = (simhash >> (16 * i)) & 0xffff;
+    pthread_mutex_lock(&b->lock);
+    found = near_dup_match(near_dup_bucket(b, value), simhash, generation, n->max_distance, score);
+    for (size_t bit = 0; bit < 16 && !found && n->max_distance >= NEAR_DUP_BANDS; ++bit) {
+      found = near_dup_match(near_dup_bucket(b, value ^ (1u << bit)), simhash, generation,
+                             n->max_distance, score);
+    }
+    if (found) b->hits++;
+    else if (i == NEAR_DUP_BANDS - 1) b->misses++;
+    pthread_mutex_unlock(&b->lock);
+  }
+  return found;
+}
+
+/*
+ * Stores a score under every band of simhash, dropping the oldest score of
+ * each bucket.
+ */
+void near_dup_put(near_dup_index *n, uint64_t simhash, uint64_t generation, float score) {
+  for (size_t i = 0; i < NEAR_DUP_BANDS; ++i) {
+    near_dup_band *b = &n->bands[i];
+    pthread_mutex_lock(&b->lock);
+    near_dup_slot *bucket = near_dup_bucket(b, (simhash >> (16 * i)) & 0xffff);
+    memmove(bucket + 1, bucket, (NEAR_DUP_WAYS - 1) * sizeof(near_dup_slot));
+    bucket[0] = (near_dup_slot){ simhash, (uint32_t)generation, score };
+    pthread_mutex_unlock(&b->lock);
+  }
+}
+
+void near_dup_counts(near_dup_index *n, uint64_t *hits, uint64_t *misses) {
+  *hits = *misses = 0;
+  for (size_t i = 0; i < NEAR_DUP_BANDS; ++i) {
+    near_dup_band *b = &n->bands[i];
+    if (b->slots == NULL) continue;
+    pthread_mutex_lock(&b->lock);
+    *hits += b->hits;
+    *misses += b->misses;
+    pthread_mutex_unlock(&b->lock);
+  }
+}
+
+/*
+ * Writes the hit and miss counters in the Prometheus text format.
+ */
+void write_near_dup_stats(near_dup_index *n, FILE *out) {
+  uint64_t hits, misses;
+  near_dup_counts(n, &hits, &misses);
+  fprintf(out, "# HELP spamclf_near_duplicate_hits_total Messages given the score of a near-duplicate.\n"
+          "# TYPE spamclf_near_duplicate_hits_total counter\nspamclf_near_duplicate_hits_total %llu\n",
+          (unsigned long long)hits);
+  fprintf(out, "# HELP spamclf_near_duplicate_misses_total Messages without a near-duplicate.\n"
+          "# TYPE spamclf_near_duplicate_misses_total counter\nspamclf_near_duplicate_misses_total %llu\n",
+          (unsigned long long)misses);
+}
+
+/*
+ * classify_score_counted() through the shortcuts in s: the exact result
+ * cache, then the near-duplicate index for messages of at least
+ * NEAR_DUP_MIN_TOKENS tokens. A score found either way adds nothing to
+ * *counts. A computed score is stored in both.
+ */
+float shortcut_score(const score_shortcuts *s, uint64_t generation, const model *m,
+                     const char *msg, size_t len, token_counts *counts) {
+  uint64_t key[2];
+  float score;
+  if (s->cache != NULL) {
+    cache_key(s->cache, msg, len, generation, key);
+    if (result_cache_get(s->cache, key, &score)) return score;
+  }
+  uint64_t simhash = 0;
+  size_t tokens = 0;
+  if (s->near != NULL) {
+    simhash = message_simhash(msg, len, &tokens);
+    if (tokens >= NEAR_DUP_MIN_TOKENS && near_dup_get(s->near, simhash, generation, &score)) {
+      if (s->cache != NULL) result_cache_put(s->cache, key, score);
+      return score;
+    }
+  }
+  score = classify_score_counted(m, msg, len, counts);
+  if (s->cache != NULL) result_cache_put(s->cache, key, score);
+  if (s->near != NULL && tokens >= NEAR_DUP_MIN_TOKENS) {
+    near_dup_put(s->near, simhash, generation, score);
+  }
+  return score;
+}
+
+// ---------- Model reload ----------
+
+/*
+ * Takes ownership of m, a model allocated with SPAM_MALLOC, as the first
+ * published model.
+ */
+void live_model_init(live_model *l, model *m) {
+  atomic_init(&l->current, m);
+  atomic_init(&l->epoch, 1);
+  for (size_t i = 0; i < LIVE_READERS; ++i) {
+    atomic_init(&l->readers[i].epoch, 0);
+    atomic_init(&l->readers[i].used, false);
+  }
+  pthread_mutex_init(&l->publish, NULL);
+}
+
+/*
+ * Frees the published model. No reader may be left.
+ */
+void live_model_free(live_model *l) {
+  model *m = atomic_load(&l->current);
+  free_model(m);
+  SPAM_FREE(m);
+  pthread_mutex_destroy(&l->publish);
+}
+
+/*
+ * Claims a reader record for the calling thread. Returns its index, or -1 if
+ * all LIVE_READERS are taken.
+ */
+ptrdiff_t live_reader_register(live_model *l) {
+  for (size_t i = 0; i < LIVE_READERS; ++i) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&l->readers[i].used, &expected, true)) return i;
+  }
+  return -1;
+}
+
+void live_reader_unregister(live_model *l, size_t reader) {
+  atomic_store(&l->readers[reader].used, false);
+}
+
+/*
+ * Returns the current model, which stays valid until live_model_exit(). The
+ * reader announces the epoch it entered before loading the pointer, so a
+ * publisher that swapped the pointer afterwards waits for it.
+ */
+const model *live_model_enter(live_model *l, size_t reader) {
+  atomic_store(&l->readers[reader].epoch, atomic_load(&l->epoch));
+  return atomic_load(&l->current);
+}
+
+void live_model_exit(live_model *l, size_t reader) {
+  atomic_store_explicit(&l->readers[reader].epoch, 0, memory_order_release);
+}
+
+/*
+ * Publishes m, a model allocated with SPAM_MALLOC, in place of the current
+ * one. Readers are never blocked: the old model is freed once every reader
+ * that might still hold it has left, which takes as long as a classification.
+ */
+void live_model_publish(live_model *l, model *m) {
+  pthread_mutex_lock(&l->publish);
+  model *old = atomic_exchange(&l->current, m);
+  uint64_t epoch = atomic_fetch_add(&l->epoch, 1) + 1;
+  for (size_t i = 0; i < LIVE_READERS; ++i) {
+    for (;;) {
+      uint64_t entered = atomic_load(&l->readers[i].epoch);
+      if (entered == 0 || entered >= epoch) break;
+      sched_yield();
+    }
+  }
+  pthread_mutex_unlock(&l->publish);
+  free_model(old);
+  SPAM_FREE(old);
+}
+
+/*
+ * Loads and checks the model at path for publishing. Besides the checks of
+ * read_model(), every weight and IDF has to be finite.
+ */
+spamclf_status load_live_model(const char *path, model **out) {
+  model *m = SPAM_MALLOC(sizeof(model));
+  if (m == NULL) return SPAMCLF_ERROR_MEMORY;
+  spamclf_status status = read_model(m, path);
+  if (status == SPAMCLF_OK) {
+    bool finite = isfinite(m->bias);
+    for (size_t i = 0; finite && i < feature_count(m); ++i) {
+      finite = isfinite(m->weights[i]) && isfinite(m->idf[i]);
+    }
+    if (!finite) {
+      free_model(m);
+      status = SPAMCLF_ERROR_FORMAT;
+    }
+  }
+  if (status != SPAMCLF_OK) {
+    SPAM_FREE(m);
+    return status;
+  }
+  *out = m;
+  return SPAMCLF_OK;
+}
+
+// ---------- Shared memory rings ----------
+
+#define RING_WRAP UINT32_MAX // Length of the marker sending the reader back to offset 0.
+
+long futex(atomic_uint *word, int op, unsigned value, const struct timespec *timeout) {
+  return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/*
+ * Sleeps while *bell holds the given value, for at most RING_SLEEP_MS.
+ */
+void ring_sleep(atomic_uint *bell, unsigned value) {
+  struct timespec timeout = { 0, RING_SLEEP_MS * 1000000L };
+  futex(bell, FUTEX_WAIT, value, &timeout);
+}
+
+/*
+ * Wakes the other side if it is sleeping on the bell. Called after publishing
+ * work; the fence orders the publication before reading the waiting flag, as
+ * the sleeper sets its flag before checking for work one last time.
+ */
+void ring_wake(atomic_uint *bell, atomic_uint *waiting) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiting, memory_order_relaxed)) {
+    atomic_fetch_add(bell, 1);
+    futex(bell, FUTEX_WAKE, INT_MAX, NULL);
+  }
+}
+
+/*
+ * Empty polls before sleeping. Polling only pays off when the other side runs
+ * on another CPU, so single CPU hosts sleep at once.
+ */
+size_t ring_polls(void) {
+  return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_POLLS : 0;
+}
+
+/*
+ * Whether the server of a segment has stopped or its process no longer
+ * exists, e.g. after it was killed and left the segment behind.
+ */
+bool ring_server_gone(ring_segment *segment) {
+  if (atomic_load(&segment->closed)) return true;
+  return kill(segment->server_pid, 0) == -1 && errno == ESRCH;
+}
+
+/*
+ * Bytes taken by a request: its 8 byte length header and the message, padded
+ * to 8 bytes.
+ */
+size_t ring_record_size(size_t len) {
+  return 8 + ((len + 7) & ~(size_t)7);
+}
+
+/*
+ * What a ring server classifies with during one pass over the slots.
+ */
+typedef struct ring_pass {
+  const model *m;
+  uint64_t generation;  // Epoch the model was entered in, for cache keys.
+  stats_shard *shard;   // Optional.
+  const score_shortcuts *shortcuts;  // Optional.
+} ring_pass;
+
+/*
+ * Classifies the requests of one client while its response ring has room.
+ * Returns the number of responses written.
+ */
+size_t serve_slot(ring_slot *slot, const ring_pass *pass) {
+  size_t head = atomic_load_explicit(&slot->request_head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&slot->request_tail, memory_order_acquire);
+  size_t response = atomic_load_explicit(&slot->response_tail, memory_order_relaxed);
+  size_t served = 0;
+  while (head != tail &&
+         response - atomic_load_explicit(&slot->response_head, memory_order_acquire) < RING_RESPONSES) {
+    size_t pos = head % RING_REQUEST_BYTES;
+    uint32_t len;
+    memcpy(&len, slot->requests + pos, sizeof(len));
+    if (len == RING_WRAP) {
+      head += RING_REQUEST_BYTES - pos;
+      continue;
+    }
+    float probability = NAN;
+    if (len <= SPAMCLF_RING_MAX_MESSAGE && pos + ring_record_size(len) <= RING_REQUEST_BYTES) {
+      const char *msg = slot->requests + pos + 8;
+      uint64_t start = pass->shard != NULL ? now_ns() : 0;
+      token_counts counts = {0};
+      float score = pass->shortcuts != NULL
+        ? shortcut_score(pass->shortcuts, pass->generation, pass->m, msg, len, &counts)
+        : classify_score_counted(pass->m, msg, len, &counts);
+      probability = sigmoid(score);
+      if (pass->shard != NULL) {
+        stats_record(pass->shard, now_ns() - start, &counts, score > logit(SPAMCLF_THRESHOLD));
+      }
+      head += ring_record_size(len);
+    } else {
+      head = tail; // Corrupt ring, drop what is left.
+    }
+    slot->responses[response++ % RING_RESPONSES] = probability;
+    served++;
+  }
+  if (served > 0) {
+    atomic_store_explicit(&slot->request_head, head, memory_order_release);
+    atomic_store_explicit(&slot->response_tail, response, memory_order_release);
+    ring_wake(&slot->response_bell, &slot->client_waiting);
+  }
+  return served;
+}
+
+bool ring_requests_pending(ring_segment *segment) {
+  for (size_t i = 0; i < RING_CLIENTS; ++i) {
+    ring_slot *slot = &segment->slots[i];
+    if (atomic_load_explicit(&slot->state, memory_order_acquire) == RING_CLAIMED &&
+        atomic_load_explicit(&slot->request_tail, memory_order_acquire) !=
+        atomic_load_explicit(&slot->request_head, memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Whether a server is alive on the segment under name. Segments that are
+ * partly written or whose server is gone are left behind by a crash.
+ */
+bool ring_name_taken(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) return false;
+  struct stat st;
+  bool taken = false;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ring_segment)) {
+    ring_segment *segment = mmap(NULL, sizeof(ring_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment != MAP_FAILED) {
+      taken = atomic_load_explicit(&segment->magic, memory_order_acquire) == RING_MAGIC &&
+        segment->version == RING_VERSION && !ring_server_gone(segment);
+      munmap(segment, sizeof(ring_segment));
+    }
+  }
+  close(fd);
+  return taken;
+}
+
+/*
+ * Removes the segment under name if it is still the one with the given
+ * inode, and not one created since by another server.
+ */
+void ring_unlink_own(const char *name, const struct stat *own) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1) return;
+  struct stat st;
+  bool same = fstat(fd, &st) == 0 && st.st_dev == own->st_dev && st.st_ino == own->st_ino;
+  close(fd);
+  if (same) shm_unlink(name);
+}
+
+spamclf_status serve_ring_segment(live_model *l, size_t reader, stats_shard *shard,
+                                  const score_shortcuts *shortcuts, const char *name,
+                                  const atomic_bool *stop) {
+  if (ring_name_taken(name)) return SPAMCLF_ERROR_UNAVAILABLE;
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd == -1) return errno == EEXIST ? SPAMCLF_ERROR_UNAVAILABLE : SPAMCLF_ERROR_IO;
+  struct stat own;
+  // The segment is zero filled: every slot is free and every ring empty.
+  if (fstat(fd, &own) != 0 || ftruncate(fd, sizeof(ring_segment)) != 0) {
+    close(fd);
+    shm_unlink(name);
+    return SPAMCLF_ERROR_IO;
+  }
+  ring_segment *segment = mmap(NULL, sizeof(ring_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    ring_unlink_own(name, &own);
+    return SPAMCLF_ERROR_MEMORY;
+  }
+  segment->version = RING_VERSION;
+  segment->server_pid = getpid();
+  atomic_store_explicit(&segment->magic, RING_MAGIC, memory_order_release);
+
+  size_t polls = ring_polls(), idle = 0;
+  while (!atomic_load_explicit(stop, memory_order_relaxed)) {
+    size_t served = 0;
+    ring_pass pass = { .m = live_model_enter(l, reader), .shard = shard,
+                       .shortcuts = shortcuts };
+    pass.generation = atomic_load_explicit(&l->readers[reader].epoch, memory_order_relaxed);
+    for (size_t i = 0; i < RING_CLIENTS; ++i) {
+      if (atomic_load_explicit(&segment->slots[i].state, memory_order_acquire) == RING_CLAIMED) {
+        served += serve_slot(&segment->slots[i], &pass);
+      }
+    }
+    live_model_exit(l, reader);
+    if (served > 0 || ++idle < polls) {
+      if (served > 0) idle = 0;
+      continue;
+    }
+    atomic_store(&segment->server_waiting, 1);
+    unsigned bell = atomic_load(&segment->request_bell);
+    if (!ring_requests_pending(segment)) {
+      ring_sleep(&segment->request_bell, bell);
+    }
+    atomic_store(&segment->server_waiting, 0);
+    idle = 0;
+  }
+
+  atomic_store(&segment->closed, 1);
+  for (size_t i = 0; i < RING_CLIENTS; ++i) {
+    atomic_fetch_add(&segment->slots[i].response_bell, 1);
+    futex(&segment->slots[i].response_bell, FUTEX_WAKE, INT_MAX, NULL);
+  }
+  munmap(segment, sizeof(ring_segment));
+  ring_unlink_own(name, &own);
+  return SPAMCLF_OK;
+}
+
+/*
+ * Creates the shared memory segment name (e.g. "/spamclf") and classifies
+ * the messages of its clients with the model published in l until *stop is
+ * set. The server busy-polls the rings while requests keep coming and sleeps
+ * on a futex when they stop. A segment left behind under the same name by a
+ * server that is gone is replaced, but a live server keeps its name and
+ * SPAMCLF_ERROR_UNAVAILABLE is returned. With stats, every message is recorded in a metrics shard, and
+ * with shortcuts, repeated messages and near-duplicates are answered from
+ * them.
+ */
+spamclf_status serve_ring(live_model *l, classify_stats *stats, const score_shortcuts *shortcuts,
+                          const char *name, const atomic_bool *stop) {
+  ptrdiff_t reader = live_reader_register(l);
+  if (reader == -1) return SPAMCLF_ERROR_ARGUMENT;
+  stats_shard *shard = stats != NULL ? stats_register(stats) : NULL;
+  spamclf_status status = serve_ring_segment(l, reader, shard, shortcuts, name, stop);
+  stats_unregister(shard);
+  live_reader_unregister(l, reader);
+  return status;
+}
+
+// ---------- Public API ----------
+
+const char *spamclf_strerror(spamclf_status status) {
+  switch (status) {
+  case SPAMCLF_OK: return "success";
+  case SPAMCLF_ERROR_ARGUMENT: return "invalid argument";
+  case SPAMCLF_ERROR_IO: return "failed to open or write file";
+  case SPAMCLF_ERROR_FORMAT: return "truncated or malformed model file";
+  case SPAMCLF_ERROR_VERSION: return "unsupported model version";
+  case SPAMCLF_ERROR_INDEX: return "failed to build the vocabulary index";
+  case SPAMCLF_ERROR_MEMORY: return "memory allocation failed";
+  case SPAMCLF_ERROR_UNAVAILABLE: return "no ring server or free client slot";
+  }
+  return "unknown error";
+}
+
+spamclf_status spamclf_load(const char *model_path, spamclf_model **out) {
+  if (model_path == NULL || out == NULL) return SPAMCLF_ERROR_ARGUMENT;
+  *out = NULL;
+  select_kernels();
+
+  model *m = SPAM_MALLOC(sizeof(model));
+  if (m == NULL) return SPAMCLF_ERROR_MEMORY;
+  spamclf_status status = read_model(m, model_path);
+  if (status != SPAMCLF_OK) {
+    SPAM_FREE(m);
+    return status;
+  }
+  *out = m;
+  return SPAMCLF_OK;
+}
+
+void spamclf_free(spamclf_model *m) {
+  if (m == NULL) return;
+  free_model(m);
+  SPAM_FREE(m);
+}
+
+float spamclf_score(const spamclf_model *m, const char *msg, size_t len) {
+  return classify_score(m, msg, len);
+}
+
+float spamclf_classify(const spamclf_model *m, const char *msg, size_t len) {
+  return classify(m, msg, len);
+}
+
+bool spamclf_is_spam(const spamclf_model *m, const char *msg, size_t len) {
+  return classify_score(m, msg, len) > logit(SPAMCLF_THRESHOLD);
+}
+
+spamclf_status spamclf_ring_connect(const char *name, spamclf_ring **out) {
+  if (name == NULL || out == NULL) return SPAMCLF_ERROR_ARGUMENT;
+  *out = NULL;
+
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) return errno == ENOENT ? SPAMCLF_ERROR_UNAVAILABLE : SPAMCLF_ERROR_IO;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return SPAMCLF_ERROR_IO;
+  }
+  if ((size_t)st.st_size < sizeof(ring_segment)) {
+    close(fd);
+    return st.st_size == 0 ? SPAMCLF_ERROR_UNAVAILABLE : SPAMCLF_ERROR_FORMAT;
+  }
+  ring_segment *segment = mmap(NULL, sizeof(ring_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) return SPAMCLF_ERROR_MEMORY;
+
+  spamclf_status status = SPAMCLF_ERROR_UNAVAILABLE;
+  uint32_t magic = atomic_load_explicit(&segment->magic, memory_order_acquire);
+  if (magic != RING_MAGIC) {
+    status = magic == 0 ? SPAMCLF_ERROR_UNAVAILABLE : SPAMCLF_ERROR_FORMAT;
+  } else if (segment->version != RING_VERSION) {
+    status = SPAMCLF_ERROR_VERSION;
+  } else if (!ring_server_gone(segment)) {
+    for (size_t i = 0; i < RING_CLIENTS; ++i) {
+      unsigned expected = RING_FREE;
+      if (atomic_compare_exchange_strong(&segment->slots[i].state, &expected, RING_CLAIMED)) {
+        ring_client *ring = SPAM_MALLOC(sizeof(ring_client));
+        if (ring == NULL) {
+          atomic_store(&segment->slots[i].state, RING_FREE);
+          status = SPAMCLF_ERROR_MEMORY;
+          break;
+        }
+        *ring = (ring_client){ .segment = segment, .slot = &segment->slots[i], .polls = ring_polls() };
+        *out = ring;
+        return SPAMCLF_OK;
+      }
+    }
+  }
+  munmap(segment, sizeof(ring_segment));
+  return status;
+}
+
+void spamclf_ring_disconnect(spamclf_ring *ring) {
+  if (ring == NULL) return;
+  // The server must be done with the slot before another client claims it.
+  float probability;
+  while (ring->pending > 0 && spamclf_ring_receive(ring, &probability) == SPAMCLF_OK) {}
+  atomic_store(&ring->slot->state, RING_FREE);
+  munmap(ring->segment, sizeof(ring_segment));
+  SPAM_FREE(ring);
+}
+
+spamclf_status spamclf_ring_submit(spamclf_ring *ring, const char *msg, size_t len) {
+  if (ring == NULL || (msg == NULL && len > 0) || len > SPAMCLF_RING_MAX_MESSAGE) {
+    return SPAMCLF_ERROR_ARGUMENT;
+  }
+  ring_slot *slot = ring->slot;
+  size_t tail = atomic_load_explicit(&slot->request_tail, memory_order_relaxed);
+  size_t pos = tail % RING_REQUEST_BYTES;
+  size_t size = ring_record_size(len);
+  size_t needed = pos + size > RING_REQUEST_BYTES ? RING_REQUEST_BYTES - pos + size : size;
+  for (size_t polls = 0;
+       tail + needed - atomic_load_explicit(&slot->request_head, memory_order_acquire) > RING_REQUEST_BYTES;
+       ++polls) {
+    if (polls < ring->polls) continue;
+    if (ring_server_gone(ring->segment)) return SPAMCLF_ERROR_UNAVAILABLE;
+    atomic_store(&slot->client_waiting, 1);
+    unsigned bell = atomic_load(&slot->response_bell);
+    if (tail + needed - atomic_load(&slot->request_head) > RING_REQUEST_BYTES) {
+      ring_sleep(&slot->response_bell, bell);
+    }
+    atomic_store(&slot->client_waiting, 0);
+  }
+
+  if (pos + size > RING_REQUEST_BYTES) {
+    uint32_t wrap = RING_WRAP;
+    memcpy(slot->requests + pos, &wrap, sizeof(wrap));
+    tail += RING_REQUEST_BYTES - pos;
+    pos = 0;
+  }
+  uint32_t header = (uint32_t)len;
+  memcpy(slot->requests + pos, &header, sizeof(header));
+  memcpy(slot->requests + pos + 8, msg, len);
+  atomic_store_explicit(&slot->request_tail, tail + size, memory_order_release);
+  ring->pending++;
+  ring_wake(&ring->segment->request_bell, &ring->segment->server_waiting);
+  return SPAMCLF_OK;
+}
+
+spamclf_status spamclf_ring_receive(spamclf_ring *ring, float *probability) {
+  if (ring == NULL || probability == NULL || ring->pending == 0) return SPAMCLF_ERROR_ARGUMENT;
+  ring_slot *slot = ring->slot;
+  size_t head = atomic_load_explicit(&slot->response_head, memory_order_relaxed);
+  for (size_t polls = 0; atomic_load_explicit(&slot->response_tail, memory_order_acquire) == head; ++polls) {
+    if (polls < ring->polls) continue;
+    if (ring_server_gone(ring->segment)) return SPAMCLF_ERROR_UNAVAILABLE;
+    atomic_store(&slot->client_waiting, 1);
+    unsigned bell = atomic_load(&slot->response_bell);
+    if (atomic_load(&slot->response_tail) == head) {
+      ring_sleep(&slot->response_bell, bell);
+    }
+    atomic_store(&slot->client_waiting, 0);
+  }
+  *probability = slot->responses[head % RING_RESPONSES];
+  atomic_store_explicit(&slot->response_head, head + 1, memory_order_release);
+  ring->pending--;
+  return SPAMCLF_OK;
+}
+
+spamclf_status spamclf_ring_classify(spamclf_ring *ring, const char *msg, size_t len,
+                                     float *probability) {
+  if (probability == NULL) return SPAMCLF_ERROR_ARGUMENT;
+  spamclf_status status = spamclf_ring_submit(ring, msg, len);
+  if (status != SPAMCLF_OK) return status;
+  return spamclf_ring_receive(ring, probability);
+}
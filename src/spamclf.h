@@ -0,0 +1,114 @@
+#ifndef SPAMCLF_H
+#define SPAMCLF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * libspamclf: spam message classification with models trained by the spam
+ * command line program.
+ *
+ * A loaded model is read-only, so any number of threads can classify with
+ * one shared handle at once without locking. Classification makes no heap
+ * allocation. Functions that can fail return a status code instead of
+ * exiting.
+ *
+ *   spamclf_model *model;
+ *   if (spamclf_load("model.bin", &model) == SPAMCLF_OK) {
+ *     bool spam = spamclf_is_spam(model, msg, strlen(msg));
+ *     spamclf_free(model);
+ *   }
+ */
+
+#if defined(__GNUC__)
+#define SPAMCLF_API __attribute__((visibility("default")))
+#else
+#define SPAMCLF_API
+#endif
+
+#define SPAMCLF_THRESHOLD 0.45f // Probability above which a message is spam.
+#define SPAMCLF_RING_MAX_MESSAGE (1 << 16) // Longest message sent through a ring.
+
+typedef struct spamclf_model spamclf_model;
+typedef struct spamclf_ring spamclf_ring;
+
+typedef enum spamclf_status {
+  SPAMCLF_OK = 0,
+  SPAMCLF_ERROR_ARGUMENT, // A required argument was NULL or out of range.
+  SPAMCLF_ERROR_IO,       // A file could not be opened or written, see errno.
+  SPAMCLF_ERROR_FORMAT,   // The model file is truncated or malformed.
+  SPAMCLF_ERROR_VERSION,  // The model file was saved by a newer version.
+  SPAMCLF_ERROR_INDEX,    // No vocabulary index could be built.
+  SPAMCLF_ERROR_MEMORY,   // An allocation failed.
+  SPAMCLF_ERROR_UNAVAILABLE, // No ring server is running or it has no free client slot.
+} spamclf_status;
+
+/*
+ * Description of a status code.
+ */
+SPAMCLF_API const char *spamclf_strerror(spamclf_status status);
+
+/*
+ * Loads the model saved at model_path. On success *model is set to a handle
+ * to release with spamclf_free().
+ */
+SPAMCLF_API spamclf_status spamclf_load(const char *model_path, spamclf_model **model);
+
+SPAMCLF_API void spamclf_free(spamclf_model *model);
+
+/*
+ * Linear score (log-odds of spam) of a message of len bytes. The message
+ * need not be NUL terminated.
+ */
+SPAMCLF_API float spamclf_score(const spamclf_model *model, const char *msg, size_t len);
+
+/*
+ * Spam probability of a message.
+ */
+SPAMCLF_API float spamclf_classify(const spamclf_model *model, const char *msg, size_t len);
+
+/*
+ * Whether the spam probability of a message is above SPAMCLF_THRESHOLD.
+ */
+SPAMCLF_API bool spamclf_is_spam(const spamclf_model *model, const char *msg, size_t len);
+
+/*
+ * Client of a classifier serving on the same host through shared memory
+ * (spam --serve NAME). Messages are copied into a ring buffer shared with the
+ * server, and probabilities come back in a second ring, in order. A client
+ * handle belongs to one thread; open one per thread. Calls waiting on a
+ * server that stopped or died fail with SPAMCLF_ERROR_UNAVAILABLE.
+ *
+ *   spamclf_ring *ring;
+ *   if (spamclf_ring_connect("/spamclf", &ring) == SPAMCLF_OK) {
+ *     float probability;
+ *     spamclf_ring_classify(ring, msg, strlen(msg), &probability);
+ *     spamclf_ring_disconnect(ring);
+ *   }
+ */
+SPAMCLF_API spamclf_status spamclf_ring_connect(const char *name, spamclf_ring **ring);
+
+/*
+ * Waits for any outstanding results and releases the client slot.
+ */
+SPAMCLF_API void spamclf_ring_disconnect(spamclf_ring *ring);
+
+/*
+ * Queues a message of at most SPAMCLF_RING_MAX_MESSAGE bytes without waiting
+ * for its result, blocking while the ring is full. A client pipelining
+ * messages this way has to receive results as it goes.
+ */
+SPAMCLF_API spamclf_status spamclf_ring_submit(spamclf_ring *ring, const char *msg, size_t len);
+
+/*
+ * Spam probability of the oldest submitted message without a result yet.
+ */
+SPAMCLF_API spamclf_status spamclf_ring_receive(spamclf_ring *ring, float *probability);
+
+/*
+ * Spam probability of a message, computed by the server.
+ */
+SPAMCLF_API spamclf_status spamclf_ring_classify(spamclf_ring *ring, const char *msg, size_t len,
+                                                 float *probability);
+
+#endif
@@ -0,0 +1,582 @@
+#ifndef SPAMCLF_INTERNAL_H
+#define SPAMCLF_INTERNAL_H
+
+/*
+ * Internals of libspamclf, shared with the command line program which trains
+ * models on top of them. Not part of the public API (see spamclf.h).
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "spamclf.h"
+
+/*
+ * Every heap allocation, stb_ds's included, goes through these hooks. Define
+ * all four on the command line to route them to another allocator. The
+ * defaults call the C library and count allocations.
+ */
+#ifndef SPAM_MALLOC
+#define SPAM_COUNT_ALLOCATIONS 1
+void *spam_malloc(size_t size);
+void *spam_calloc(size_t n, size_t size);
+void *spam_realloc(void *ptr, size_t size);
+#define SPAM_MALLOC(size) spam_malloc(size)
+#define SPAM_CALLOC(n, size) spam_calloc(n, size)
+#define SPAM_REALLOC(ptr, size) spam_realloc(ptr, size)
+#define SPAM_FREE(ptr) free(ptr)
+#endif
+
+#define STBDS_REALLOC(context, ptr, size) SPAM_REALLOC(ptr, size)
+#define STBDS_FREE(context, ptr) SPAM_FREE(ptr)
+#include "stb_ds.h"
+
+// ---------- Configuration ----------
+
+#define SMALL_BUFFER_SIZE 256
+#define BUFFER_SIZE 1024
+
+#define LEGACY_VOCABULARY_SIZE 8123 // No. of tokens in models saved without a header.
+#define TOKEN_MIN_LENGTH 3
+#define TOKEN_MAX_LENGTH 12
+#define POOL_PREFIX_MAX 5 // Longest LEB128 length prefix of a pooled token.
+
+#define MODEL_MAGIC 0x4d4c5053 // "SPLM"
+#define MODEL_VERSION 7
+
+#define MPHF_BUCKET_LOAD 5        // Average no. of keys per bucket of the vocabulary index.
+#define MPHF_MAX_DISPLACEMENT (1u << 20)
+#define MPHF_MAX_SEEDS 64
+#define MPHF_DIRECT 0x80000000u   // Bucket stores its only key's slot instead of a displacement.
+
+#define BLOOM_BITS_PER_TOKEN 12   // Size of the vocabulary Bloom filter.
+#define BLOOM_BLOCK_WORDS 8       // 64-bit words per block, one cache line.
+
+#define HASH_BITS 16 // Default size of the hashed feature space (2^HASH_BITS buckets).
+#define BIGRAM_SEED 0x62696772616d73ULL
+#define SIMHASH_SEED 0x73696d68617368ULL
+
+// Optional feature streams, stored in the model flags.
+#define FEATURE_BIGRAMS 0x1
+#define FEATURE_CHAR_NGRAMS 0x2
+#define HASHED_FEATURES (FEATURE_BIGRAMS | FEATURE_CHAR_NGRAMS)
+
+#define CHAR_NGRAM_MIN 3
+#define CHAR_NGRAM_MAX 5
+#define CHAR_NGRAM_SEED 0x63686172676d73ULL
+
+#define RING_MAGIC 0x474e5253 // "SRNG"
+#define RING_VERSION 2
+#define RING_CLIENTS 16                                  // Client slots of a ring server.
+#define RING_REQUEST_BYTES (4 * SPAMCLF_RING_MAX_MESSAGE) // Request ring size of a client.
+#define RING_RESPONSES (RING_REQUEST_BYTES / 8)           // Response ring size of a client.
+#define RING_POLLS 4096    // Empty polls before sleeping on a futex, with a spare CPU.
+#define RING_SLEEP_MS 100  // Longest futex sleep, after which stop flags are checked.
+
+// ---------- Types ----------
+
+/*
+ * Dense vector kernels. One implementation per instruction set level is
+ * compiled in, and select_kernels() picks the widest one the CPU supports.
+ *
+ *   dot(x, y)                  sum of x[i] * y[i]
+ *   axpy(a, x, y)              y[i] += a * x[i]  (x may alias y)
+ *   reg_update(w, g, lr, l2)   w[i] -= lr * (g[i] + l2 * w[i])
+ *   sigmoid(z, p)              p[i] = 1 / (1 + e^-z[i]), approximated
+ */
+typedef struct kernels {
+  const char *name;
+  float (*dot)(const float *x, const float *y, size_t n);
+  void (*axpy)(float a, const float *x, float *y, size_t n);
+  void (*reg_update)(float *w, const float *g, float learning_rate, float lambda, size_t n);
+  void (*sigmoid)(const float *z, float *p, size_t n);
+} kernels;
+
+/*
+ * Cache friendly open-addressing (linear probing) hash table of tokens. Each
+ * slot is 32 bytes, two per cache line, and keeps a 32-bit hash fingerprint,
+ * the token length and the token itself inline, so a probe touches no other
+ * memory. Tokens longer than TOKEN_INLINE_MAX are compared through the string
+ * pool instead, using the value as index into the offsets array. Lookups take
+ * (pointer, length) and need no NUL terminated copy.
+ */
+#define TOKEN_INLINE_MAX 23
+#define TOKEN_LONG 0xff
+
+typedef struct token_slot {
+  uint32_t fingerprint;  // High hash bits, never 0. 0 marks an empty slot.
+  uint32_t value;
+  uint8_t len;           // TOKEN_LONG for tokens kept only in the pool.
+  char key[TOKEN_INLINE_MAX];
+} token_slot;
+
+typedef struct token_table {
+  token_slot *slots;
+  size_t mask;
+  size_t count;
+} token_table;
+
+/*
+ * Minimal perfect hash function (hash and displace) mapping a fixed set of n
+ * keys onto the slots 0..n-1. Keys are split into buckets of about
+ * MPHF_BUCKET_LOAD keys, and each bucket stores a displacement that sends all
+ * of its keys to distinct free slots. Buckets holding a single key store its
+ * slot directly, which keeps the search short as the table fills up.
+ */
+typedef struct mphf {
+  uint64_t seed;
+  uint32_t size;
+  uint32_t buckets;
+  uint32_t *displacements;
+} mphf;
+
+/*
+ * Blocked Bloom filter over the vocabulary, checked before the vocabulary
+ * index so that most tokens outside it are turned away after touching a
+ * single cache line. A key picks a block with the low half of its index hash
+ * and sets one bit in each word of it with the high half, so the filter
+ * needs no hash of its own. A filter without blocks lets every key through.
+ */
+typedef struct bloom_filter {
+  uint32_t blocks;
+  uint64_t *words;       // BLOOM_BLOCK_WORDS per block, aligned to 64 bytes.
+  void *allocation;
+} bloom_filter;
+
+/*
+ * Features are laid out as one weight, IDF and count per vocabulary token,
+ * followed by 2^hash_bits buckets for hashed features (bigrams, character
+ * n-grams) when any hashed feature stream is enabled.
+ */
+typedef struct spamclf_model {
+  size_t vocabulary_size;
+  size_t documents;      // No. of messages the IDF is computed over.
+  uint32_t flags;        // FEATURE_* streams the model was trained with.
+  uint32_t hash_bits;
+  float *weights;
+  float bias;
+  float *idf;
+  uint32_t *counts;      // Document frequency of each feature, NULL for models saved before version 7.
+  char *pool;            // Vocabulary tokens (see pool_append).
+  uint32_t *offsets;     // Pool offset of each vocabulary token.
+  mphf index;            // Maps each token to its vocabulary index.
+  bloom_filter bloom;    // Tokens of the vocabulary, hashed as for the index.
+} model;
+
+/*
+ * Many models loaded into one process around a single vocabulary. Tokens of
+ * every model are interned into a shared string pool and index, and each
+ * model keeps only its weights: the product of IDF and weight of each token
+ * of its vocabulary, found through a bitmap of the shared tokens it has and
+ * the rank of the token's bit, and its hashed buckets. Memory grows with the
+ * distinct tokens and the weights, plus a bit per shared token and model. A
+ * message is tokenized and looked up once (registry_tokenize())
+ * and then scored against any of the models (registry_score()), with the
+ * same score as classify_score() on the model alone.
+ *
+ * Models are added with registry_add(), and registry_index() has to be
+ * called before scoring. Token IDs are slots of the shared index once it is
+ * built, and positions in the pool while models are being added.
+ */
+typedef struct tenant_model {
+  uint32_t flags;
+  uint32_t hash_bits;
+  float bias;
+  size_t vocabulary_size;  // Tokens of the model's own vocabulary.
+  size_t span;             // Shared tokens covered by the bitmap.
+  uint64_t *present;       // Bit of each shared token, set if the model has it.
+  uint32_t *ranks;         // Bits set before each word of present.
+  float *weights;          // IDF times weight of each token the model has, by ID.
+  float *hashed;           // IDF times weight of each hashed bucket.
+} tenant_model;
+
+typedef struct model_registry {
+  char *pool;              // Shared tokens, in slot order once indexed.
+  uint32_t *offsets;       // Pool offset of each shared token, stb_ds array.
+  token_table interned;    // Token IDs while models are being added.
+  mphf index;
+  bloom_filter bloom;
+  bool indexed;
+  uint32_t flags;          // Feature streams of any of the models.
+  tenant_model *models;    // stb_ds array.
+} model_registry;
+
+/*
+ * A message split for registry_score(). The arrays are reused by the next
+ * registry_tokenize() into the same message.
+ */
+typedef struct registry_message {
+  uint32_t *ids;           // Shared tokens of the message, in order.
+  uint64_t *hashes;        // hash_bytes() of each, for bigrams.
+  uint64_t *char_ngrams;   // Hashes of every character n-gram, before bucketing.
+  size_t tokens;           // Tokens looked up, known or not.
+} registry_message;
+
+typedef struct token_counts {
+  size_t tokens;   // Tokens looked up in the vocabulary.
+  size_t unknown;  // Tokens not found.
+} token_counts;
+
+/*
+ * Classifier metrics. Every recording thread owns a shard, so recording is a
+ * handful of uncontended relaxed stores, and readers merge the shards on
+ * demand. Latencies in nanoseconds go into an HDR style log-linear histogram:
+ * values below 2^STATS_SUB_BITS have a bucket each, and every higher power
+ * of two is split into 2^STATS_SUB_BITS buckets, which bounds the relative
+ * error of a quantile by 2^-STATS_SUB_BITS.
+ */
+#define STATS_SUB_BITS 5
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+#define STATS_SHARDS 64
+
+typedef struct stats_shard {
+  _Alignas(64) atomic_bool used;
+  _Atomic uint64_t messages;
+  _Atomic uint64_t spam;
+  _Atomic uint64_t tokens;
+  _Atomic uint64_t unknown_tokens;
+  _Atomic uint64_t latency_ns;  // Sum of the recorded latencies.
+  _Atomic uint64_t latency[STATS_BUCKETS];
+} stats_shard;
+
+typedef struct classify_stats {
+  stats_shard shards[STATS_SHARDS];
+} classify_stats;
+
+typedef struct stats_snapshot {
+  uint64_t messages;
+  uint64_t spam;
+  uint64_t tokens;
+  uint64_t unknown_tokens;
+  uint64_t latency_ns;
+  uint64_t latency[STATS_BUCKETS];
+} stats_snapshot;
+
+/*
+ * Bounded cache of message scores, for bursts of identical messages. Keys are
+ * 128-bit hashes of the lowercase message (see cache_key()), so no text is
+ * kept. The cache is split into shards, each with its own lock, hash chains
+ * and least recently used list threaded through a fixed entry array.
+ */
+#define CACHE_SHARDS 16
+
+typedef struct cache_entry {
+  uint64_t key[2];
+  float score;
+  uint32_t chain;      // Next entry of the same hash bucket.
+  uint32_t prev, next; // Neighbours in the LRU list, most recent first.
+} cache_entry;
+
+typedef struct cache_shard {
+  _Alignas(64) pthread_mutex_t lock;
+  cache_entry *entries;
+  uint32_t *buckets;   // First entry of each hash chain.
+  uint32_t mask;
+  uint32_t capacity;
+  uint32_t count;
+  uint32_t head, tail; // Most and least recently used entries.
+  uint64_t hits;
+  uint64_t misses;
+} cache_shard;
+
+typedef struct result_cache {
+  uint64_t seed;       // Random per process, so keys cannot be precomputed.
+  cache_shard shards[CACHE_SHARDS];
+} result_cache;
+
+/*
+ * Scores of recently classified messages keyed by the 64-bit SimHash of
+ * their tokens (see message_simhash()), for campaign variants that only
+ * differ in a word or two. Messages whose hashes are within max_distance bits
+ * share a score. The hash is cut into NEAR_DUP_BANDS 16-bit bands, and each
+ * band has a table of NEAR_DUP_WAYS-way buckets, 64 bytes each, that a
+ * score is stored in under the band's value. Two hashes within 2 *
+ * NEAR_DUP_BANDS - 1 bits agree on a band to within one bit, so probing every
+ * band's bucket and those of its 16 one-bit neighbours finds them.
+ */
+#define NEAR_DUP_BANDS 4
+#define NEAR_DUP_WAYS 4
+#define NEAR_DUP_MIN_TOKENS 6  // Fewer tokens make SimHash too coarse to trust.
+#define NEAR_DUP_DISTANCE 6    // Default max_distance, see bench_near_dup().
+
+typedef struct near_dup_slot {
+  uint64_t simhash;
+  uint32_t generation;  // Low bits of the model generation.
+  float score;          // NAN in empty slots.
+} near_dup_slot;
+
+typedef struct near_dup_band {
+  _Alignas(64) pthread_mutex_t lock;
+  near_dup_slot *slots; // NEAR_DUP_WAYS per bucket, most recent first.
+  uint32_t bits;        // log2 of the bucket count.
+  uint64_t hits;        // Lookups that found a score in this band.
+  uint64_t misses;      // Counted in the last band only.
+} near_dup_band;
+
+typedef struct near_dup_index {
+  unsigned max_distance;
+  near_dup_band bands[NEAR_DUP_BANDS];
+} near_dup_index;
+
+/*
+ * Ways a score can be found without classifying a message. Both are
+ * optional; the exact result cache is tried first.
+ */
+typedef struct score_shortcuts {
+  result_cache *cache;
+  near_dup_index *near;
+} score_shortcuts;
+
+/*
+ * A model that can be replaced while other threads classify with it, using
+ * epoch based reclamation. Readers bracket each use with live_model_enter()
+ * and live_model_exit(), which only store their entry epoch in their own
+ * cache line. A publisher swaps the pointer, advances the epoch and frees the
+ * old model once no reader is still inside an older epoch.
+ */
+#define LIVE_READERS 64
+
+typedef struct live_reader {
+  _Alignas(64) _Atomic uint64_t epoch;  // Epoch entered, 0 outside the model.
+  atomic_bool used;
+} live_reader;
+
+typedef struct live_model {
+  _Atomic(model *) current;
+  _Alignas(64) _Atomic uint64_t epoch;
+  live_reader readers[LIVE_READERS];
+  pthread_mutex_t publish;  // Serializes publishers.
+} live_model;
+
+/*
+ * Shared memory segment of a ring server. Each client claims a slot and owns
+ * its two rings, both single producer, single consumer: length prefixed
+ * requests it writes and the server reads, and the probabilities the server
+ * writes back in the same order. Ring positions only grow, and are taken
+ * modulo the ring size.
+ *
+ * A side that finds nothing to do for RING_POLLS polls sets its waiting flag
+ * and sleeps on its bell, a futex word the other side increments (and wakes)
+ * after publishing work if it sees the flag set. The server rings a client's
+ * bell whenever it consumes requests, so a client also sleeps on it while its
+ * request ring is full. Sleeping clients wake every RING_SLEEP_MS to check
+ * that the server process is still alive.
+ */
+enum ring_slot_state { RING_FREE, RING_CLAIMED };
+
+typedef struct ring_slot {
+  _Alignas(64) atomic_uint state;
+  _Alignas(64) atomic_size_t request_head;  // Written by the server.
+  atomic_size_t response_tail;
+  atomic_uint response_bell;
+  _Alignas(64) atomic_size_t request_tail;  // Written by the client.
+  atomic_size_t response_head;
+  atomic_uint client_waiting;
+  _Alignas(64) char requests[RING_REQUEST_BYTES];
+  float responses[RING_RESPONSES];
+} ring_slot;
+
+typedef struct ring_segment {
+  atomic_uint magic;  // Stored once the segment is initialized.
+  uint32_t version;
+  int32_t server_pid;
+  atomic_uint closed;
+  _Alignas(64) atomic_uint request_bell;
+  atomic_uint server_waiting;
+  ring_slot slots[RING_CLIENTS];
+} ring_segment;
+
+typedef struct spamclf_ring {
+  ring_segment *segment;
+  ring_slot *slot;
+  size_t pending;  // Submitted messages without a received result.
+  size_t polls;    // Empty polls before sleeping, see ring_polls().
+} ring_client;
+
+// ---------- Memory ----------
+
+#ifdef SPAM_COUNT_ALLOCATIONS
+extern atomic_size_t allocations; // No. of allocations made through the hooks.
+#endif
+
+char *str_dup(const char *str);
+
+// ---------- Utilities ----------
+
+uint64_t mix64(uint64_t x);
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+
+// ---------- Kernels ----------
+
+extern bool exact_sigmoid;
+extern kernels kernel;
+extern const kernels kernel_levels[];
+extern const size_t kernel_level_count;
+#define KERNEL_LEVELS kernel_level_count
+
+float sigmoidf(float x);
+float sigmoid_approx(float z);
+float sigmoid(float z);
+float logit(float p);
+bool kernel_supported(const kernels *k);
+void sigmoid_batch(const float *z, float *p, size_t n);
+void select_kernels(void);
+
+// ---------- NLP ----------
+
+spamclf_status read_stop_words(const char *path, char ***words);
+void free_stop_words(char ***words);
+bool accept_string(char **const *stop_words, const char *str);
+
+/*
+ * Runs body for every token of a message of len bytes that is between
+ * TOKEN_MIN_LENGTH and TOKEN_MAX_LENGTH long, with the token NUL terminated
+ * in buf (BUFFER_SIZE bytes) and its length in token_len. The message is
+ * lowercased on the fly and split as by extract_token_words(): punctuation is
+ * skipped, spaces and parentheses end a token, and digits and repeated
+ * characters are dropped.
+ */
+#define for_each_token(msg, len, buf, token_len, body) do {              \
+    token_len = 0;                                                      \
+    char c_ = '\0', before_;                                            \
+    for (size_t i_ = 0; i_ <= (len); ++i_) {                            \
+      before_ = c_;                                                     \
+      c_ = i_ < (len) ? (char)tolower((unsigned char)(msg)[i_]) : '\0'; \
+      if (c_ == '.' || c_ == ',' || c_ == '?' || c_ == '!' || c_ == ':' || c_ == '"') continue; \
+      if (c_ == ' ' || c_ == '(' || c_ == ')' || c_ == '\0') {           \
+        (buf)[token_len] = '\0';                                         \
+        if (token_len >= TOKEN_MIN_LENGTH && token_len <= TOKEN_MAX_LENGTH) { \
+          body                                                          \
+        }                                                               \
+        token_len = 0;                                                  \
+        if (c_ == '\0') break;                                          \
+      } else if (!isdigit((unsigned char)c_) && c_ != before_ && token_len < BUFFER_SIZE - 1) { \
+        (buf)[token_len++] = c_;                                        \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+// ---------- String pool ----------
+
+uint32_t pool_append(char **pool, const char *token, size_t len);
+const char *pool_token(const char *pool, uint32_t offset, size_t *len);
+const char *pool_token_checked(const char *pool, size_t pool_size, size_t offset, size_t *len);
+ptrdiff_t token_table_find(const token_table *t, const char *pool, const uint32_t *offsets,
+                           const char *token, size_t len);
+ptrdiff_t token_table_find_hashed(const token_table *t, const char *pool, const uint32_t *offsets,
+                                  const char *token, size_t len, uint64_t hash);
+spamclf_status token_table_insert(token_table *t, const char *pool, const uint32_t *offsets,
+                                  const char *token, size_t len, uint32_t value);
+void free_token_table(token_table *t);
+
+// ---------- Minimal perfect hash ----------
+
+uint32_t mphf_slot(const mphf *h, const char *key, size_t len);
+uint32_t mphf_slot_hashed(const mphf *h, uint64_t hash);
+spamclf_status build_mphf(mphf *h, const char *pool, const uint32_t *offsets, size_t n, uint64_t seed);
+spamclf_status index_tokens(mphf *h, const char *pool, const uint32_t *offsets, size_t n);
+void free_mphf(mphf *h);
+
+// ---------- Bloom filter ----------
+
+uint32_t bloom_blocks(size_t n);
+spamclf_status bloom_init(bloom_filter *b, uint32_t blocks);
+void bloom_add(bloom_filter *b, uint64_t hash);
+bool bloom_may_contain(const bloom_filter *b, uint64_t hash);
+spamclf_status build_token_bloom(bloom_filter *b, const char *pool, const uint32_t *offsets,
+                                 size_t n, uint64_t seed);
+void free_bloom(bloom_filter *b);
+
+// ---------- Model ----------
+
+const char *vocabulary_token(const model *m, size_t i, size_t *len);
+size_t hashed_buckets(const model *m);
+size_t feature_count(const model *m);
+uint64_t bigram_hash(uint64_t previous, uint64_t current);
+size_t bigram_bucket(const model *m, uint64_t previous, uint64_t current);
+spamclf_status resize_model(model *m, size_t vocabulary_size);
+void free_model(model *m);
+ptrdiff_t find_indexed_token(const mphf *index, const bloom_filter *bloom, const char *pool,
+                             const uint32_t *offsets, const char *token, size_t len);
+ptrdiff_t lookup_token(const model *m, const char *token, size_t len);
+spamclf_status build_vocabulary_bloom(model *m);
+spamclf_status index_vocabulary(model *m);
+spamclf_status read_model(model *m, const char *path);
+spamclf_status write_model(const model *m, const char *path);
+float classify_score_counted(const model *m, const char *msg, size_t len, token_counts *counts);
+float classify_score(const model *m, const char *msg, size_t len);
+float classify(const model *m, const char *msg, size_t len);
+
+// ---------- Model registry ----------
+
+spamclf_status tenant_pack(tenant_model *t, const float *dense, size_t span);
+ptrdiff_t tenant_rank(const tenant_model *t, uint32_t id);
+spamclf_status registry_add(model_registry *r, const model *m, size_t *id);
+spamclf_status registry_load(model_registry *r, const char *path, size_t *id);
+spamclf_status registry_index(model_registry *r);
+void free_registry(model_registry *r);
+size_t registry_memory(const model_registry *r);
+void registry_tokenize(const model_registry *r, const char *msg, size_t len, registry_message *t);
+float registry_score(const model_registry *r, size_t id, const registry_message *t);
+void free_registry_message(registry_message *t);
+
+// ---------- Metrics ----------
+
+uint64_t now_ns(void);
+stats_shard *stats_register(classify_stats *s);
+void stats_unregister(stats_shard *shard);
+void stats_record(stats_shard *shard, uint64_t latency_ns, const token_counts *counts, bool spam);
+size_t histogram_bucket(uint64_t value);
+uint64_t histogram_value(size_t bucket);
+void stats_merge(const classify_stats *s, stats_snapshot *out);
+uint64_t stats_quantile(const stats_snapshot *snapshot, double q);
+void write_stats(const stats_snapshot *snapshot, FILE *out);
+
+// ---------- Result cache ----------
+
+uint64_t lower_word(uint64_t w);
+void cache_key(const result_cache *c, const char *msg, size_t len, uint64_t generation,
+               uint64_t key[2]);
+spamclf_status result_cache_init(result_cache *c, size_t capacity);
+void result_cache_free(result_cache *c);
+bool result_cache_get(result_cache *c, const uint64_t key[2], float *score);
+void result_cache_put(result_cache *c, const uint64_t key[2], float score);
+void result_cache_counts(result_cache *c, uint64_t *hits, uint64_t *misses);
+void write_cache_stats(result_cache *c, FILE *out);
+
+// ---------- Near-duplicates ----------
+
+uint64_t message_simhash(const char *msg, size_t len, size_t *tokens);
+spamclf_status near_dup_init(near_dup_index *n, size_t capacity, unsigned max_distance);
+void near_dup_free(near_dup_index *n);
+bool near_dup_get(near_dup_index *n, uint64_t simhash, uint64_t generation, float *score);
+void near_dup_put(near_dup_index *n, uint64_t simhash, uint64_t generation, float score);
+void near_dup_counts(near_dup_index *n, uint64_t *hits, uint64_t *misses);
+void write_near_dup_stats(near_dup_index *n, FILE *out);
+float shortcut_score(const score_shortcuts *s, uint64_t generation, const model *m,
+                     const char *msg, size_t len, token_counts *counts);
+
+// ---------- Model reload ----------
+
+void live_model_init(live_model *l, model *m);
+void live_model_free(live_model *l);
+ptrdiff_t live_reader_register(live_model *l);
+void live_reader_unregister(live_model *l, size_t reader);
+const model *live_model_enter(live_model *l, size_t reader);
+void live_model_exit(live_model *l, size_t reader);
+void live_model_publish(live_model *l, model *m);
+spamclf_status load_live_model(const char *path, model **out);
+
+// ---------- Shared memory rings ----------
+
+spamclf_status serve_ring(live_model *l, classify_stats *stats, const score_shortcuts *shortcuts,
+                          const char *name, const atomic_bool *stop);
+
+#endif